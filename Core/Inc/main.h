@@ -59,6 +59,42 @@ void Error_Handler(void);
 
 /* Private defines -----------------------------------------------------------*/
 /* USER CODE BEGIN Private defines */
+#define UART1_DTR_Pin GPIO_PIN_4
+#define UART1_DTR_GPIO_Port GPIOA
+#define UART1_RTS_Pin GPIO_PIN_5
+#define UART1_RTS_GPIO_Port GPIOA
+#define UART2_DTR_Pin GPIO_PIN_6
+#define UART2_DTR_GPIO_Port GPIOA
+#define UART3_DTR_Pin GPIO_PIN_12
+#define UART3_DTR_GPIO_Port GPIOB
+#define UART1_DCD_Pin GPIO_PIN_5
+#define UART1_DCD_GPIO_Port GPIOB
+#define UART1_DSR_Pin GPIO_PIN_6
+#define UART1_DSR_GPIO_Port GPIOB
+#define UART1_RI_Pin GPIO_PIN_7
+#define UART1_RI_GPIO_Port GPIOB
+#define UART1_CTS_Pin GPIO_PIN_8
+#define UART1_CTS_GPIO_Port GPIOA
+#define UART2_DCD_Pin GPIO_PIN_8
+#define UART2_DCD_GPIO_Port GPIOB
+#define UART2_DSR_Pin GPIO_PIN_9
+#define UART2_DSR_GPIO_Port GPIOB
+#define UART2_RI_Pin GPIO_PIN_7
+#define UART2_RI_GPIO_Port GPIOA
+#define UART3_DCD_Pin GPIO_PIN_0
+#define UART3_DCD_GPIO_Port GPIOB
+#define UART3_DSR_Pin GPIO_PIN_1
+#define UART3_DSR_GPIO_Port GPIOB
+#define UART3_RI_Pin GPIO_PIN_15
+#define UART3_RI_GPIO_Port GPIOB
+#define UART2_CTS_Pin GPIO_PIN_0
+#define UART2_CTS_GPIO_Port GPIOA
+#define UART2_RTS_Pin GPIO_PIN_1
+#define UART2_RTS_GPIO_Port GPIOA
+#define UART3_CTS_Pin GPIO_PIN_13
+#define UART3_CTS_GPIO_Port GPIOB
+#define UART3_RTS_Pin GPIO_PIN_14
+#define UART3_RTS_GPIO_Port GPIOB
 
 /* USER CODE END Private defines */
 
@@ -33,12 +33,19 @@
 extern TIM_HandleTypeDef htim4;
 
 /* USER CODE BEGIN Private defines */
-
+/* TIM2 compare channels, one timeout per CDC channel */
+#define TIM2_TIMEOUT_COUNT 3U
 /* USER CODE END Private defines */
 
 void MX_TIM4_Init(void);
 
 /* USER CODE BEGIN Prototypes */
+void MX_TIM2_Init(void);
+void TIM2_Timebase_IRQHandler(void);
+uint32_t TIM2_Micros(void);
+void TIM2_Start_Timeout(uint8_t timeout_index, uint32_t us);
+void TIM2_Stop_Timeout(uint8_t timeout_index);
+void TIM2_Timeout_Callback(uint8_t timeout_index);
 
 /* USER CODE END Prototypes */
 
@@ -48,7 +48,45 @@ void MX_GPIO_Init(void)
 }
 
 /* USER CODE BEGIN 2 */
+/**
+  * @brief  Modem lines of the three channels, active low like those of a USB
+  *         serial adapter. DTR and RTS start deasserted (high). DCD, DSR
+  *         and RI are pulled up so an open line reads deasserted, CTS is
+  *         pulled down so TX runs with nothing wired
+  */
+void Modem_GPIO_Init(void)
+{
+  GPIO_InitTypeDef GPIO_InitStruct = {0};
+
+  HAL_GPIO_WritePin(GPIOA, UART1_DTR_Pin | UART1_RTS_Pin | UART2_DTR_Pin | UART2_RTS_Pin, GPIO_PIN_SET);
+  HAL_GPIO_WritePin(GPIOB, UART3_DTR_Pin | UART3_RTS_Pin, GPIO_PIN_SET);
+
+  GPIO_InitStruct.Pin = UART1_DTR_Pin | UART1_RTS_Pin | UART2_DTR_Pin | UART2_RTS_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
+  HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
 
+  GPIO_InitStruct.Pin = UART3_DTR_Pin | UART3_RTS_Pin;
+  HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
+
+  /* CTS of USART2/3 are also the hardware flow control inputs */
+  GPIO_InitStruct.Pin = UART1_CTS_Pin | UART2_CTS_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_INPUT;
+  GPIO_InitStruct.Pull = GPIO_PULLDOWN;
+  HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+
+  GPIO_InitStruct.Pin = UART3_CTS_Pin;
+  HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
+
+  GPIO_InitStruct.Pin = UART2_RI_Pin;
+  GPIO_InitStruct.Pull = GPIO_PULLUP;
+  HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+
+  GPIO_InitStruct.Pin = UART1_DCD_Pin | UART1_DSR_Pin | UART1_RI_Pin |
+                        UART2_DCD_Pin | UART2_DSR_Pin |
+                        UART3_DCD_Pin | UART3_DSR_Pin | UART3_RI_Pin;
+  HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
+}
 /* USER CODE END 2 */
 
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/
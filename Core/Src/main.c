@@ -27,6 +27,7 @@
 
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "usbd_cdc_if.h"
 
 /* USER CODE END Includes */
 
@@ -84,6 +85,8 @@ int main(void)
   SystemClock_Config();
 
   /* USER CODE BEGIN SysInit */
+  /* Timebase up before USB can deliver a request that needs it */
+  MX_TIM2_Init();
 
   /* USER CODE END SysInit */
 
@@ -93,10 +96,21 @@ int main(void)
   MX_USART1_UART_Init();
   MX_USART2_UART_Init();
   MX_USART3_UART_Init();
-  MX_USB_DEVICE_Init();
   MX_TIM4_Init();
   /* USER CODE BEGIN 2 */
+  Modem_GPIO_Init();
+  /* Every channel receiving at its stored settings and the tick taking the
+     data into the rings before USB starts, up to a ring per channel waits
+     for the host. USB last, its call is not generated (see the .ioc) */
+  CDC_Config_Load();
+  if (HAL_TIM_Base_Start_IT(&htim4) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  CDC_Boot_Mark(BOOT_UARTS_UP);
 
+  MX_USB_DEVICE_Init();
+  CDC_Boot_Mark(BOOT_USB_START);
   /* USER CODE END 2 */
 
   /* Infinite loop */
@@ -106,6 +120,7 @@ int main(void)
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
+    CDC_Config_Service();
   }
   /* USER CODE END 3 */
 }
@@ -35,7 +35,7 @@ void MX_TIM4_Init(void)
   htim4.Instance = TIM4;
   htim4.Init.Prescaler = 72-1;
   htim4.Init.CounterMode = TIM_COUNTERMODE_UP;
-  htim4.Init.Period = 5000-1;
+  htim4.Init.Period = 1000-1;
   htim4.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
   htim4.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_ENABLE;
   if (HAL_TIM_Base_Init(&htim4) != HAL_OK)
@@ -96,7 +96,122 @@ void HAL_TIM_Base_MspDeInit(TIM_HandleTypeDef* tim_baseHandle)
 }
 
 /* USER CODE BEGIN 1 */
+TIM_HandleTypeDef htim2;
 
+/** upper half of the microsecond count */
+static __IO uint32_t TIM2_Overflow;
+
+/** 32 bit deadline of each armed compare channel */
+static uint32_t TIM2_Deadline[TIM2_TIMEOUT_COUNT];
+
+/**
+  * @brief  TIM2 free running at 1 MHz, extended to 32 bits by the update
+  *         interrupt. Compare channels 1..3 are one shot timeouts, they are
+  *         handled at register level to keep the latency low
+  */
+void MX_TIM2_Init(void)
+{
+  __HAL_RCC_TIM2_CLK_ENABLE();
+
+  htim2.Instance = TIM2;
+  htim2.Init.Prescaler = 72-1;
+  htim2.Init.CounterMode = TIM_COUNTERMODE_UP;
+  htim2.Init.Period = 0xFFFF;
+  htim2.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+  htim2.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+  if (HAL_TIM_Base_Init(&htim2) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  HAL_NVIC_SetPriority(TIM2_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(TIM2_IRQn);
+
+  if (HAL_TIM_Base_Start_IT(&htim2) != HAL_OK)
+  {
+    Error_Handler();
+  }
+}
+
+/**
+  * @brief  Microseconds since MX_TIM2_Init, wraps after 71 minutes
+  */
+uint32_t TIM2_Micros(void)
+{
+  uint32_t high;
+  uint32_t low;
+
+  do
+  {
+    high = TIM2_Overflow;
+    low = TIM2->CNT;
+  } while (high != TIM2_Overflow);
+
+  /* Wrapped while interrupts of the same priority are being served */
+  if ((READ_BIT(TIM2->SR, TIM_SR_UIF) != 0U) && (low < 0x8000U))
+  {
+    high++;
+  }
+
+  return (high << 16) | low;
+}
+
+/**
+  * @brief  Call TIM2_Timeout_Callback(timeout_index) after us microseconds,
+  *         restarts the timeout if it is already armed
+  */
+void TIM2_Start_Timeout(uint8_t timeout_index, uint32_t us)
+{
+  uint32_t deadline = TIM2_Micros() + us;
+
+  TIM2_Deadline[timeout_index] = deadline;
+  (&TIM2->CCR1)[timeout_index] = deadline & 0xFFFFU;
+  TIM2->SR = ~(TIM_SR_CC1IF << timeout_index);
+  SET_BIT(TIM2->DIER, TIM_DIER_CC1IE << timeout_index);
+
+  /* Counter already past the compare value, do not wait for the next turn */
+  if ((int32_t)(TIM2_Micros() - deadline) >= 0)
+  {
+    TIM2->EGR = TIM_EGR_CC1G << timeout_index;
+  }
+}
+
+void TIM2_Stop_Timeout(uint8_t timeout_index)
+{
+  CLEAR_BIT(TIM2->DIER, TIM_DIER_CC1IE << timeout_index);
+  TIM2->SR = ~(TIM_SR_CC1IF << timeout_index);
+}
+
+void TIM2_Timebase_IRQHandler(void)
+{
+  uint32_t flags = TIM2->SR & TIM2->DIER;
+
+  if ((flags & TIM_SR_UIF) != 0U)
+  {
+    TIM2->SR = ~TIM_SR_UIF;
+    TIM2_Overflow++;
+  }
+
+  for (uint8_t i = 0; i < TIM2_TIMEOUT_COUNT; i++)
+  {
+    if ((flags & (TIM_SR_CC1IF << i)) != 0U)
+    {
+      TIM2->SR = ~(TIM_SR_CC1IF << i);
+
+      /* Deadlines beyond 65 ms match the low half several times */
+      if ((int32_t)(TIM2_Micros() - TIM2_Deadline[i]) >= 0)
+      {
+        CLEAR_BIT(TIM2->DIER, TIM_DIER_CC1IE << i);
+        TIM2_Timeout_Callback(i);
+      }
+    }
+  }
+}
+
+__weak void TIM2_Timeout_Callback(uint8_t timeout_index)
+{
+  UNUSED(timeout_index);
+}
 /* USER CODE END 1 */
 
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/
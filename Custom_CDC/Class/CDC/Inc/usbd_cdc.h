@@ -42,23 +42,55 @@ extern "C"
   * @{
   */
 
-#define NUMBER_OF_CDC 3 // max is 3
+#ifndef NUMBER_OF_CDC
+#define NUMBER_OF_CDC 3 /* 1 to 3, a fourth set of buffers does not fit the PMA */
+#endif
 
-#define CDC0_IN_EP 0x81U  /* EP1 for data IN */
-#define CDC0_CMD_EP 0x82U /* EP2 for CDC commands */
-#define CDC0_OUT_EP 0x01U /* EP1 for data OUT */
+#if (NUMBER_OF_CDC < 1)
+#error "NUMBER_OF_CDC must be at least 1"
+#endif
 
-#define CDC1_IN_EP 0x83U
-#define CDC1_CMD_EP 0x84U
-#define CDC1_OUT_EP 0x02U
+#if ((CDC_VENDOR_CHANNELS >> NUMBER_OF_CDC) != 0U)
+#error "CDC_VENDOR_CHANNELS names a channel past NUMBER_OF_CDC"
+#endif
 
-#define CDC2_IN_EP 0x85U
-#define CDC2_CMD_EP 0x86U
-#define CDC2_OUT_EP 0x03U
+#if ((CDC_MUX != 0U) && (CDC_VENDOR_CHANNELS != 0U))
+#error "CDC_MUX carries every channel, CDC_VENDOR_CHANNELS does not apply"
+#endif
 
-#define CDC3_IN_EP 0x87U
-#define CDC3_CMD_EP 0x88U
-#define CDC3_OUT_EP 0x04U
+/* Channel table: a CDC channel is a communication and a data interface, a
+   vendor channel (CDC_VENDOR_CHANNELS) one interface with all three
+   endpoints, numbered in channel order. Data IN on EP(2n + 1), commands on
+   EP(2n + 2), data OUT on EP(n + 1) either way.
+   CDC_CHANNELS(X) expands X(n) for every channel, comma separated */
+#define CDC_IS_VENDOR(n) ((CDC_VENDOR_CHANNELS >> (n)) & 1U)
+#define CDC_VENDOR_BELOW(n) (((n) > 0U ? CDC_IS_VENDOR(0U) : 0U) + \
+                             ((n) > 1U ? CDC_IS_VENDOR(1U) : 0U) + \
+                             ((n) > 2U ? CDC_IS_VENDOR(2U) : 0U))
+#define CDC_VENDOR_COUNT CDC_VENDOR_BELOW(NUMBER_OF_CDC)
+#if (CDC_MUX != 0U)
+#define CDC_NUM_INTERFACES 1U
+#else
+#define CDC_NUM_INTERFACES (2U * NUMBER_OF_CDC - CDC_VENDOR_COUNT)
+#endif
+
+#define CDC_IN_EP_OF(n) (0x81U + 2U * (n))
+#define CDC_CMD_EP_OF(n) (0x82U + 2U * (n))
+#define CDC_OUT_EP_OF(n) (0x01U + (n))
+#define CDC_COMM_ITF_OF(n) (2U * (n) - CDC_VENDOR_BELOW(n))
+#define CDC_DATA_ITF_OF(n) (CDC_COMM_ITF_OF(n) + 1U)
+
+#if (NUMBER_OF_CDC == 1)
+#define CDC_CHANNELS(X) X(0)
+#elif (NUMBER_OF_CDC == 2)
+#define CDC_CHANNELS(X) X(0), X(1)
+#else
+#define CDC_CHANNELS(X) X(0), X(1), X(2)
+#endif
+
+#define CDC_STRINGIFY(x) #x
+#define CDC_TO_STRING(x) CDC_STRINGIFY(x)
+#define CDC_CHANNELS_STRING CDC_TO_STRING(NUMBER_OF_CDC)
 
 #ifndef CDC_HS_BINTERVAL
 #define CDC_HS_BINTERVAL 0x10U
@@ -73,7 +105,43 @@ extern "C"
 #define CDC_DATA_FS_MAX_PACKET_SIZE 48U  /* Endpoint IN & OUT Packet size */
 #define CDC_CMD_PACKET_SIZE 8U           /* Control Endpoint Packet size */
 
-#define USB_CDC_CONFIG_DESC_SIZ (9 + 66 * NUMBER_OF_CDC)
+/* PMA: both data buffers of each channel from the end of EP0 IN, then the
+   command buffers */
+#define CDC_PMA_BASE 0xC0U
+#define CDC_PMA_IN_OF(n) (CDC_PMA_BASE + 2U * CDC_DATA_FS_MAX_PACKET_SIZE * (n))
+#define CDC_PMA_OUT_OF(n) (CDC_PMA_IN_OF(n) + CDC_DATA_FS_MAX_PACKET_SIZE)
+#define CDC_PMA_CMD_OF(n) (CDC_PMA_IN_OF(NUMBER_OF_CDC) + CDC_CMD_PACKET_SIZE * (n))
+
+#if (CDC_PMA_CMD_OF(NUMBER_OF_CDC) > 512U)
+#error "NUMBER_OF_CDC: the endpoint buffers do not fit the 512 byte PMA"
+#endif
+
+/*---------------------------------------------------------------------*/
+/*  Multiplexed build (CDC_MUX): interface 0, bulk EP1 OUT and EP1 IN. */
+/*  Every packet holds whole records: CDC_MUX_xxx | channel, data      */
+/*  length, data. Class and vendor requests go to interface 0 with the */
+/*  channel in the high byte of wIndex                                 */
+/*---------------------------------------------------------------------*/
+#define CDC_MUX_IN_EP 0x81U
+#define CDC_MUX_OUT_EP 0x01U
+#define CDC_MUX_PACKET_SIZE 64U
+#define CDC_MUX_HEADER_SIZE 2U
+#define CDC_MUX_CHANNEL_MASK 0x0FU
+#define CDC_MUX_PAD 0x0FU          /* channel of filler records, skipped */
+#define CDC_MUX_TYPE_MASK 0xF0U
+#define CDC_MUX_DATA 0x00U         /* data, the transfer goes on in a later record */
+#define CDC_MUX_END 0x10U          /* data ending the transfer, as a short packet would */
+#define CDC_MUX_SERIAL_STATE 0x20U /* IN only, SERIAL_STATE bitmap, 2 bytes */
+
+#define CDC_PMA_MUX_IN CDC_PMA_BASE
+#define CDC_PMA_MUX_OUT (CDC_PMA_MUX_IN + CDC_MUX_PACKET_SIZE)
+
+#if (CDC_MUX != 0U)
+#define USB_CDC_CONFIG_DESC_SIZ (9 + 23)
+#else
+/* 66 bytes per CDC function, 30 per vendor interface */
+#define USB_CDC_CONFIG_DESC_SIZ (9 + 66 * NUMBER_OF_CDC - 36 * CDC_VENDOR_COUNT)
+#endif
 #define CDC_DATA_HS_IN_PACKET_SIZE CDC_DATA_HS_MAX_PACKET_SIZE
 #define CDC_DATA_HS_OUT_PACKET_SIZE CDC_DATA_HS_MAX_PACKET_SIZE
 
@@ -93,6 +161,78 @@ extern "C"
 #define CDC_SET_CONTROL_LINE_STATE 0x22U
 #define CDC_SEND_BREAK 0x23U
 
+/* SET_CONTROL_LINE_STATE wValue */
+#define CDC_CONTROL_LINE_DTR 0x01U
+#define CDC_CONTROL_LINE_RTS 0x02U
+
+/* Notifications on the command endpoint */
+#define CDC_SERIAL_STATE 0x20U
+#define CDC_NOTIFICATION_SIZE 10U /* header 8 + UART state bitmap 2 */
+
+/* SERIAL_STATE bitmap */
+#define CDC_SERIAL_STATE_DCD 0x0001U     /* bRxCarrier */
+#define CDC_SERIAL_STATE_DSR 0x0002U     /* bTxCarrier */
+#define CDC_SERIAL_STATE_BREAK 0x0004U   /* bBreak */
+#define CDC_SERIAL_STATE_RI 0x0008U      /* bRingSignal */
+#define CDC_SERIAL_STATE_FRAMING 0x0010U /* bFraming */
+#define CDC_SERIAL_STATE_PARITY 0x0020U  /* bParity */
+#define CDC_SERIAL_STATE_OVERRUN 0x0040U /* bOverRun */
+/* Vendor only: bit 7 is reserved in PSTN, so CTS is sent on vendor and
+   multiplexed channels alone and a CDC ACM function never sets it */
+#define CDC_SERIAL_STATE_CTS 0x0080U
+#define CDC_SERIAL_STATE_ERRORS (CDC_SERIAL_STATE_BREAK | CDC_SERIAL_STATE_FRAMING | \
+                                 CDC_SERIAL_STATE_PARITY | CDC_SERIAL_STATE_OVERRUN)
+
+/*---------------------------------------------------------------------*/
+/*  Vendor requests (bmRequestType 0x41, wIndex: CDC interface number) */
+/*---------------------------------------------------------------------*/
+#define CDC_VENDOR_SET_FLOW_CONTROL 0xC0U /* wValue: CDC_FLOW_CONTROL_xxx */
+#define CDC_VENDOR_SET_DTR_GATING 0xC1U   /* wValue: 1 drops UART data while DTR is deasserted */
+#define CDC_VENDOR_SET_MULTIDROP 0xC2U    /* wValue: CDC_MULTIDROP_ENABLE | node address, 0 for off */
+#define CDC_VENDOR_SET_RS485 0xC3U        /* wValue: 1 drives the transceiver DE from the RTS pin */
+#define CDC_VENDOR_SET_RS485_GUARD 0xC4U  /* wValue: (post << 8) | pre DE guard time, in bit times */
+#define CDC_VENDOR_SET_MODBUS 0xC5U       /* wValue: 1 forwards whole Modbus RTU frames, one per transfer */
+#define CDC_VENDOR_SET_TIMESTAMPS 0xC6U   /* wValue: 1 sends UART data as CDC_TIMESTAMP records */
+#define CDC_VENDOR_SET_PACKET 0xC7U       /* wValue: CDC_PACKET_xxx framing on the UART side */
+#define CDC_VENDOR_SET_LATENCY 0xC8U      /* wValue: IN latency timer 0..255 ms, 0 sends on every UART event */
+#define CDC_VENDOR_SET_FILL 0xC9U         /* wValue: bytes waiting that send at once, down to whole packets, 0 off */
+#define CDC_VENDOR_SAVE_CONFIG 0xCAU      /* wValue: 1 keeps line coding, flow control, latency and packet mode
+                                             in flash as the boot defaults, 0 forgets them: boots at 115200 8N1,
+                                             no flow control, stream mode. The running settings stay as they are */
+
+/* Vendor reads (bmRequestType 0xC1, wIndex as above, wValue 0), above every setting */
+#define CDC_VENDOR_GET_TX_GAPS 0xE0U      /* wLength 4: times the UART line went idle with OUT data waiting,
+                                             32 bit little endian, counted since power up */
+
+/* Timestamp record: data length (1..255), arrival of the burst's first start
+   bit in microseconds (32 bit little endian), data. Records cut from one
+   burst carry the same timestamp */
+#define CDC_TIMESTAMP_HEADER_SIZE 5U
+#define CDC_TIMESTAMP_MAX_DATA 255U
+
+#define CDC_FLOW_CONTROL_NONE 0x00U
+#define CDC_FLOW_CONTROL_RTS_CTS 0x01U
+#define CDC_FLOW_CONTROL_XON_XOFF 0x02U
+
+/* One USB transfer per packet, COBS (0x00 delimited) or SLIP (RFC 1055) on the UART */
+#define CDC_PACKET_NONE 0x00U
+#define CDC_PACKET_COBS 0x01U
+#define CDC_PACKET_SLIP 0x02U
+
+#define CDC_MULTIDROP_ENABLE 0x0100U
+#define CDC_MULTIDROP_ADDRESS_MASK 0x000FU /* USART_CR2.ADD is 4 bits */
+
+/*---------------------------------------------------------------------*/
+/*  Microsoft OS 2.0 descriptors for the vendor channels               */
+/*---------------------------------------------------------------------*/
+#define CDC_MS_VENDOR_CODE 0x20U     /* bRequest of the descriptor set request */
+#define CDC_MS_GET_DESCRIPTOR_SET 0x07U /* wIndex of the descriptor set request */
+#if (CDC_MUX != 0U)
+#define CDC_MS_OS_20_SET_SIZE (10U + 8U + 160U)
+#else
+#define CDC_MS_OS_20_SET_SIZE (10U + 8U + 160U * CDC_VENDOR_COUNT)
+#endif
+
   /**
   * @}
   */
@@ -133,6 +273,12 @@ extern "C"
 
     __IO uint32_t TxState;
     __IO uint32_t RxState;
+
+    uint8_t TxDeferZlp;       /* set by the interface: more data follows, no ZLP after a full last packet */
+    __IO uint8_t TxZlpOwed;   /* such a transfer ended, the host read is still open */
+
+    uint8_t Notification[CDC_NOTIFICATION_SIZE];
+    __IO uint32_t NotifyState;
   } USBD_CDC_HandleTypeDef;
 
   /** @defgroup USBD_CORE_Exported_Macros
@@ -170,6 +316,10 @@ extern "C"
   uint8_t USBD_CDC_ReceivePacket(uint8_t cdc_index, USBD_HandleTypeDef *pdev);
 
   uint8_t USBD_CDC_TransmitPacket(uint8_t cdc_index, USBD_HandleTypeDef *pdev);
+
+  uint8_t USBD_CDC_SendSerialState(uint8_t cdc_index,
+                                   USBD_HandleTypeDef *pdev,
+                                   uint16_t serial_state);
   /**
   * @}
   */
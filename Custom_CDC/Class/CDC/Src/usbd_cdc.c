@@ -113,18 +113,83 @@ static uint8_t USBD_CDC_EP0_RxReady(USBD_HandleTypeDef *pdev);
 
 static uint8_t *USBD_CDC_GetFSCfgDesc(uint16_t *length);
 
-static uint8_t CDC_IN_EP[] = {CDC0_IN_EP, CDC1_IN_EP, CDC2_IN_EP, CDC3_IN_EP};
-static uint8_t CDC_CMD_EP[] = {CDC0_CMD_EP, CDC1_CMD_EP, CDC2_CMD_EP, CDC3_CMD_EP};
-static uint8_t CDC_OUT_EP[] = {CDC0_OUT_EP, CDC1_OUT_EP, CDC2_OUT_EP, CDC3_OUT_EP};
+#define CDC_ONCE(n) (n)
+#define CDC_TWICE(n) (n), (n)
+
+#if (CDC_MUX != 0U)
+static void USBD_CDC_Mux_In(USBD_HandleTypeDef *pdev);
+
+static void USBD_CDC_Mux_Out(USBD_HandleTypeDef *pdev);
+
+/* Multiplexed build: every channel keeps its handle, TransmitPacket and
+   ReceivePacket work on it as on its own endpoints */
+__ALIGN_BEGIN static uint8_t Mux_In_Packet[CDC_MUX_PACKET_SIZE] __ALIGN_END;
+__ALIGN_BEGIN static uint8_t Mux_Out_Packet[CDC_MUX_PACKET_SIZE] __ALIGN_END;
+static uint8_t Mux_In_Busy;               /* packet on the IN endpoint */
+static uint32_t Mux_In_Size;              /* size of the last IN packet, a full one owes a ZLP when idle */
+static uint8_t Mux_In_First;              /* channel served first by the next IN packet, round robin */
+static uint32_t Mux_Tx_Pos[NUMBER_OF_CDC]; /* bytes of the channel's IN transfer already packed */
+static uint8_t Mux_Out_Held;              /* OUT packet not fully handed out, the endpoint NAKs */
+static uint8_t Mux_Out_Active;            /* USBD_CDC_Mux_Out running, channels arm from inside it */
+static uint32_t Mux_Out_Len;
+static uint32_t Mux_Out_Pos;              /* record being handed out */
+static uint32_t Mux_Rec_Done;             /* its data bytes already in the channel slot */
+static uint8_t Mux_Zlp_Due;               /* it ended the transfer on a full slot, a ZLP follows */
+static uint8_t Mux_Rx_Armed[NUMBER_OF_CDC]; /* channel slot given by ReceivePacket */
+static uint32_t Mux_Rx_Fill[NUMBER_OF_CDC]; /* bytes in it */
+#else
+static const uint8_t CDC_IN_EP[] = {CDC_CHANNELS(CDC_IN_EP_OF)};
+static const uint8_t CDC_CMD_EP[] = {CDC_CHANNELS(CDC_CMD_EP_OF)};
+static const uint8_t CDC_OUT_EP[] = {CDC_CHANNELS(CDC_OUT_EP_OF)};
+
+/* Endpoint number to channel, IN data and command endpoints come in pairs */
+static const uint8_t EP_In_To_Interface[] = {0, CDC_CHANNELS(CDC_TWICE)};
+
+static const uint8_t EP_Out_To_Interface[] = {0, CDC_CHANNELS(CDC_ONCE)};
+
+/* Per channel build choice, CDC function or vendor interface */
+#if CDC_IS_VENDOR(0U)
+#define CDC_CHANNEL_DESC_0 CDC_VENDOR_DESC(0U)
+#define CDC_ITF_MAP_0 CDC_ONCE(0U)
+#define CDC_MS_OS_20_FUNCTION_0 CDC_MS_OS_20_FUNCTION(0U),
+#else
+#define CDC_CHANNEL_DESC_0 CDC_FUNCTION_DESC(0U)
+#define CDC_ITF_MAP_0 CDC_TWICE(0U)
+#define CDC_MS_OS_20_FUNCTION_0
+#endif
+
+#if CDC_IS_VENDOR(1U)
+#define CDC_CHANNEL_DESC_1 CDC_VENDOR_DESC(1U)
+#define CDC_ITF_MAP_1 CDC_ONCE(1U)
+#define CDC_MS_OS_20_FUNCTION_1 CDC_MS_OS_20_FUNCTION(1U),
+#else
+#define CDC_CHANNEL_DESC_1 CDC_FUNCTION_DESC(1U)
+#define CDC_ITF_MAP_1 CDC_TWICE(1U)
+#define CDC_MS_OS_20_FUNCTION_1
+#endif
 
-static uint8_t EP_In_To_Interface[] = {0, 0, 0, 1, 1, 2, 2, 3, 3};
+#if CDC_IS_VENDOR(2U)
+#define CDC_CHANNEL_DESC_2 CDC_VENDOR_DESC(2U)
+#define CDC_ITF_MAP_2 CDC_ONCE(2U)
+#define CDC_MS_OS_20_FUNCTION_2 CDC_MS_OS_20_FUNCTION(2U),
+#else
+#define CDC_CHANNEL_DESC_2 CDC_FUNCTION_DESC(2U)
+#define CDC_ITF_MAP_2 CDC_TWICE(2U)
+#define CDC_MS_OS_20_FUNCTION_2
+#endif
 
-static uint8_t EP_Out_To_Interface[] = {0, 0, 1, 2, 3};
+#define CDC_CHANNEL_DESC(n) CDC_CHANNEL_DESC_##n
+#define CDC_ITF_MAP(n) CDC_ITF_MAP_##n
 
-static uint8_t W_Index_To_Interface[] = {0, 0, 1, 1, 2, 2, 3, 3};
+/* Interface number (wIndex) to channel */
+static const uint8_t W_Index_To_Interface[] = {CDC_CHANNELS(CDC_ITF_MAP)};
+#endif
 
 static USBD_CDC_HandleTypeDef CDC_Handle[NUMBER_OF_CDC];
 
+/* Channel of the class request waiting for its EP0 data stage, 0xFF if none */
+static uint8_t Cmd_Cdc_Index = 0xFFU;
+
 uint8_t *USBD_CDC_GetDeviceQualifierDescriptor(uint16_t *length);
 
 /* USB Standard Device Descriptor */
@@ -169,6 +234,137 @@ USBD_ClassTypeDef USBD_CDC =
         USBD_CDC_GetDeviceQualifierDescriptor,
 };
 
+/* One CDC function (66 bytes): IAD, communication interface with its
+   command endpoint, data interface with its bulk pair */
+#define CDC_FUNCTION_DESC(n)                                                       \
+  /******** IAD to associate the two CDC interfaces */                            \
+  0x08,                  /* bLength */                                             \
+  0x0B,                  /* bDescriptorType */                                     \
+  CDC_COMM_ITF_OF(n),    /* bFirstInterface */                                     \
+  0x02,                  /* bInterfaceCount */                                     \
+  0x02,                  /* bFunctionClass */                                      \
+  0x02,                  /* bFunctionSubClass */                                   \
+  0x01,                  /* bFunctionProtocol */                                   \
+  0x00,                  /* iFunction */                                           \
+                                                                                   \
+  /* Interface Descriptor */                                                       \
+  0x09,                    /* bLength: Interface Descriptor size */                \
+  USB_DESC_TYPE_INTERFACE, /* bDescriptorType: Interface */                        \
+  CDC_COMM_ITF_OF(n),      /* bInterfaceNumber: Number of Interface */             \
+  0x00,                    /* bAlternateSetting: Alternate setting */              \
+  0x01,                    /* bNumEndpoints: One endpoints used */                 \
+  0x02,                    /* bInterfaceClass: Communication Interface Class */    \
+  0x02,                    /* bInterfaceSubClass: Abstract Control Model */        \
+  0x01,                    /* bInterfaceProtocol: Common AT commands */            \
+  0x00,                    /* iInterface: */                                       \
+                                                                                   \
+  /* Header Functional Descriptor */                                               \
+  0x05, /* bLength: Endpoint Descriptor size */                                    \
+  0x24, /* bDescriptorType: CS_INTERFACE */                                        \
+  0x00, /* bDescriptorSubtype: Header Func Desc */                                 \
+  0x10, /* bcdCDC: spec release number */                                          \
+  0x01,                                                                            \
+                                                                                   \
+  /* Call Management Functional Descriptor */                                      \
+  0x05,               /* bFunctionLength */                                        \
+  0x24,               /* bDescriptorType: CS_INTERFACE */                          \
+  0x01,               /* bDescriptorSubtype: Call Management Func Desc */          \
+  0x00,               /* bmCapabilities: D0+D1 */                                  \
+  CDC_DATA_ITF_OF(n), /* bDataInterface */                                         \
+                                                                                   \
+  /* ACM Functional Descriptor */                                                  \
+  0x04, /* bFunctionLength */                                                      \
+  0x24, /* bDescriptorType: CS_INTERFACE */                                        \
+  0x02, /* bDescriptorSubtype: Abstract Control Management desc */                 \
+  0x02, /* bmCapabilities */                                                       \
+                                                                                   \
+  /* Union Functional Descriptor */                                                \
+  0x05,               /* bFunctionLength */                                        \
+  0x24,               /* bDescriptorType: CS_INTERFACE */                          \
+  0x06,               /* bDescriptorSubtype: Union func desc */                    \
+  CDC_COMM_ITF_OF(n), /* bMasterInterface: Communication class interface */        \
+  CDC_DATA_ITF_OF(n), /* bSlaveInterface0: Data Class Interface */                 \
+                                                                                   \
+  /* Command Endpoint Descriptor */                                                \
+  0x07,                        /* bLength: Endpoint Descriptor size */             \
+  USB_DESC_TYPE_ENDPOINT,      /* bDescriptorType: Endpoint */                     \
+  CDC_CMD_EP_OF(n),            /* bEndpointAddress */                              \
+  0x03,                        /* bmAttributes: Interrupt */                       \
+  LOBYTE(CDC_CMD_PACKET_SIZE), /* wMaxPacketSize: */                               \
+  HIBYTE(CDC_CMD_PACKET_SIZE),                                                     \
+  CDC_FS_BINTERVAL, /* bInterval: */                                               \
+                                                                                   \
+  /* Data class interface descriptor */                                            \
+  0x09,                    /* bLength: Endpoint Descriptor size */                 \
+  USB_DESC_TYPE_INTERFACE, /* bDescriptorType: */                                  \
+  CDC_DATA_ITF_OF(n),      /* bInterfaceNumber: Number of Interface */             \
+  0x00,                    /* bAlternateSetting: Alternate setting */              \
+  0x02,                    /* bNumEndpoints: Two endpoints used */                 \
+  0x0A,                    /* bInterfaceClass: CDC */                              \
+  0x00,                    /* bInterfaceSubClass: */                               \
+  0x00,                    /* bInterfaceProtocol: */                               \
+  0x00,                    /* iInterface: */                                       \
+                                                                                   \
+  /* Endpoint OUT Descriptor */                                                    \
+  0x07,                                /* bLength: Endpoint Descriptor size */     \
+  USB_DESC_TYPE_ENDPOINT,              /* bDescriptorType: Endpoint */             \
+  CDC_OUT_EP_OF(n),                    /* bEndpointAddress */                      \
+  0x02,                                /* bmAttributes: Bulk */                    \
+  LOBYTE(CDC_DATA_FS_MAX_PACKET_SIZE), /* wMaxPacketSize: */                       \
+  HIBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),                                             \
+  0x00, /* bInterval: ignore for Bulk transfer */                                  \
+                                                                                   \
+  /* Endpoint IN Descriptor */                                                     \
+  0x07,                                /* bLength: Endpoint Descriptor size */     \
+  USB_DESC_TYPE_ENDPOINT,              /* bDescriptorType: Endpoint */             \
+  CDC_IN_EP_OF(n),                     /* bEndpointAddress */                      \
+  0x02,                                /* bmAttributes: Bulk */                    \
+  LOBYTE(CDC_DATA_FS_MAX_PACKET_SIZE), /* wMaxPacketSize: */                       \
+  HIBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),                                             \
+  0x00 /* bInterval: ignore for Bulk transfer */
+
+/* One vendor channel (30 bytes): a single interface with the bulk pair and
+   the command endpoint, same endpoints and requests as the CDC function but
+   no tty on the host */
+#define CDC_VENDOR_DESC(n)                                                         \
+  /* Interface Descriptor */                                                       \
+  0x09,                    /* bLength: Interface Descriptor size */                \
+  USB_DESC_TYPE_INTERFACE, /* bDescriptorType: Interface */                        \
+  CDC_COMM_ITF_OF(n),      /* bInterfaceNumber: Number of Interface */             \
+  0x00,                    /* bAlternateSetting: Alternate setting */              \
+  0x03,                    /* bNumEndpoints: Three endpoints used */               \
+  0xFF,                    /* bInterfaceClass: Vendor specific */                  \
+  0x00,                    /* bInterfaceSubClass: */                               \
+  0x00,                    /* bInterfaceProtocol: */                               \
+  0x00,                    /* iInterface: */                                       \
+                                                                                   \
+  /* Endpoint OUT Descriptor */                                                    \
+  0x07,                                /* bLength: Endpoint Descriptor size */     \
+  USB_DESC_TYPE_ENDPOINT,              /* bDescriptorType: Endpoint */             \
+  CDC_OUT_EP_OF(n),                    /* bEndpointAddress */                      \
+  0x02,                                /* bmAttributes: Bulk */                    \
+  LOBYTE(CDC_DATA_FS_MAX_PACKET_SIZE), /* wMaxPacketSize: */                       \
+  HIBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),                                             \
+  0x00, /* bInterval: ignore for Bulk transfer */                                  \
+                                                                                   \
+  /* Endpoint IN Descriptor */                                                     \
+  0x07,                                /* bLength: Endpoint Descriptor size */     \
+  USB_DESC_TYPE_ENDPOINT,              /* bDescriptorType: Endpoint */             \
+  CDC_IN_EP_OF(n),                     /* bEndpointAddress */                      \
+  0x02,                                /* bmAttributes: Bulk */                    \
+  LOBYTE(CDC_DATA_FS_MAX_PACKET_SIZE), /* wMaxPacketSize: */                       \
+  HIBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),                                             \
+  0x00, /* bInterval: ignore for Bulk transfer */                                  \
+                                                                                   \
+  /* Command Endpoint Descriptor, SERIAL_STATE notifications */                    \
+  0x07,                        /* bLength: Endpoint Descriptor size */             \
+  USB_DESC_TYPE_ENDPOINT,      /* bDescriptorType: Endpoint */                     \
+  CDC_CMD_EP_OF(n),            /* bEndpointAddress */                              \
+  0x03,                        /* bmAttributes: Interrupt */                       \
+  LOBYTE(CDC_CMD_PACKET_SIZE), /* wMaxPacketSize: */                               \
+  HIBYTE(CDC_CMD_PACKET_SIZE),                                                     \
+  CDC_FS_BINTERVAL /* bInterval: */
+
 /* USB CDC device Configuration Descriptor */
 __ALIGN_BEGIN uint8_t USBD_CDC_CfgFSDesc[USB_CDC_CONFIG_DESC_SIZ] __ALIGN_END =
     {
@@ -177,367 +373,113 @@ __ALIGN_BEGIN uint8_t USBD_CDC_CfgFSDesc[USB_CDC_CONFIG_DESC_SIZ] __ALIGN_END =
         USB_DESC_TYPE_CONFIGURATION,     /* bDescriptorType: Configuration */
         LOBYTE(USB_CDC_CONFIG_DESC_SIZ), /* wTotalLength:no of returned bytes */
         HIBYTE(USB_CDC_CONFIG_DESC_SIZ),
-        (2 * NUMBER_OF_CDC), /* bNumInterfaces: 2 interface */
+        CDC_NUM_INTERFACES, /* bNumInterfaces: 2 per CDC, 1 per vendor channel, 1 multiplexed */
         0x01,                /* bConfigurationValue: Configuration value */
         0x00,                /* iConfiguration: Index of string descriptor describing the configuration */
         0xC0,                /* bmAttributes: self powered */
         0x32,                /* MaxPower 0 mA */
 
-        /********************  CDC0 block ********************/
-        /******** IAD to associate the two CDC interfaces */
-        0x08, /* bLength */
-        0x0B, /* bDescriptorType */
-        0x00, /* bFirstInterface */
-        0x02, /* bInterfaceCount */
-        0x02, /* bFunctionClass */
-        0x02, /* bFunctionSubClass */
-        0x01, /* bFunctionProtocol */
-        0x00, /* iFunction (Index of string descriptor describing this function) */
-
+#if (CDC_MUX != 0U)
         /* Interface Descriptor */
         0x09,                    /* bLength: Interface Descriptor size */
         USB_DESC_TYPE_INTERFACE, /* bDescriptorType: Interface */
         0x00,                    /* bInterfaceNumber: Number of Interface */
         0x00,                    /* bAlternateSetting: Alternate setting */
-        0x01,                    /* bNumEndpoints: One endpoints used */
-        0x02,                    /* bInterfaceClass: Communication Interface Class */
-        0x02,                    /* bInterfaceSubClass: Abstract Control Model */
-        0x01,                    /* bInterfaceProtocol: Common AT commands */
-        0x00,                    /* iInterface: */
-
-        /* Header Functional Descriptor */
-        0x05, /* bLength: Endpoint Descriptor size */
-        0x24, /* bDescriptorType: CS_INTERFACE */
-        0x00, /* bDescriptorSubtype: Header Func Desc */
-        0x10, /* bcdCDC: spec release number */
-        0x01,
-
-        /* Call Management Functional Descriptor */
-        0x05, /* bFunctionLength */
-        0x24, /* bDescriptorType: CS_INTERFACE */
-        0x01, /* bDescriptorSubtype: Call Management Func Desc */
-        0x00, /* bmCapabilities: D0+D1 */
-        0x01, /* bDataInterface: 1 */
-
-        /* ACM Functional Descriptor */
-        0x04, /* bFunctionLength */
-        0x24, /* bDescriptorType: CS_INTERFACE */
-        0x02, /* bDescriptorSubtype: Abstract Control Management desc */
-        0x02, /* bmCapabilities */
-
-        /* Union Functional Descriptor */
-        0x05, /* bFunctionLength */
-        0x24, /* bDescriptorType: CS_INTERFACE */
-        0x06, /* bDescriptorSubtype: Union func desc */
-        0x00, /* bMasterInterface: Communication class interface */
-        0x01, /* bSlaveInterface0: Data Class Interface */
-
-        /* Endpoint 2 Descriptor */
-        0x07,                        /* bLength: Endpoint Descriptor size */
-        USB_DESC_TYPE_ENDPOINT,      /* bDescriptorType: Endpoint */
-        CDC0_CMD_EP,                 /* bEndpointAddress */
-        0x03,                        /* bmAttributes: Interrupt */
-        LOBYTE(CDC_CMD_PACKET_SIZE), /* wMaxPacketSize: */
-        HIBYTE(CDC_CMD_PACKET_SIZE),
-        CDC_FS_BINTERVAL, /* bInterval: */
-        /*---------------------------------------------------------------------------*/
-
-        /* Data class interface descriptor */
-        0x09,                    /* bLength: Endpoint Descriptor size */
-        USB_DESC_TYPE_INTERFACE, /* bDescriptorType: */
-        0x01,                    /* bInterfaceNumber: Number of Interface */
-        0x00,                    /* bAlternateSetting: Alternate setting */
         0x02,                    /* bNumEndpoints: Two endpoints used */
-        0x0A,                    /* bInterfaceClass: CDC */
+        0xFF,                    /* bInterfaceClass: Vendor specific */
         0x00,                    /* bInterfaceSubClass: */
         0x00,                    /* bInterfaceProtocol: */
         0x00,                    /* iInterface: */
 
         /* Endpoint OUT Descriptor */
-        0x07,                                /* bLength: Endpoint Descriptor size */
-        USB_DESC_TYPE_ENDPOINT,              /* bDescriptorType: Endpoint */
-        CDC0_OUT_EP,                         /* bEndpointAddress */
-        0x02,                                /* bmAttributes: Bulk */
-        LOBYTE(CDC_DATA_FS_MAX_PACKET_SIZE), /* wMaxPacketSize: */
-        HIBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),
-        0x00, /* bInterval: ignore for Bulk transfer */
-
-        /* Endpoint IN Descriptor */
-        0x07,                                /* bLength: Endpoint Descriptor size */
-        USB_DESC_TYPE_ENDPOINT,              /* bDescriptorType: Endpoint */
-        CDC0_IN_EP,                          /* bEndpointAddress */
-        0x02,                                /* bmAttributes: Bulk */
-        LOBYTE(CDC_DATA_FS_MAX_PACKET_SIZE), /* wMaxPacketSize: */
-        HIBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),
-        0x00,
-#if (NUMBER_OF_CDC > 1)
-        /********************  CDC1 block ********************/
-        /******** IAD to associate the two CDC interfaces */
-        0x08, /* bLength */
-        0x0B, /* bDescriptorType */
-        0x02, /* bFirstInterface */
-        0x02, /* bInterfaceCount */
-        0x02, /* bFunctionClass */
-        0x02, /* bFunctionSubClass */
-        0x01, /* bFunctionProtocol */
-        0x00, /* iFunction (Index of string descriptor describing this function) */
-
-        /* Interface Descriptor */
-        0x09,                    /* bLength: Interface Descriptor size */
-        USB_DESC_TYPE_INTERFACE, /* bDescriptorType: Interface */
-        0x02,                    /* bInterfaceNumber: Number of Interface */
-        0x00,                    /* bAlternateSetting: Alternate setting */
-        0x01,                    /* bNumEndpoints: One endpoints used */
-        0x02,                    /* bInterfaceClass: Communication Interface Class */
-        0x02,                    /* bInterfaceSubClass: Abstract Control Model */
-        0x01,                    /* bInterfaceProtocol: Common AT commands */
-        0x00,                    /* iInterface: */
-
-        /* Header Functional Descriptor */
-        0x05, /* bLength: Endpoint Descriptor size */
-        0x24, /* bDescriptorType: CS_INTERFACE */
-        0x00, /* bDescriptorSubtype: Header Func Desc */
-        0x10, /* bcdCDC: spec release number */
-        0x01,
-
-        /* Call Management Functional Descriptor */
-        0x05, /* bFunctionLength */
-        0x24, /* bDescriptorType: CS_INTERFACE */
-        0x01, /* bDescriptorSubtype: Call Management Func Desc */
-        0x00, /* bmCapabilities: D0+D1 */
-        0x03, /* bDataInterface: 1 */
-
-        /* ACM Functional Descriptor */
-        0x04, /* bFunctionLength */
-        0x24, /* bDescriptorType: CS_INTERFACE */
-        0x02, /* bDescriptorSubtype: Abstract Control Management desc */
-        0x02, /* bmCapabilities */
-
-        /* Union Functional Descriptor */
-        0x05, /* bFunctionLength */
-        0x24, /* bDescriptorType: CS_INTERFACE */
-        0x06, /* bDescriptorSubtype: Union func desc */
-        0x02, /* bMasterInterface: Communication class interface */
-        0x03, /* bSlaveInterface0: Data Class Interface */
-
-        /* Endpoint 2 Descriptor */
         0x07,                        /* bLength: Endpoint Descriptor size */
         USB_DESC_TYPE_ENDPOINT,      /* bDescriptorType: Endpoint */
-        CDC1_CMD_EP,                 /* bEndpointAddress */
-        0x03,                        /* bmAttributes: Interrupt */
-        LOBYTE(CDC_CMD_PACKET_SIZE), /* wMaxPacketSize: */
-        HIBYTE(CDC_CMD_PACKET_SIZE),
-        CDC_FS_BINTERVAL, /* bInterval: */
-        /*---------------------------------------------------------------------------*/
-
-        /* Data class interface descriptor */
-        0x09,                    /* bLength: Endpoint Descriptor size */
-        USB_DESC_TYPE_INTERFACE, /* bDescriptorType: */
-        0x03,                    /* bInterfaceNumber: Number of Interface */
-        0x00,                    /* bAlternateSetting: Alternate setting */
-        0x02,                    /* bNumEndpoints: Two endpoints used */
-        0x0A,                    /* bInterfaceClass: CDC */
-        0x00,                    /* bInterfaceSubClass: */
-        0x00,                    /* bInterfaceProtocol: */
-        0x00,                    /* iInterface: */
-
-        /* Endpoint OUT Descriptor */
-        0x07,                                /* bLength: Endpoint Descriptor size */
-        USB_DESC_TYPE_ENDPOINT,              /* bDescriptorType: Endpoint */
-        CDC1_OUT_EP,                         /* bEndpointAddress */
-        0x02,                                /* bmAttributes: Bulk */
-        LOBYTE(CDC_DATA_FS_MAX_PACKET_SIZE), /* wMaxPacketSize: */
-        HIBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),
+        CDC_MUX_OUT_EP,              /* bEndpointAddress */
+        0x02,                        /* bmAttributes: Bulk */
+        LOBYTE(CDC_MUX_PACKET_SIZE), /* wMaxPacketSize: */
+        HIBYTE(CDC_MUX_PACKET_SIZE),
         0x00, /* bInterval: ignore for Bulk transfer */
 
         /* Endpoint IN Descriptor */
-        0x07,                                /* bLength: Endpoint Descriptor size */
-        USB_DESC_TYPE_ENDPOINT,              /* bDescriptorType: Endpoint */
-        CDC1_IN_EP,                          /* bEndpointAddress */
-        0x02,                                /* bmAttributes: Bulk */
-        LOBYTE(CDC_DATA_FS_MAX_PACKET_SIZE), /* wMaxPacketSize: */
-        HIBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),
-        0x00, /* bInterval: ignore for Bulk transfer */
-#endif
-#if (NUMBER_OF_CDC > 2)
-        /********************  CDC2 block ********************/
-        /******** IAD to associate the two CDC interfaces */
-        0x08, /* bLength */
-        0x0B, /* bDescriptorType */
-        0x04, /* bFirstInterface */
-        0x02, /* bInterfaceCount */
-        0x02, /* bFunctionClass */
-        0x02, /* bFunctionSubClass */
-        0x01, /* bFunctionProtocol */
-        0x00, /* iFunction (Index of string descriptor describing this function) */
-
-        /* Interface Descriptor */
-        0x09,                    /* bLength: Interface Descriptor size */
-        USB_DESC_TYPE_INTERFACE, /* bDescriptorType: Interface */
-        0x04,                    /* bInterfaceNumber: Number of Interface */
-        0x00,                    /* bAlternateSetting: Alternate setting */
-        0x01,                    /* bNumEndpoints: One endpoints used */
-        0x02,                    /* bInterfaceClass: Communication Interface Class */
-        0x02,                    /* bInterfaceSubClass: Abstract Control Model */
-        0x01,                    /* bInterfaceProtocol: Common AT commands */
-        0x00,                    /* iInterface: */
-
-        /* Header Functional Descriptor */
-        0x05, /* bLength: Endpoint Descriptor size */
-        0x24, /* bDescriptorType: CS_INTERFACE */
-        0x00, /* bDescriptorSubtype: Header Func Desc */
-        0x10, /* bcdCDC: spec release number */
-        0x01,
-
-        /* Call Management Functional Descriptor */
-        0x05, /* bFunctionLength */
-        0x24, /* bDescriptorType: CS_INTERFACE */
-        0x01, /* bDescriptorSubtype: Call Management Func Desc */
-        0x00, /* bmCapabilities: D0+D1 */
-        0x05, /* bDataInterface: 1 */
-
-        /* ACM Functional Descriptor */
-        0x04, /* bFunctionLength */
-        0x24, /* bDescriptorType: CS_INTERFACE */
-        0x02, /* bDescriptorSubtype: Abstract Control Management desc */
-        0x02, /* bmCapabilities */
-
-        /* Union Functional Descriptor */
-        0x05, /* bFunctionLength */
-        0x24, /* bDescriptorType: CS_INTERFACE */
-        0x06, /* bDescriptorSubtype: Union func desc */
-        0x04, /* bMasterInterface: Communication class interface */
-        0x05, /* bSlaveInterface0: Data Class Interface */
-
-        /* Endpoint 2 Descriptor */
         0x07,                        /* bLength: Endpoint Descriptor size */
         USB_DESC_TYPE_ENDPOINT,      /* bDescriptorType: Endpoint */
-        CDC2_CMD_EP,                 /* bEndpointAddress */
-        0x03,                        /* bmAttributes: Interrupt */
-        LOBYTE(CDC_CMD_PACKET_SIZE), /* wMaxPacketSize: */
-        HIBYTE(CDC_CMD_PACKET_SIZE),
-        CDC_FS_BINTERVAL, /* bInterval: */
-        /*---------------------------------------------------------------------------*/
-
-        /* Data class interface descriptor */
-        0x09,                    /* bLength: Endpoint Descriptor size */
-        USB_DESC_TYPE_INTERFACE, /* bDescriptorType: */
-        0x05,                    /* bInterfaceNumber: Number of Interface */
-        0x00,                    /* bAlternateSetting: Alternate setting */
-        0x02,                    /* bNumEndpoints: Two endpoints used */
-        0x0A,                    /* bInterfaceClass: CDC */
-        0x00,                    /* bInterfaceSubClass: */
-        0x00,                    /* bInterfaceProtocol: */
-        0x00,                    /* iInterface: */
-
-        /* Endpoint OUT Descriptor */
-        0x07,                                /* bLength: Endpoint Descriptor size */
-        USB_DESC_TYPE_ENDPOINT,              /* bDescriptorType: Endpoint */
-        CDC2_OUT_EP,                         /* bEndpointAddress */
-        0x02,                                /* bmAttributes: Bulk */
-        LOBYTE(CDC_DATA_FS_MAX_PACKET_SIZE), /* wMaxPacketSize: */
-        HIBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),
-        0x00, /* bInterval: ignore for Bulk transfer */
-
-        /* Endpoint IN Descriptor */
-        0x07,                                /* bLength: Endpoint Descriptor size */
-        USB_DESC_TYPE_ENDPOINT,              /* bDescriptorType: Endpoint */
-        CDC2_IN_EP,                          /* bEndpointAddress */
-        0x02,                                /* bmAttributes: Bulk */
-        LOBYTE(CDC_DATA_FS_MAX_PACKET_SIZE), /* wMaxPacketSize: */
-        HIBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),
-        0x00,
+        CDC_MUX_IN_EP,               /* bEndpointAddress */
+        0x02,                        /* bmAttributes: Bulk */
+        LOBYTE(CDC_MUX_PACKET_SIZE), /* wMaxPacketSize: */
+        HIBYTE(CDC_MUX_PACKET_SIZE),
+        0x00 /* bInterval: ignore for Bulk transfer */
+#else
+        CDC_CHANNELS(CDC_CHANNEL_DESC)
 #endif
-#if (NUMBER_OF_CDC > 3)
-        /********************  CDC3 block ********************/
-        /******** IAD to associate he two CDC interfaces */
-        0x08, /* bLength */
-        0x0B, /* bDescriptorType */
-        0x06, /* bFirstInterface */
-        0x02, /* bInterfaceCount */
-        0x02, /* bFunctionClass */
-        0x02, /* bFunctionSubClass */
-        0x01, /* bFunctionProtocol */
-        0x00, /* iFunction (Index of string descriptor describing this function) */
-
-        /* Interface Descriptor */
-        0x09,                    /* bLength: Interface Descriptor size */
-        USB_DESC_TYPE_INTERFACE, /* bDescriptorType: Interface */
-        0x06,                    /* bInterfaceNumber: Number of Interface */
-        0x00,                    /* bAlternateSetting: Alternate setting */
-        0x01,                    /* bNumEndpoints: One endpoints used */
-        0x02,                    /* bInterfaceClass: Communication Interface Class */
-        0x02,                    /* bInterfaceSubClass: Abstract Control Model */
-        0x01,                    /* bInterfaceProtocol: Common AT commands */
-        0x00,                    /* iInterface: */
-
-        /* Header Functional Descriptor */
-        0x05, /* bLength: Endpoint Descriptor size */
-        0x24, /* bDescriptorType: CS_INTERFACE */
-        0x00, /* bDescriptorSubtype: Header Func Desc */
-        0x10, /* bcdCDC: spec release number */
-        0x01,
-
-        /* Call Management Functional Descriptor */
-        0x05, /* bFunctionLength */
-        0x24, /* bDescriptorType: CS_INTERFACE */
-        0x01, /* bDescriptorSubtype: Call Management Func Desc */
-        0x00, /* bmCapabilities: D0+D1 */
-        0x07, /* bDataInterface: 1 */
-
-        /* ACM Functional Descriptor */
-        0x04, /* bFunctionLength */
-        0x24, /* bDescriptorType: CS_INTERFACE */
-        0x02, /* bDescriptorSubtype: Abstract Control Management desc */
-        0x02, /* bmCapabilities */
-
-        /* Union Functional Descriptor */
-        0x05, /* bFunctionLength */
-        0x24, /* bDescriptorType: CS_INTERFACE */
-        0x06, /* bDescriptorSubtype: Union func desc */
-        0x06, /* bMasterInterface: Communication class interface */
-        0x07, /* bSlaveInterface0: Data Class Interface */
-
-        /* Endpoint 2 Descriptor */
-        0x07,                        /* bLength: Endpoint Descriptor size */
-        USB_DESC_TYPE_ENDPOINT,      /* bDescriptorType: Endpoint */
-        CDC3_CMD_EP,                 /* bEndpointAddress */
-        0x03,                        /* bmAttributes: Interrupt */
-        LOBYTE(CDC_CMD_PACKET_SIZE), /* wMaxPacketSize: */
-        HIBYTE(CDC_CMD_PACKET_SIZE),
-        CDC_FS_BINTERVAL, /* bInterval: */
-        /*---------------------------------------------------------------------------*/
-
-        /* Data class interface descriptor */
-        0x09,                    /* bLength: Endpoint Descriptor size */
-        USB_DESC_TYPE_INTERFACE, /* bDescriptorType: */
-        0x07,                    /* bInterfaceNumber: Number of Interface */
-        0x00,                    /* bAlternateSetting: Alternate setting */
-        0x02,                    /* bNumEndpoints: Two endpoints used */
-        0x0A,                    /* bInterfaceClass: CDC */
-        0x00,                    /* bInterfaceSubClass: */
-        0x00,                    /* bInterfaceProtocol: */
-        0x00,                    /* iInterface: */
-
-        /* Endpoint OUT Descriptor */
-        0x07,                                /* bLength: Endpoint Descriptor size */
-        USB_DESC_TYPE_ENDPOINT,              /* bDescriptorType: Endpoint */
-        CDC3_OUT_EP,                         /* bEndpointAddress */
-        0x02,                                /* bmAttributes: Bulk */
-        LOBYTE(CDC_DATA_FS_MAX_PACKET_SIZE), /* wMaxPacketSize: */
-        HIBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),
-        0x00, /* bInterval: ignore for Bulk transfer */
+};
 
-        /* Endpoint IN Descriptor */
-        0x07,                                /* bLength: Endpoint Descriptor size */
-        USB_DESC_TYPE_ENDPOINT,              /* bDescriptorType: Endpoint */
-        CDC3_IN_EP,                          /* bEndpointAddress */
-        0x02,                                /* bmAttributes: Bulk */
-        LOBYTE(CDC_DATA_FS_MAX_PACKET_SIZE), /* wMaxPacketSize: */
-        HIBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),
-        0x00, /* bInterval: ignore for Bulk transfer */
+#if ((CDC_VENDOR_CHANNELS != 0U) || (CDC_MUX != 0U))
+/* UTF-16LE character */
+#define CDC_W(c) (c), 0x00
+
+/* MS OS 2.0 function subset for one vendor channel (160 bytes): WinUSB
+   compatible ID and a DeviceInterfaceGUIDs property, the GUID's last digit
+   is the channel number */
+#define CDC_MS_OS_20_FUNCTION(n)                                                   \
+  /* Function subset header */                                                     \
+  0x08, 0x00,         /* wLength */                                                \
+  0x02, 0x00,         /* wDescriptorType: MS_OS_20_SUBSET_HEADER_FUNCTION */       \
+  CDC_COMM_ITF_OF(n), /* bFirstInterface */                                        \
+  0x00,               /* bReserved */                                              \
+  0xA0, 0x00,         /* wSubsetLength */                                          \
+                                                                                   \
+  /* Compatible ID */                                                              \
+  0x14, 0x00, /* wLength */                                                        \
+  0x03, 0x00, /* wDescriptorType: FEATURE_COMPATIBLE_ID */                         \
+  'W', 'I', 'N', 'U', 'S', 'B', 0x00, 0x00,       /* CompatibleID */               \
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* SubCompatibleID */            \
+                                                                                   \
+  /* Registry property */                                                          \
+  0x84, 0x00, /* wLength */                                                        \
+  0x04, 0x00, /* wDescriptorType: FEATURE_REG_PROPERTY */                          \
+  0x07, 0x00, /* wPropertyDataType: REG_MULTI_SZ */                                \
+  0x2A, 0x00, /* wPropertyNameLength */                                            \
+  CDC_W('D'), CDC_W('e'), CDC_W('v'), CDC_W('i'), CDC_W('c'), CDC_W('e'),          \
+  CDC_W('I'), CDC_W('n'), CDC_W('t'), CDC_W('e'), CDC_W('r'), CDC_W('f'),          \
+  CDC_W('a'), CDC_W('c'), CDC_W('e'), CDC_W('G'), CDC_W('U'), CDC_W('I'),          \
+  CDC_W('D'), CDC_W('s'), CDC_W(0x00),                                             \
+  0x50, 0x00, /* wPropertyDataLength */                                            \
+  CDC_W('{'), CDC_W('6'), CDC_W('E'), CDC_W('7'), CDC_W('F'), CDC_W('1'),          \
+  CDC_W('F'), CDC_W('0'), CDC_W('A'), CDC_W('-'), CDC_W('3'), CDC_W('C'),          \
+  CDC_W('2'), CDC_W('B'), CDC_W('-'), CDC_W('4'), CDC_W('D'), CDC_W('8'),          \
+  CDC_W('E'), CDC_W('-'), CDC_W('9'), CDC_W('A'), CDC_W('5'), CDC_W('1'),          \
+  CDC_W('-'), CDC_W('0'), CDC_W('C'), CDC_W('4'), CDC_W('B'), CDC_W('2'),          \
+  CDC_W('E'), CDC_W('3'), CDC_W('D'), CDC_W('7'), CDC_W('F'), CDC_W('1'),          \
+  CDC_W('0' + (n)), CDC_W('}'), CDC_W(0x00), CDC_W(0x00)
+
+/* MS OS 2.0 descriptor set, returned for the vendor request advertised in
+   the BOS platform capability */
+__ALIGN_BEGIN uint8_t USBD_CDC_MsOs20Desc[CDC_MS_OS_20_SET_SIZE] __ALIGN_END =
+    {
+        /* Descriptor set header */
+        0x0A, 0x00,             /* wLength */
+        0x00, 0x00,             /* wDescriptorType: MS_OS_20_SET_HEADER_DESCRIPTOR */
+        0x00, 0x00, 0x03, 0x06, /* dwWindowsVersion: Windows 8.1 */
+        LOBYTE(CDC_MS_OS_20_SET_SIZE), /* wTotalLength */
+        HIBYTE(CDC_MS_OS_20_SET_SIZE),
+
+        /* Configuration subset header */
+        0x08, 0x00, /* wLength */
+        0x01, 0x00, /* wDescriptorType: MS_OS_20_SUBSET_HEADER_CONFIGURATION */
+        0x00,       /* bConfigurationValue: first configuration */
+        0x00,       /* bReserved */
+        LOBYTE(CDC_MS_OS_20_SET_SIZE - 10U), /* wTotalLength */
+        HIBYTE(CDC_MS_OS_20_SET_SIZE - 10U),
+
+#if (CDC_MUX != 0U)
+        CDC_MS_OS_20_FUNCTION(0U)
+#else
+        CDC_MS_OS_20_FUNCTION_0
+        CDC_MS_OS_20_FUNCTION_1
+        CDC_MS_OS_20_FUNCTION_2
 #endif
 };
+#endif
 
 /**
   * @}
@@ -559,8 +501,25 @@ static uint8_t USBD_CDC_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
   uint8_t ret = 0U;
   USBD_CDC_HandleTypeDef *hcdc;
 
+#if (CDC_MUX != 0U)
+  /* Open the multiplexed EP IN and EP OUT */
+  USBD_LL_OpenEP(pdev, CDC_MUX_IN_EP, USBD_EP_TYPE_BULK, CDC_MUX_PACKET_SIZE);
+  pdev->ep_in[CDC_MUX_IN_EP & 0xFU].is_used = 1U;
+
+  USBD_LL_OpenEP(pdev, CDC_MUX_OUT_EP, USBD_EP_TYPE_BULK, CDC_MUX_PACKET_SIZE);
+  pdev->ep_out[CDC_MUX_OUT_EP & 0xFU].is_used = 1U;
+
+  Mux_In_Busy = 0U;
+  Mux_In_Size = 0U;
+  Mux_Out_Held = 0U;
+  Mux_Out_Active = 0U;
+  Mux_Rec_Done = 0U;
+  Mux_Zlp_Due = 0U;
+#endif
+
   for (uint8_t i = 0; i < NUMBER_OF_CDC; i++)
   {
+#if (CDC_MUX == 0U)
     if (pdev->dev_speed == USBD_SPEED_HIGH)
     {
       /* Open EP IN */
@@ -593,6 +552,7 @@ static uint8_t USBD_CDC_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
     /* Open Command IN EP */
     USBD_LL_OpenEP(pdev, CDC_CMD_EP[i], USBD_EP_TYPE_INTR, CDC_CMD_PACKET_SIZE);
     pdev->ep_in[CDC_CMD_EP[i] & 0xFU].is_used = 1U;
+#endif
 
     pdev->pClassDataCDC[i] = &CDC_Handle[i];
 
@@ -604,7 +564,16 @@ static uint8_t USBD_CDC_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
     /* Init Xfer states */
     hcdc->TxState = 0U;
     hcdc->RxState = 0U;
-
+    hcdc->NotifyState = 0U;
+    hcdc->TxDeferZlp = 0U;
+    hcdc->TxZlpOwed = 0U;
+
+#if (CDC_MUX != 0U)
+    /* The channel takes the records for it from the first OUT packet */
+    Mux_Tx_Pos[i] = 0U;
+    Mux_Rx_Armed[i] = 1U;
+    Mux_Rx_Fill[i] = 0U;
+#else
     if (pdev->dev_speed == USBD_SPEED_HIGH)
     {
       /* Prepare Out endpoint to receive next packet */
@@ -617,8 +586,14 @@ static uint8_t USBD_CDC_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
       USBD_LL_PrepareReceive(pdev, CDC_OUT_EP[i], hcdc->RxBuffer,
                              CDC_DATA_FS_OUT_PACKET_SIZE);
     }
+#endif
   }
 
+#if (CDC_MUX != 0U)
+  /* Prepare Out endpoint to receive next packet */
+  USBD_LL_PrepareReceive(pdev, CDC_MUX_OUT_EP, Mux_Out_Packet, CDC_MUX_PACKET_SIZE);
+#endif
+
   return ret;
 }
 
@@ -633,8 +608,18 @@ static uint8_t USBD_CDC_DeInit(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
 {
   uint8_t ret = 0U;
 
+#if (CDC_MUX != 0U)
+  /* Close the multiplexed EP IN and EP OUT */
+  USBD_LL_CloseEP(pdev, CDC_MUX_IN_EP);
+  pdev->ep_in[CDC_MUX_IN_EP & 0xFU].is_used = 0U;
+
+  USBD_LL_CloseEP(pdev, CDC_MUX_OUT_EP);
+  pdev->ep_out[CDC_MUX_OUT_EP & 0xFU].is_used = 0U;
+#endif
+
   for (uint8_t i = 0; i < NUMBER_OF_CDC; i++)
   {
+#if (CDC_MUX == 0U)
     /* Close EP IN */
     USBD_LL_CloseEP(pdev, CDC_IN_EP[i]);
     pdev->ep_in[CDC_IN_EP[i] & 0xFU].is_used = 0U;
@@ -646,6 +631,7 @@ static uint8_t USBD_CDC_DeInit(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
     /* Close Command IN EP */
     USBD_LL_CloseEP(pdev, CDC_CMD_EP[i]);
     pdev->ep_in[CDC_CMD_EP[i] & 0xFU].is_used = 0U;
+#endif
 
     /* DeInit  physical Interface components */
     if (pdev->pClassDataCDC[i] != NULL)
@@ -671,13 +657,52 @@ static uint8_t USBD_CDC_Setup(USBD_HandleTypeDef *pdev,
   uint16_t status_info = 0U;
   uint8_t ret = USBD_OK;
 
-  uint8_t cdc_index = W_Index_To_Interface[req->wIndex];
-  USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef *)pdev->pClassDataCDC[cdc_index];
+  uint8_t cdc_index = 0U;
+  USBD_CDC_HandleTypeDef *hcdc;
+
+#if ((CDC_VENDOR_CHANNELS != 0U) || (CDC_MUX != 0U))
+  /* MS OS 2.0 descriptor set, a vendor request to the device */
+  if ((req->bmRequest == 0xC0U) && (req->bRequest == CDC_MS_VENDOR_CODE) &&
+      (req->wIndex == CDC_MS_GET_DESCRIPTOR_SET))
+  {
+    USBD_CtlSendData(pdev, USBD_CDC_MsOs20Desc, MIN(req->wLength, sizeof(USBD_CDC_MsOs20Desc)));
+    return ret;
+  }
+#endif
+
+  /* Device and endpoint recipients carry no interface number in wIndex */
+#if (CDC_MUX != 0U)
+  if (((req->bmRequest & USB_REQ_RECIPIENT_MASK) == USB_REQ_RECIPIENT_INTERFACE) &&
+      (HIBYTE(req->wIndex) < NUMBER_OF_CDC))
+  {
+    /* One interface, the channel in the high byte */
+    cdc_index = HIBYTE(req->wIndex);
+  }
+#else
+  if (((req->bmRequest & USB_REQ_RECIPIENT_MASK) == USB_REQ_RECIPIENT_INTERFACE) &&
+      (LOBYTE(req->wIndex) < sizeof(W_Index_To_Interface)))
+  {
+    cdc_index = W_Index_To_Interface[LOBYTE(req->wIndex)];
+  }
+#endif
+  else if ((req->bmRequest & USB_REQ_TYPE_MASK) == USB_REQ_TYPE_VENDOR)
+  {
+    USBD_CtlError(pdev, req);
+    return USBD_FAIL;
+  }
+
+  hcdc = (USBD_CDC_HandleTypeDef *)pdev->pClassDataCDC[cdc_index];
 
   switch (req->bmRequest & USB_REQ_TYPE_MASK)
   {
   case USB_REQ_TYPE_CLASS:
-    if (req->wLength)
+    if (hcdc == NULL)
+    {
+      /* Not configured yet, or the channel went away with a reset */
+      USBD_CtlError(pdev, req);
+      ret = USBD_FAIL;
+    }
+    else if (req->wLength)
     {
       if (req->bmRequest & 0x80U)
       {
@@ -689,6 +714,7 @@ static uint8_t USBD_CDC_Setup(USBD_HandleTypeDef *pdev,
       {
         hcdc->CmdOpCode = req->bRequest;
         hcdc->CmdLength = (uint8_t)req->wLength;
+        Cmd_Cdc_Index = cdc_index;
 
         USBD_CtlPrepareRx(pdev, (uint8_t *)(void *)hcdc->data, req->wLength);
       }
@@ -699,6 +725,30 @@ static uint8_t USBD_CDC_Setup(USBD_HandleTypeDef *pdev,
     }
     break;
 
+  case USB_REQ_TYPE_VENDOR:
+    if (req->bmRequest & 0x80U)
+    {
+      /* Vendor reads answer from the channel's control buffer */
+      if ((hcdc == NULL) || (req->wLength == 0U) || (req->wLength > sizeof(hcdc->data)) ||
+          (((USBD_CDC_ItfTypeDef *)pdev->pUserDataCDC)->Control(cdc_index, req->bRequest, (uint8_t *)(void *)hcdc->data, req->wLength) != USBD_OK))
+      {
+        USBD_CtlError(pdev, req);
+        ret = USBD_FAIL;
+      }
+      else
+      {
+        USBD_CtlSendData(pdev, (uint8_t *)(void *)hcdc->data, req->wLength);
+      }
+    }
+    /* Vendor settings carry their parameter in wValue, no data stage */
+    else if ((req->wLength != 0U) ||
+             (((USBD_CDC_ItfTypeDef *)pdev->pUserDataCDC)->Control(cdc_index, req->bRequest, (uint8_t *)(void *)req, 0U) != USBD_OK))
+    {
+      USBD_CtlError(pdev, req);
+      ret = USBD_FAIL;
+    }
+    break;
+
   case USB_REQ_TYPE_STANDARD:
     switch (req->bRequest)
     {
@@ -759,6 +809,15 @@ static uint8_t USBD_CDC_Setup(USBD_HandleTypeDef *pdev,
   */
 static uint8_t USBD_CDC_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
 {
+#if (CDC_MUX != 0U)
+  if (epnum == (CDC_MUX_IN_EP & 0xFU))
+  {
+    /* Packet sent, the next one from what the channels have queued */
+    Mux_In_Busy = 0U;
+    USBD_CDC_Mux_In(pdev);
+  }
+  return USBD_OK;
+#else
   PCD_HandleTypeDef *hpcd = pdev->pData;
 
   uint8_t cdc_index = EP_In_To_Interface[epnum];
@@ -766,13 +825,28 @@ static uint8_t USBD_CDC_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
 
   if (pdev->pClassDataCDC[cdc_index] != NULL)
   {
-    if ((pdev->ep_in[epnum].total_length > 0U) && ((pdev->ep_in[epnum].total_length % hpcd->IN_ep[epnum].maxpacket) == 0U))
+    if (epnum == (CDC_CMD_EP[cdc_index] & 0xFU))
+    {
+      /* Notification sent, never a multiple of the packet size */
+      hcdc->NotifyState = 0U;
+    }
+    else if ((pdev->ep_in[epnum].total_length > 0U) && ((pdev->ep_in[epnum].total_length % hpcd->IN_ep[epnum].maxpacket) == 0U))
     {
       /* Update the packet total length */
       pdev->ep_in[epnum].total_length = 0U;
 
-      /* Send ZLP */
-      USBD_LL_Transmit(pdev, epnum, NULL, 0U);
+      if (hcdc->TxDeferZlp != 0U)
+      {
+        /* Mid-stream, the next transfer continues the host read. The
+           interface sends the ZLP if the stream goes idle instead */
+        hcdc->TxZlpOwed = 1U;
+        hcdc->TxState = 0U;
+      }
+      else
+      {
+        /* Send ZLP */
+        USBD_LL_Transmit(pdev, epnum, NULL, 0U);
+      }
     }
     else
     {
@@ -784,6 +858,7 @@ static uint8_t USBD_CDC_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
   {
     return USBD_FAIL;
   }
+#endif
 }
 
 /**
@@ -795,6 +870,14 @@ static uint8_t USBD_CDC_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
   */
 static uint8_t USBD_CDC_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum)
 {
+#if (CDC_MUX != 0U)
+  /* Held, NAKed, until every record is in a channel slot */
+  Mux_Out_Len = USBD_LL_GetRxDataSize(pdev, epnum);
+  Mux_Out_Pos = 0U;
+  Mux_Out_Held = 1U;
+  USBD_CDC_Mux_Out(pdev);
+  return USBD_OK;
+#else
   uint8_t cdc_index = EP_Out_To_Interface[epnum];
   USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef *)pdev->pClassDataCDC[cdc_index];
 
@@ -813,8 +896,192 @@ static uint8_t USBD_CDC_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum)
   {
     return USBD_FAIL;
   }
+#endif
 }
 
+#if (CDC_MUX != 0U)
+/**
+  * @brief  USBD_CDC_Mux_In
+  *         Pack what the channels queued into the next IN packet, round robin
+  *         so a busy channel cannot starve the others. Transfers are copied
+  *         out, the channel's buffer is free once its last record is packed
+  * @param  pdev: device instance
+  * @retval None
+  */
+static void USBD_CDC_Mux_In(USBD_HandleTypeDef *pdev)
+{
+  USBD_CDC_HandleTypeDef *hcdc;
+  uint8_t cdc_index;
+  uint32_t size = 0U;
+  uint32_t left;
+  uint32_t len;
+
+  if (Mux_In_Busy != 0U)
+  {
+    return;
+  }
+
+  for (uint8_t i = 0U; i < NUMBER_OF_CDC; i++)
+  {
+    cdc_index = (Mux_In_First + i) % NUMBER_OF_CDC;
+    hcdc = (USBD_CDC_HandleTypeDef *)pdev->pClassDataCDC[cdc_index];
+
+    if (hcdc == NULL)
+    {
+      continue;
+    }
+
+    if ((hcdc->NotifyState != 0U) && ((size + CDC_MUX_HEADER_SIZE + 2U) <= CDC_MUX_PACKET_SIZE))
+    {
+      Mux_In_Packet[size + 0U] = CDC_MUX_SERIAL_STATE | cdc_index;
+      Mux_In_Packet[size + 1U] = 2U;
+      Mux_In_Packet[size + 2U] = hcdc->Notification[8];
+      Mux_In_Packet[size + 3U] = hcdc->Notification[9];
+      size += CDC_MUX_HEADER_SIZE + 2U;
+      hcdc->NotifyState = 0U;
+    }
+
+    if (hcdc->TxState != 0U)
+    {
+      left = hcdc->TxLength - Mux_Tx_Pos[cdc_index];
+
+      if ((size + CDC_MUX_HEADER_SIZE) < CDC_MUX_PACKET_SIZE)
+      {
+        len = MIN(left, CDC_MUX_PACKET_SIZE - CDC_MUX_HEADER_SIZE - size);
+
+        if (len != 0U)
+        {
+          Mux_In_Packet[size + 0U] = ((len == left) ? CDC_MUX_END : CDC_MUX_DATA) | cdc_index;
+          Mux_In_Packet[size + 1U] = (uint8_t)len;
+          memcpy(&Mux_In_Packet[size + CDC_MUX_HEADER_SIZE], &hcdc->TxBuffer[Mux_Tx_Pos[cdc_index]], len);
+          size += CDC_MUX_HEADER_SIZE + len;
+          Mux_Tx_Pos[cdc_index] += len;
+          left -= len;
+        }
+      }
+
+      if (left == 0U)
+      {
+        Mux_Tx_Pos[cdc_index] = 0U;
+        hcdc->TxState = 0U;
+      }
+    }
+  }
+
+  Mux_In_First = (Mux_In_First + 1U) % NUMBER_OF_CDC;
+
+  if (size != 0U)
+  {
+    Mux_In_Busy = 1U;
+    Mux_In_Size = size;
+    USBD_LL_Transmit(pdev, CDC_MUX_IN_EP, Mux_In_Packet, (uint16_t)size);
+  }
+  else if (Mux_In_Size == CDC_MUX_PACKET_SIZE)
+  {
+    /* Gone idle after a full packet, close the host read */
+    Mux_In_Busy = 1U;
+    Mux_In_Size = 0U;
+    USBD_LL_Transmit(pdev, CDC_MUX_IN_EP, NULL, 0U);
+  }
+}
+
+/**
+  * @brief  USBD_CDC_Mux_Out
+  *         Hand the records of the OUT packet to their channels, filling the
+  *         channel's slot as its own OUT endpoint would: full slots, then a
+  *         short one or a ZLP where a CDC_MUX_END record closes the transfer.
+  *         Stops at a channel with no slot, its ReceivePacket resumes here
+  * @param  pdev: device instance
+  * @retval None
+  */
+static void USBD_CDC_Mux_Out(USBD_HandleTypeDef *pdev)
+{
+  USBD_CDC_HandleTypeDef *hcdc;
+  uint8_t *record;
+  uint8_t cdc_index;
+  uint8_t end;
+  uint32_t len;
+  uint32_t chunk;
+
+  if ((Mux_Out_Held == 0U) || (Mux_Out_Active != 0U))
+  {
+    return;
+  }
+  Mux_Out_Active = 1U;
+
+  while (Mux_Out_Pos < Mux_Out_Len)
+  {
+    record = &Mux_Out_Packet[Mux_Out_Pos];
+
+    if (((Mux_Out_Pos + CDC_MUX_HEADER_SIZE) > Mux_Out_Len) ||
+        ((Mux_Out_Pos + CDC_MUX_HEADER_SIZE + record[1]) > Mux_Out_Len))
+    {
+      /* Record cut by the end of the packet, the rest is dropped */
+      break;
+    }
+
+    cdc_index = record[0] & CDC_MUX_CHANNEL_MASK;
+    len = record[1];
+    end = ((record[0] & CDC_MUX_TYPE_MASK) == CDC_MUX_END);
+    hcdc = (cdc_index < NUMBER_OF_CDC) ? (USBD_CDC_HandleTypeDef *)pdev->pClassDataCDC[cdc_index] : NULL;
+
+    if ((hcdc == NULL) || ((record[0] & CDC_MUX_TYPE_MASK) > CDC_MUX_END))
+    {
+      Mux_Out_Pos += CDC_MUX_HEADER_SIZE + len;
+      continue;
+    }
+
+    if (Mux_Rx_Armed[cdc_index] == 0U)
+    {
+      /* Channel full, the packet waits */
+      Mux_Out_Active = 0U;
+      return;
+    }
+
+    if (Mux_Zlp_Due == 0U)
+    {
+      chunk = MIN(len - Mux_Rec_Done, CDC_DATA_FS_OUT_PACKET_SIZE - Mux_Rx_Fill[cdc_index]);
+      memcpy(&hcdc->RxBuffer[Mux_Rx_Fill[cdc_index]], &record[CDC_MUX_HEADER_SIZE + Mux_Rec_Done], chunk);
+      Mux_Rx_Fill[cdc_index] += chunk;
+      Mux_Rec_Done += chunk;
+
+      if ((Mux_Rx_Fill[cdc_index] < CDC_DATA_FS_OUT_PACKET_SIZE) && (end == 0U))
+      {
+        /* Slot not full, the transfer goes on in a later record */
+        Mux_Out_Pos += CDC_MUX_HEADER_SIZE + len;
+        Mux_Rec_Done = 0U;
+        continue;
+      }
+
+      Mux_Zlp_Due = (end != 0U) && (Mux_Rec_Done == len) && (Mux_Rx_Fill[cdc_index] == CDC_DATA_FS_OUT_PACKET_SIZE);
+    }
+    else
+    {
+      Mux_Zlp_Due = 0U;
+    }
+
+    if ((Mux_Rec_Done == len) && (Mux_Zlp_Due == 0U))
+    {
+      Mux_Out_Pos += CDC_MUX_HEADER_SIZE + len;
+      Mux_Rec_Done = 0U;
+    }
+
+    hcdc->RxLength = Mux_Rx_Fill[cdc_index];
+    Mux_Rx_Fill[cdc_index] = 0U;
+    Mux_Rx_Armed[cdc_index] = 0U;
+
+    ((USBD_CDC_ItfTypeDef *)pdev->pUserDataCDC)->Receive(cdc_index, hcdc->RxBuffer, &hcdc->RxLength);
+  }
+
+  /* Every record handed out */
+  Mux_Out_Held = 0U;
+  Mux_Out_Active = 0U;
+  Mux_Rec_Done = 0U;
+  Mux_Zlp_Due = 0U;
+  USBD_LL_PrepareReceive(pdev, CDC_MUX_OUT_EP, Mux_Out_Packet, CDC_MUX_PACKET_SIZE);
+}
+#endif
+
 /**
   * @brief  USBD_CDC_EP0_RxReady
   *         Handle EP0 Rx Ready event
@@ -823,15 +1090,22 @@ static uint8_t USBD_CDC_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum)
   */
 static uint8_t USBD_CDC_EP0_RxReady(USBD_HandleTypeDef *pdev)
 {
-  for (uint8_t i = 0; i < NUMBER_OF_CDC; i++)
+  USBD_CDC_HandleTypeDef *hcdc;
+  uint8_t cdc_index = Cmd_Cdc_Index;
+
+  /* Only the channel the setup stage addressed */
+  Cmd_Cdc_Index = 0xFFU;
+  if (cdc_index >= NUMBER_OF_CDC)
   {
-    USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef *)pdev->pClassDataCDC[i];
+    return USBD_OK;
+  }
 
-    if ((pdev->pUserDataCDC != NULL) && (hcdc->CmdOpCode != 0xFFU))
-    {
-      ((USBD_CDC_ItfTypeDef *)pdev->pUserDataCDC)->Control(i, hcdc->CmdOpCode, (uint8_t *)(void *)hcdc->data, (uint16_t)hcdc->CmdLength);
-      hcdc->CmdOpCode = 0xFFU;
-    }
+  hcdc = (USBD_CDC_HandleTypeDef *)pdev->pClassDataCDC[cdc_index];
+
+  if ((pdev->pUserDataCDC != NULL) && (hcdc != NULL) && (hcdc->CmdOpCode != 0xFFU))
+  {
+    ((USBD_CDC_ItfTypeDef *)pdev->pUserDataCDC)->Control(cdc_index, hcdc->CmdOpCode, (uint8_t *)(void *)hcdc->data, (uint16_t)hcdc->CmdLength);
+    hcdc->CmdOpCode = 0xFFU;
   }
 
   return USBD_OK;
@@ -934,7 +1208,13 @@ uint8_t USBD_CDC_TransmitPacket(uint8_t cdc_index, USBD_HandleTypeDef *pdev)
     {
       /* Tx Transfer in progress */
       hcdc->TxState = 1U;
+      hcdc->TxZlpOwed = 0U;
 
+#if (CDC_MUX != 0U)
+      /* Packed into the multiplexed IN packets */
+      Mux_Tx_Pos[cdc_index] = 0U;
+      USBD_CDC_Mux_In(pdev);
+#else
       /* Update the packet total length */
       pdev->ep_in[CDC_IN_EP[cdc_index] & 0xFU].total_length = hcdc->TxLength;
 
@@ -942,6 +1222,7 @@ uint8_t USBD_CDC_TransmitPacket(uint8_t cdc_index, USBD_HandleTypeDef *pdev)
       USBD_LL_Transmit(pdev, CDC_IN_EP[cdc_index],
                        hcdc->TxBuffer,
                        (uint16_t)hcdc->TxLength);
+#endif
 
       return USBD_OK;
     }
@@ -956,6 +1237,52 @@ uint8_t USBD_CDC_TransmitPacket(uint8_t cdc_index, USBD_HandleTypeDef *pdev)
   }
 }
 
+/**
+  * @brief  USBD_CDC_SendSerialState
+  *         Send a SERIAL_STATE notification on the command endpoint
+  * @param  pdev: device instance
+  * @param  serial_state: CDC_SERIAL_STATE_xxx bitmap
+  * @retval status, USBD_BUSY while the previous notification is in flight
+  */
+uint8_t USBD_CDC_SendSerialState(uint8_t cdc_index,
+                                 USBD_HandleTypeDef *pdev,
+                                 uint16_t serial_state)
+{
+  USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef *)pdev->pClassDataCDC[cdc_index];
+
+  if ((hcdc == NULL) || (pdev->dev_state != USBD_STATE_CONFIGURED))
+  {
+    return USBD_FAIL;
+  }
+
+  if (hcdc->NotifyState != 0U)
+  {
+    return USBD_BUSY;
+  }
+
+  hcdc->NotifyState = 1U;
+
+  hcdc->Notification[0] = 0xA1U; /* bmRequestType: device to host, class, interface */
+  hcdc->Notification[1] = CDC_SERIAL_STATE;
+  hcdc->Notification[2] = 0x00U; /* wValue */
+  hcdc->Notification[3] = 0x00U;
+  hcdc->Notification[4] = (uint8_t)CDC_COMM_ITF_OF(cdc_index); /* wIndex: communication interface */
+  hcdc->Notification[5] = 0x00U;
+  hcdc->Notification[6] = 0x02U; /* wLength */
+  hcdc->Notification[7] = 0x00U;
+  hcdc->Notification[8] = LOBYTE(serial_state);
+  hcdc->Notification[9] = HIBYTE(serial_state);
+
+#if (CDC_MUX != 0U)
+  /* Goes as a CDC_MUX_SERIAL_STATE record */
+  USBD_CDC_Mux_In(pdev);
+#else
+  USBD_LL_Transmit(pdev, CDC_CMD_EP[cdc_index], hcdc->Notification, CDC_NOTIFICATION_SIZE);
+#endif
+
+  return USBD_OK;
+}
+
 /**
   * @brief  USBD_CDC_ReceivePacket
   *         prepare OUT Endpoint for reception
@@ -967,8 +1294,14 @@ uint8_t USBD_CDC_ReceivePacket(uint8_t cdc_index, USBD_HandleTypeDef *pdev)
   USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef *)pdev->pClassDataCDC[cdc_index];
 
   /* Suspend or Resume USB Out process */
-  if (pdev->pClassDataCDC[cdc_index] != NULL)
+  if (hcdc != NULL)
   {
+#if (CDC_MUX != 0U)
+    /* A new slot, records held for the channel go on into it */
+    Mux_Rx_Armed[cdc_index] = 1U;
+    Mux_Rx_Fill[cdc_index] = 0U;
+    USBD_CDC_Mux_Out(pdev);
+#else
     if (pdev->dev_speed == USBD_SPEED_HIGH)
     {
       /* Prepare Out endpoint to receive next packet */
@@ -985,6 +1318,7 @@ uint8_t USBD_CDC_ReceivePacket(uint8_t cdc_index, USBD_HandleTypeDef *pdev)
                              hcdc->RxBuffer,
                              CDC_DATA_FS_OUT_PACKET_SIZE);
     }
+#endif
     return USBD_OK;
   }
   else
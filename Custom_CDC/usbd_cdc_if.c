@@ -51,7 +51,43 @@
   */
 
 /* USER CODE BEGIN PRIVATE_TYPES */
-
+/** What a channel is wired to, one constant entry per channel */
+typedef struct
+{
+  UART_HandleTypeDef *huart; /* its DMA handles are huart->hdmatx and huart->hdmarx */
+  GPIO_TypeDef *DTR_Port;    /* modem outputs, active low (Modem_GPIO_Init) */
+  uint16_t DTR_Pin;
+  GPIO_TypeDef *RTS_Port;
+  uint16_t RTS_Pin;
+  GPIO_TypeDef *DCD_Port;    /* modem inputs, active low (Modem_GPIO_Init) */
+  uint16_t DCD_Pin;
+  GPIO_TypeDef *DSR_Port;
+  uint16_t DSR_Pin;
+  GPIO_TypeDef *RI_Port;
+  uint16_t RI_Pin;
+  GPIO_TypeDef *CTS_Port;
+  uint16_t CTS_Pin;
+  GPIO_TypeDef *TX_Port;     /* held low as GPIO for the length of a break */
+  uint16_t TX_Pin;
+} CDC_Channel_TypeDef;
+
+/** Boot defaults of a channel, one record of the active config page.
+    Records are appended, the last valid one of a channel counts. Slot 0 of
+    a page is its header, Channel CONFIG_HEADER and Bitrate the sequence */
+typedef struct
+{
+  uint16_t Magic;       /* CONFIG_MAGIC, a blank slot reads 0xFFFF */
+  uint8_t Channel;
+  uint8_t Flow_Control; /* CDC_FLOW_CONTROL_xxx */
+  uint32_t Bitrate;     /* 0 for the 115200 of Change_UART_Setting */
+  uint8_t Format;
+  uint8_t Parity_Type;
+  uint8_t Data_Type;
+  uint8_t Latency_Ms;
+  uint8_t Packet_Mode;  /* CDC_PACKET_xxx */
+  uint8_t Stored;       /* 0: forgotten, the factory defaults from here on */
+  uint16_t Check;       /* complement of the sum of the half words above */
+} CDC_Config_TypeDef;
 /* USER CODE END PRIVATE_TYPES */
 
 /**
@@ -64,6 +100,60 @@
   */
 
 /* USER CODE BEGIN PRIVATE_DEFINES */
+/* Flow control hysteresis on the UART to USB ring */
+#define RX_HIGH_WATERMARK (APP_TX_DATA_SIZE * 3U / 4U)
+#define RX_LOW_WATERMARK (APP_TX_DATA_SIZE / 4U)
+
+#define XON_CHAR 0x11U
+#define XOFF_CHAR 0x13U
+
+/* IN latency timer before CDC_VENDOR_SET_LATENCY, the former fixed tick */
+#define DEFAULT_LATENCY_MS 5U
+/* Longest wait past the latency timer of a short packet while the line is busy */
+#define MAX_HOLD_MS 16U
+
+/* Config pages: the last two 1K pages of the 64K part, left out of FLASH by
+   the linker script. Records go to the active page, a full one is copied to
+   the other, whose header is written last. 63 records per erase */
+#define CONFIG_PAGE_A 0x0800F800U
+#define CONFIG_PAGE_B 0x0800FC00U
+#define CONFIG_HEADER 0x80U
+#define CONFIG_SLOTS (FLASH_PAGE_SIZE / sizeof(CDC_Config_TypeDef))
+#define CONFIG_HALF_WORDS (sizeof(CDC_Config_TypeDef) / 2U)
+#define CONFIG_MAGIC 0xC0F1U
+
+/* SEND_BREAK wValue holding the break until a SEND_BREAK of 0 */
+#define BREAK_UNTIL_CLEARED 0xFFFFU
+
+/* RS-485 driver enable */
+#define DE_IDLE 0U    /* released, receiving */
+#define DE_SETUP 1U   /* asserted, pre guard time running */
+#define DE_DRIVING 2U /* asserted, transmitting */
+#define DE_HOLD 3U    /* asserted, post guard time running after TC */
+
+/* Modbus RTU framing, packet mode */
+#define IN_BUFFER_SIZE 256U /* largest RTU ADU, longer spans go in IN_CHUNK_SIZE transfers */
+#define FRAME_QUEUE_SIZE 8U    /* completed frames waiting for the IN endpoint */
+#define IN_CHUNK_SIZE (IN_BUFFER_SIZE - (IN_BUFFER_SIZE % CDC_DATA_FS_IN_PACKET_SIZE)) /* whole packets */
+#define FRAME_TIMER_NONE 0U
+#define FRAME_TIMER_T15 1U /* checking the line for a 1.5 character gap */
+#define FRAME_TIMER_T35 2U /* checking the line for a 3.5 character gap */
+
+/* Timestamp records */
+#define BURST_QUEUE_SIZE 16U    /* bursts in the ring not sent yet */
+#define RECORD_BUFFER_SIZE 288U /* records of one IN transfer, 6 full packets */
+
+/* Packet mode */
+#define SLIP_END 0xC0U
+#define SLIP_ESC 0xDBU
+#define SLIP_ESC_END 0xDCU
+#define SLIP_ESC_ESC 0xDDU
+#define COBS_MAX_RUN 254U       /* data bytes of a 0xFF block */
+#define ENCODE_CHUNK_SIZE 128U  /* encoded data per UART DMA */
+#define ENC_IDLE 0U             /* no packet from USB being encoded */
+#define ENC_BLOCK 1U            /* COBS code byte or SLIP leading END next */
+#define ENC_DATA 2U
+#define ENC_END 3U              /* delimiter next */
 /* USER CODE END PRIVATE_DEFINES */
 
 /**
@@ -93,16 +183,140 @@
 #define APP_RX_DATA_SIZE 1024
 #define APP_TX_DATA_SIZE 1024
 
-/** RX buffer for USB */
+/** RX buffer for USB, OUT ring in stream mode, one whole transfer in packet mode */
 uint8_t RX_Buffer[NUMBER_OF_CDC][APP_RX_DATA_SIZE];
 
 /** TX buffer for USB, RX buffer for UART */
 uint8_t TX_Buffer[NUMBER_OF_CDC][APP_TX_DATA_SIZE];
 
-USBD_CDC_LineCodingTypeDef Line_Coding[NUMBER_OF_CDC];
-
-uint32_t Write_Index[NUMBER_OF_CDC]; /* keep track of received data over UART */
-uint32_t Read_Index[NUMBER_OF_CDC];  /* keep track of sent data to USB */
+/** Everything a channel changes at run time, one entry per channel, reached
+    through one base pointer. The rings and transfer buffers (RX_Buffer,
+    TX_Buffer, Record_Buffer, In_Buffer, Encode_Buffer) stay separate arrays
+    and so does Boot_Config, the image of the flash records */
+typedef struct
+{
+  USBD_CDC_LineCodingTypeDef Line_Coding;
+
+  uint32_t Write_Index;  /* keep track of received data over UART */
+  uint32_t Read_Index;   /* keep track of sent data to USB */
+  uint32_t Rx_Dma_Index; /* circular RX DMA position processed so far, at or ahead of Write_Index */
+
+  /* Word length emulation, applied over whole spans (CDC_Mask_Span), 0 when unused */
+  uint8_t Tx_Set_Mask;
+  uint8_t Tx_Clear_Mask;
+  uint8_t Rx_Clear_Mask;
+
+  uint8_t Latency_Ms;       /* longest wait of UART data for the IN endpoint */
+  uint16_t Latency_Elapsed; /* ms since the last IN transfer, saturating past Latency_Ms + MAX_HOLD_MS */
+  uint16_t Fill_Threshold;  /* ring level sent without waiting, 0 when off */
+  uint8_t Rx_Idle;          /* UART line idle since the last data, short packets may go */
+
+  uint8_t Flow_Control; /* CDC_FLOW_CONTROL_xxx */
+  uint8_t Rx_Hold;      /* far end stopped (RTS released or XOFF sent) until the ring drains */
+
+  /* UART TX engine, USB OUT data stays in RX_Buffer until the UART is done with it */
+  uint8_t *Tx_Pending_Buf;
+  uint32_t Tx_Pending_Len; /* USB data waiting for the UART */
+  uint8_t Tx_Data_Busy;    /* USB data on the DMA, possibly paused */
+  uint8_t Tx_Paused;       /* XOFF received from the device */
+  uint32_t Tx_Gaps;        /* times the line went idle with OUT data waiting, CDC_VENDOR_GET_TX_GAPS */
+  __IO uint8_t Flow_Char;  /* XON/XOFF waiting to be inserted, 0 if none */
+
+  /* Stream mode OUT ring in RX_Buffer, packets land where the UART DMA reads them */
+  uint32_t Out_Head;      /* slot the OUT endpoint writes next */
+  uint32_t Out_Tail;      /* oldest byte the UART has not sent */
+  uint32_t Out_Wrap;      /* end of the data when the head went back to the bottom */
+  uint32_t Out_Dma_Len;   /* bytes from Out_Tail on the UART DMA */
+  uint8_t Out_Armed;      /* OUT endpoint holds a slot */
+  uint16_t Flow_Char_Buf; /* 9 bit frames are sent from 16 bit data */
+
+  uint16_t Multidrop; /* CDC_MULTIDROP_ENABLE | node address, 0 when off */
+
+  uint8_t Control_Line_State; /* CDC_CONTROL_LINE_xxx set by the host */
+  uint8_t Dtr_Gating;         /* port closed (DTR deasserted) drops UART data */
+
+  uint16_t Break_Request; /* SEND_BREAK wValue waiting for the UART to go idle, 0 if none */
+  uint8_t Break_Active;   /* TX pin held low, UART TX queue on hold */
+
+  uint16_t Serial_State_Lines;  /* modem inputs last reported to the host */
+  uint16_t Serial_State_Errors; /* UART errors not reported yet */
+
+  uint8_t Rs485;        /* RTS pin is the transceiver DE, high while driving the bus */
+  uint16_t Rs485_Guard; /* (post << 8) | pre guard time, in bit times */
+  uint8_t De_State;     /* DE_xxx, UART data received while not DE_IDLE is our echo */
+
+  uint8_t Modbus;                       /* ring goes to USB a whole frame per transfer */
+  uint16_t Frame_End[FRAME_QUEUE_SIZE]; /* Write_Index at the end of each completed frame */
+  uint8_t Frame_First;
+  uint8_t Frame_Count;
+  uint8_t Frame_Timer;                  /* FRAME_TIMER_xxx */
+  uint8_t Frame_Broken;                 /* frame resumed after a 1.5 to 3.5 character gap */
+  uint32_t Frame_Mark;                  /* RX DMA position when the gap timing started */
+  uint32_t Frame_Wait_Us[2];            /* idle line to the 1.5 check, then to the 3.5 check */
+
+  uint32_t Char_Us; /* one character on the wire at the current line coding */
+
+  uint8_t Timestamps;                     /* ring goes to USB as timestamp records */
+  uint8_t Burst_Armed;                    /* line idle, RXNE interrupt waiting for the next burst */
+  uint8_t Burst_Timed;                    /* Burst_Time taken by the RXNE interrupt */
+  uint32_t Burst_Mark;                    /* RX DMA counter when armed */
+  uint32_t Burst_Time;                    /* start of the burst being received */
+  uint16_t Burst_Start[BURST_QUEUE_SIZE]; /* Write_Index at the first byte of each burst */
+  uint32_t Burst_Stamp[BURST_QUEUE_SIZE];
+  uint8_t Burst_First;
+  uint8_t Burst_Count;
+  uint32_t Burst_Current;                 /* timestamp of the data at Read_Index */
+
+  uint8_t Packet_Mode; /* CDC_PACKET_xxx, decoded packets go to USB as frames */
+  uint8_t Dec_Code;    /* COBS code byte of the block being decoded, 0 at packet start */
+  uint8_t Dec_Left;    /* COBS data bytes left in the block */
+  uint8_t Dec_Esc;     /* SLIP escape received */
+  uint32_t Out_Len;    /* USB transfer gathered in RX_Buffer so far */
+  uint32_t Enc_Pos;    /* next byte of the transfer to encode */
+  uint32_t Enc_Len;
+  uint8_t Enc_Step;    /* ENC_xxx */
+  uint8_t Enc_Run;     /* COBS data bytes of the block left to copy */
+  uint8_t Enc_Short;   /* COBS block shorter than COBS_MAX_RUN, a data zero ends it */
+} CDC_Context_TypeDef;
+
+CDC_Context_TypeDef CDC_Ctx[NUMBER_OF_CDC];
+
+uint8_t Settings_Due; /* bit n: channel n's UART reconfiguration waits for CDC_Apply_Settings */
+
+/** Channel n is UART n + 1 */
+#define CDC_CHANNEL_0 {&huart1, UART1_DTR_GPIO_Port, UART1_DTR_Pin, UART1_RTS_GPIO_Port, UART1_RTS_Pin, \
+                       UART1_DCD_GPIO_Port, UART1_DCD_Pin, UART1_DSR_GPIO_Port, UART1_DSR_Pin,    \
+                       UART1_RI_GPIO_Port, UART1_RI_Pin, UART1_CTS_GPIO_Port, UART1_CTS_Pin,      \
+                       GPIOA, GPIO_PIN_9}
+#define CDC_CHANNEL_1 {&huart2, UART2_DTR_GPIO_Port, UART2_DTR_Pin, UART2_RTS_GPIO_Port, UART2_RTS_Pin, \
+                       UART2_DCD_GPIO_Port, UART2_DCD_Pin, UART2_DSR_GPIO_Port, UART2_DSR_Pin,    \
+                       UART2_RI_GPIO_Port, UART2_RI_Pin, UART2_CTS_GPIO_Port, UART2_CTS_Pin,      \
+                       GPIOA, GPIO_PIN_2}
+#define CDC_CHANNEL_2 {&huart3, UART3_DTR_GPIO_Port, UART3_DTR_Pin, UART3_RTS_GPIO_Port, UART3_RTS_Pin, \
+                       UART3_DCD_GPIO_Port, UART3_DCD_Pin, UART3_DSR_GPIO_Port, UART3_DSR_Pin,    \
+                       UART3_RI_GPIO_Port, UART3_RI_Pin, UART3_CTS_GPIO_Port, UART3_CTS_Pin,      \
+                       GPIOB, GPIO_PIN_10}
+#define CDC_CHANNEL_OF(n) CDC_CHANNEL_##n
+
+static const CDC_Channel_TypeDef CDC_Channel[NUMBER_OF_CDC] = {CDC_CHANNELS(CDC_CHANNEL_OF)};
+
+/** USART register blocks are 1 KB aligned, bits 10 to 12 of the address
+    tell the three apart: USART2 1, USART3 2, USART1 6 */
+#define UART_SLOT(instance) ((((uint32_t)(instance)) >> 10) & 7U)
+static uint8_t Uart_Channel[8]; /* channel of the USART in each UART_SLOT, set by CDC_Config_Load */
+
+uint8_t Record_Buffer[NUMBER_OF_CDC][RECORD_BUFFER_SIZE];
+uint8_t In_Buffer[NUMBER_OF_CDC][IN_BUFFER_SIZE]; /* IN transfer on the endpoint, copied out of the ring */
+
+uint8_t Encode_Buffer[NUMBER_OF_CDC][ENCODE_CHUNK_SIZE];
+
+CDC_Config_TypeDef Boot_Config[NUMBER_OF_CDC]; /* what each channel starts with, as in its last record */
+uint32_t Config_Page;                          /* active config page, 0 when neither has a valid header */
+uint32_t Config_Seq;                           /* sequence in its header, the newer page is the active one */
+uint32_t Config_Next;                          /* first free slot of the active page, CONFIG_SLOTS when full */
+uint8_t Config_Due;                            /* bit n: Boot_Config[n] waits for CDC_Config_Service to program it */
+
+uint32_t Boot_Us[BOOT_MARKS]; /* BOOT_xxx reached, TIM2_Micros, 0 if not yet */
 
 /* USER CODE END PRIVATE_VARIABLES */
 
@@ -138,128 +352,1866 @@ static int8_t CDC_Receive_FS(uint8_t cdc_index, uint8_t *pbuf, uint32_t *Len);
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_DECLARATION */
 UART_HandleTypeDef *CDC_Index_To_UART_Handle(uint8_t cdc_index)
 {
-  UART_HandleTypeDef *handle = NULL;
+  return CDC_Channel[cdc_index].huart;
+}
+
+/**
+  * @brief  Channel of a UART handle, for the HAL callbacks that only pass the
+  *         handle. One load through Uart_Channel, the per byte path
+  *         (CDC_UART_IRQHandler) is given the channel instead
+  */
+uint8_t UART_Handle_TO_CDC_Index(UART_HandleTypeDef *handle)
+{
+  return Uart_Channel[UART_SLOT(handle->Instance)];
+}
+
+static uint32_t CDC_Ring_Level(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+
+  return (ctx->Write_Index + APP_TX_DATA_SIZE - ctx->Read_Index) % APP_TX_DATA_SIZE;
+}
+
+static void CDC_Reverse(uint8_t *buf, uint32_t len)
+{
+  uint8_t swap;
+
+  for (uint32_t i = 0U, j = len; i + 1U < j; i++, j--)
+  {
+    swap = buf[i];
+    buf[i] = buf[j - 1U];
+    buf[j - 1U] = swap;
+  }
+}
+
+/**
+  * @brief  Sample DCD, DSR, RI and CTS as a SERIAL_STATE bitmap. CTS only on
+  *         vendor and multiplexed channels, PSTN has no bit for it
+  */
+static uint16_t CDC_Read_Modem_Lines(uint8_t cdc_index)
+{
+  uint16_t lines = 0U;
 
-  if (cdc_index == 0)
+  if (HAL_GPIO_ReadPin(CDC_Channel[cdc_index].DCD_Port, CDC_Channel[cdc_index].DCD_Pin) == GPIO_PIN_RESET)
+  {
+    lines |= CDC_SERIAL_STATE_DCD;
+  }
+  if (HAL_GPIO_ReadPin(CDC_Channel[cdc_index].DSR_Port, CDC_Channel[cdc_index].DSR_Pin) == GPIO_PIN_RESET)
   {
-    handle = &huart1;
+    lines |= CDC_SERIAL_STATE_DSR;
   }
-  else if (cdc_index == 1)
+  if (HAL_GPIO_ReadPin(CDC_Channel[cdc_index].RI_Port, CDC_Channel[cdc_index].RI_Pin) == GPIO_PIN_RESET)
   {
-    handle = &huart2;
+    lines |= CDC_SERIAL_STATE_RI;
   }
-  else if (cdc_index == 2)
+  if (((CDC_MUX != 0U) || CDC_IS_VENDOR(cdc_index)) &&
+      (HAL_GPIO_ReadPin(CDC_Channel[cdc_index].CTS_Port, CDC_Channel[cdc_index].CTS_Pin) == GPIO_PIN_RESET))
   {
-    handle = &huart3;
+    lines |= CDC_SERIAL_STATE_CTS;
   }
 
-  return handle;
+  return lines;
 }
 
-uint8_t UART_Handle_TO_CDC_Index(UART_HandleTypeDef *handle)
+/**
+  * @brief  Drive the RTS pin, from the ring level with RTS/CTS flow control,
+  *         else from the host's SET_CONTROL_LINE_STATE
+  */
+static void CDC_Update_RTS(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+  uint8_t asserted;
+
+  if (ctx->Rs485 != 0U)
+  {
+    /* Pin owned by the DE logic */
+    return;
+  }
+
+  if (ctx->Flow_Control == CDC_FLOW_CONTROL_RTS_CTS)
+  {
+    asserted = (ctx->Rx_Hold == 0U);
+  }
+  else
+  {
+    asserted = ((ctx->Control_Line_State & CDC_CONTROL_LINE_RTS) != 0U);
+  }
+
+  HAL_GPIO_WritePin(CDC_Channel[cdc_index].RTS_Port, CDC_Channel[cdc_index].RTS_Pin, asserted ? GPIO_PIN_RESET : GPIO_PIN_SET);
+}
+
+static void CDC_Rx_Process(uint8_t cdc_index);
+static void CDC_Frame_End(uint8_t cdc_index);
+static void CDC_Usb_Flush(uint8_t cdc_index);
+static void CDC_Encode_Chunk(uint8_t cdc_index);
+
+/**
+  * @brief  Drive the TX pin low as GPIO, the UART shift register is idle
+  */
+static void CDC_Break_Start(uint8_t cdc_index)
 {
-  uint8_t cdc_index = 0;
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+  GPIO_InitTypeDef GPIO_InitStruct = {0};
 
-  if (handle == &huart1)
+  /* A frame still waiting for its gap ends here, the timeout times the break */
+  if (ctx->Frame_Timer != FRAME_TIMER_NONE)
   {
-    cdc_index = 0;
+    CDC_Frame_End(cdc_index);
   }
-  else if (handle == &huart2)
+
+  ctx->Break_Active = 1U;
+
+  HAL_GPIO_WritePin(CDC_Channel[cdc_index].TX_Port, CDC_Channel[cdc_index].TX_Pin, GPIO_PIN_RESET);
+  GPIO_InitStruct.Pin = CDC_Channel[cdc_index].TX_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
+  HAL_GPIO_Init(CDC_Channel[cdc_index].TX_Port, &GPIO_InitStruct);
+
+  if (ctx->Break_Request != BREAK_UNTIL_CLEARED)
   {
-    cdc_index = 1;
+    TIM2_Start_Timeout(cdc_index, ctx->Break_Request * 1000U);
   }
-  else if (handle == &huart3)
+  ctx->Break_Request = 0U;
+}
+
+/**
+  * @brief  Give the TX pin back to the UART
+  */
+static void CDC_Break_Stop(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+  GPIO_InitTypeDef GPIO_InitStruct = {0};
+
+  ctx->Break_Request = 0U;
+
+  if (ctx->Break_Active != 0U)
   {
-    cdc_index = 2;
+    /* The timeout may be a DE guard time otherwise */
+    TIM2_Stop_Timeout(cdc_index);
+    ctx->Break_Active = 0U;
+
+    GPIO_InitStruct.Pin = CDC_Channel[cdc_index].TX_Pin;
+    GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+    GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
+    HAL_GPIO_Init(CDC_Channel[cdc_index].TX_Port, &GPIO_InitStruct);
   }
+}
+
+static uint32_t CDC_Bits_To_Us(uint8_t cdc_index, uint32_t bits)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
 
-  return cdc_index;
+  return (bits * 1000000U + ctx->Line_Coding.bitrate - 1U) / ctx->Line_Coding.bitrate;
 }
 
-void Change_UART_Setting(uint8_t cdc_index)
+/**
+  * @brief  RS-485: drive the bus ahead of a transmission
+  * @retval 1 once the pre guard time has elapsed, 0 while it runs (its end kicks again)
+  */
+static uint8_t CDC_DE_Acquire(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+  uint32_t pre = ctx->Rs485_Guard & 0xFFU;
+
+  if (ctx->Rs485 == 0U)
+  {
+    return 1U;
+  }
+
+  switch (ctx->De_State)
+  {
+  case DE_IDLE:
+    /* What arrived so far is not echo, a frame still waiting for its gap ends here */
+    CDC_Rx_Process(cdc_index);
+    if (ctx->Frame_Timer != FRAME_TIMER_NONE)
+    {
+      CDC_Frame_End(cdc_index);
+    }
+    HAL_GPIO_WritePin(CDC_Channel[cdc_index].RTS_Port, CDC_Channel[cdc_index].RTS_Pin, GPIO_PIN_SET);
+    if (pre != 0U)
+    {
+      ctx->De_State = DE_SETUP;
+      TIM2_Start_Timeout(cdc_index, CDC_Bits_To_Us(cdc_index, pre));
+      return 0U;
+    }
+    ctx->De_State = DE_DRIVING;
+    return 1U;
+  case DE_SETUP:
+    return 0U;
+  case DE_HOLD:
+    /* Back to back frames, the bus is still ours */
+    TIM2_Stop_Timeout(cdc_index);
+    ctx->De_State = DE_DRIVING;
+    return 1U;
+  default:
+    return 1U;
+  }
+}
+
+/**
+  * @brief  RS-485: release the bus, the echo received while driving is dropped
+  */
+static void CDC_DE_Release(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+
+  if ((ctx->De_State == DE_SETUP) || (ctx->De_State == DE_HOLD))
+  {
+    TIM2_Stop_Timeout(cdc_index);
+  }
+
+  if (ctx->De_State != DE_IDLE)
+  {
+    CDC_Rx_Process(cdc_index);
+    ctx->De_State = DE_IDLE;
+  }
+
+  if (ctx->Rs485 != 0U)
+  {
+    HAL_GPIO_WritePin(CDC_Channel[cdc_index].RTS_Port, CDC_Channel[cdc_index].RTS_Pin, GPIO_PIN_RESET);
+  }
+}
+
+/**
+  * @brief  RS-485: nothing left to send after TC, hold the bus for the post
+  *         guard time then release it
+  */
+static void CDC_DE_Done(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+  uint32_t post = ctx->Rs485_Guard >> 8;
+
+  if (ctx->De_State != DE_DRIVING)
+  {
+    return;
+  }
+
+  if (post != 0U)
+  {
+    ctx->De_State = DE_HOLD;
+    TIM2_Start_Timeout(cdc_index, CDC_Bits_To_Us(cdc_index, post));
+  }
+  else
+  {
+    CDC_DE_Release(cdc_index);
+  }
+}
+
+/**
+  * @brief  Stream mode: give the OUT endpoint the next free slot of the ring,
+  *         a whole packet that does not cross the end. While the ring is
+  *         full the endpoint NAKs, the UART freeing a span arms it again
+  */
+static void CDC_Out_Arm(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+
+  if (ctx->Out_Armed != 0U)
+  {
+    return;
+  }
+
+  if (ctx->Out_Head == ctx->Out_Tail)
+  {
+    /* Empty, nothing on the DMA either */
+    ctx->Out_Head = 0U;
+    ctx->Out_Tail = 0U;
+  }
+  else if (ctx->Out_Head > ctx->Out_Tail)
+  {
+    if ((ctx->Out_Head + CDC_DATA_FS_OUT_PACKET_SIZE) > APP_RX_DATA_SIZE)
+    {
+      /* No room at the end, go back to the bottom once the UART left it */
+      if (ctx->Out_Tail <= CDC_DATA_FS_OUT_PACKET_SIZE)
+      {
+        return;
+      }
+      ctx->Out_Wrap = ctx->Out_Head;
+      ctx->Out_Head = 0U;
+    }
+  }
+  else if ((ctx->Out_Head + CDC_DATA_FS_OUT_PACKET_SIZE) >= ctx->Out_Tail)
+  {
+    /* Head must stay behind the tail, equal means empty */
+    return;
+  }
+
+  ctx->Out_Armed = 1U;
+  USBD_CDC_SetRxBuffer(cdc_index, &hUsbDeviceFS, &RX_Buffer[cdc_index][ctx->Out_Head]);
+  USBD_CDC_ReceivePacket(cdc_index, &hUsbDeviceFS);
+}
+
+/**
+  * @brief  Stream mode: the UART is done with the span on the DMA, its room
+  *         goes back to the OUT endpoint
+  */
+static void CDC_Out_Release(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+
+  ctx->Out_Tail += ctx->Out_Dma_Len;
+  ctx->Out_Dma_Len = 0U;
+
+  if ((ctx->Out_Head < ctx->Out_Tail) && (ctx->Out_Tail == ctx->Out_Wrap))
+  {
+    ctx->Out_Tail = 0U;
+  }
+
+  CDC_Out_Arm(cdc_index);
+}
+
+/**
+  * @brief  Data for the UART DMA: the encoded chunk in packet mode, else what
+  *         the OUT ring holds in one piece, so packets that came in while
+  *         the UART was busy go out in one transfer
+  */
+static uint32_t CDC_Out_Pending(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+
+  if ((ctx->Packet_Mode == CDC_PACKET_NONE) && (ctx->Out_Head != ctx->Out_Tail))
+  {
+    ctx->Tx_Pending_Buf = &RX_Buffer[cdc_index][ctx->Out_Tail];
+    ctx->Tx_Pending_Len = ((ctx->Out_Head > ctx->Out_Tail) ? ctx->Out_Head : ctx->Out_Wrap) -
+                          ctx->Out_Tail;
+  }
+
+  return ctx->Tx_Pending_Len;
+}
+
+/**
+  * @brief  UART TX DMA done with its span while the last characters are still
+  *         shifting out. The span's buffer is free from here, and the next
+  *         span goes on the same DMA request so the line does not idle
+  *         between USB packets. Otherwise ends as the HAL does: TC interrupt,
+  *         then HAL_UART_TxCpltCallback
+  */
+static void CDC_Tx_Dma_Cplt(DMA_HandleTypeDef *hdma)
+{
+  UART_HandleTypeDef *handle = (UART_HandleTypeDef *)hdma->Parent;
+  uint8_t cdc_index = UART_Handle_TO_CDC_Index(handle);
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+
+  if (ctx->Enc_Step != ENC_IDLE)
+  {
+    /* Packet mode, the transfer in RX_Buffer is not all encoded yet */
+    CDC_Encode_Chunk(cdc_index);
+  }
+  else if (ctx->Packet_Mode != CDC_PACKET_NONE)
+  {
+    /* Whole transfer encoded, RX_Buffer can gather the next one */
+    USBD_CDC_ReceivePacket(cdc_index, &hUsbDeviceFS);
+  }
+  else
+  {
+    CDC_Out_Release(cdc_index);
+  }
+
+  if ((ctx->Break_Request == 0U) && (ctx->Tx_Paused == 0U) && (CDC_Out_Pending(cdc_index) != 0U))
+  {
+    if (__HAL_UART_GET_FLAG(handle, UART_FLAG_TC) != RESET)
+    {
+      /* Chained too late, the shift register ran dry */
+      ctx->Tx_Gaps++;
+    }
+    ctx->Out_Dma_Len = ctx->Tx_Pending_Len;
+    handle->pTxBuffPtr = ctx->Tx_Pending_Buf;
+    handle->TxXferSize = (uint16_t)ctx->Tx_Pending_Len;
+    handle->TxXferCount = (uint16_t)ctx->Tx_Pending_Len;
+    HAL_DMA_Start_IT(hdma, (uint32_t)ctx->Tx_Pending_Buf, (uint32_t)&handle->Instance->DR, ctx->Tx_Pending_Len);
+    ctx->Tx_Pending_Len = 0U;
+
+    /* TC may have been set by a gap, it must only end the last span */
+    __HAL_UART_CLEAR_FLAG(handle, UART_FLAG_TC);
+    return;
+  }
+
+  handle->TxXferCount = 0U;
+  CLEAR_BIT(handle->Instance->CR3, USART_CR3_DMAT);
+  SET_BIT(handle->Instance->CR1, USART_CR1_TCIE);
+}
+
+/**
+  * @brief  Start the next UART transmission if the UART is idle: a requested
+  *         break first, a pending XON/XOFF next, then the pending USB data
+  *         unless the device sent XOFF. In RS-485 mode DE goes up first and
+  *         comes down once nothing is left
+  */
+static void CDC_Tx_Kick(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+  UART_HandleTypeDef *handle = CDC_Index_To_UART_Handle(cdc_index);
+
+  if (handle->gState != HAL_UART_STATE_READY)
+  {
+    /* TX complete callback kicks again */
+    return;
+  }
+
+  if ((Settings_Due & (1U << cdc_index)) != 0U)
+  {
+    /* Nothing goes out at the old line coding, CDC_Apply_Settings kicks again */
+    return;
+  }
+
+  if (ctx->Break_Request != 0U)
+  {
+    if (CDC_DE_Acquire(cdc_index) == 0U)
+    {
+      return;
+    }
+    CDC_Break_Start(cdc_index);
+  }
+
+  if (ctx->Break_Active != 0U)
+  {
+    /* Queue held, the end of the break kicks again */
+    return;
+  }
+
+  if (ctx->Flow_Char != 0U)
+  {
+    if (CDC_DE_Acquire(cdc_index) == 0U)
+    {
+      return;
+    }
+    ctx->Flow_Char_Buf = ctx->Flow_Char;
+    ctx->Flow_Char = 0U;
+    HAL_UART_Transmit_IT(handle, (uint8_t *)&ctx->Flow_Char_Buf, 1);
+  }
+  else if ((ctx->Tx_Paused == 0U) && (CDC_Out_Pending(cdc_index) != 0U))
+  {
+    if (CDC_DE_Acquire(cdc_index) == 0U)
+    {
+      return;
+    }
+    ctx->Tx_Data_Busy = 1U;
+    ctx->Out_Dma_Len = ctx->Tx_Pending_Len;
+    HAL_UART_Transmit_DMA(handle, ctx->Tx_Pending_Buf, ctx->Tx_Pending_Len);
+    ctx->Tx_Pending_Len = 0U;
+    /* Spans chain from the DMA complete, not from TC */
+    handle->hdmatx->XferCpltCallback = CDC_Tx_Dma_Cplt;
+  }
+  else
+  {
+    /* Called with the UART idle, so past TC of the last frame */
+    CDC_DE_Done(cdc_index);
+  }
+}
+
+/**
+  * @brief  Queue XON/XOFF ahead of any data. When a USB packet is on the DMA
+  *         its request is masked and the character goes out from the TXE
+  *         interrupt (CDC_UART_IRQHandler), so it does not wait for the packet
+  */
+static void CDC_Send_Flow_Char(uint8_t cdc_index, uint8_t flow_char)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+  UART_HandleTypeDef *handle = CDC_Index_To_UART_Handle(cdc_index);
+
+  ctx->Flow_Char = (flow_char & ~ctx->Tx_Clear_Mask) | ctx->Tx_Set_Mask;
+
+  if (ctx->Tx_Data_Busy != 0U)
+  {
+    CLEAR_BIT(handle->Instance->CR3, USART_CR3_DMAT);
+    SET_BIT(handle->Instance->CR1, USART_CR1_TXEIE);
+  }
+  else
+  {
+    CDC_Tx_Kick(cdc_index);
+  }
+}
+
+/**
+  * @brief  Apply the word length emulation to a span in place, a word at a time
+  */
+static void CDC_Mask_Span(uint8_t *buf, uint32_t len, uint8_t clear_mask, uint8_t set_mask)
+{
+  uint32_t clear_mask32 = clear_mask * 0x01010101U;
+  uint32_t set_mask32 = set_mask * 0x01010101U;
+
+  while ((len != 0U) && (((uint32_t)buf & 3U) != 0U))
+  {
+    *buf = (*buf & ~clear_mask) | set_mask;
+    buf++;
+    len--;
+  }
+
+  for (; len >= 4U; len -= 4U, buf += 4U)
+  {
+    *(uint32_t *)buf = (*(uint32_t *)buf & ~clear_mask32) | set_mask32;
+  }
+
+  while (len != 0U)
+  {
+    *buf = (*buf & ~clear_mask) | set_mask;
+    buf++;
+    len--;
+  }
+}
+
+/**
+  * @brief  Append a span the DMA wrote at or ahead of Write_Index, moved down
+  *         only when filtered bytes left a gap
+  */
+static void CDC_Rx_Accept(uint8_t cdc_index, uint8_t *src, uint32_t len)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+  uint32_t chunk;
+
+  if (src != &TX_Buffer[cdc_index][ctx->Write_Index])
+  {
+    while (len != 0U)
+    {
+      chunk = APP_TX_DATA_SIZE - ctx->Write_Index;
+      if (chunk > len)
+      {
+        chunk = len;
+      }
+      memmove(&TX_Buffer[cdc_index][ctx->Write_Index], src, chunk);
+      ctx->Write_Index = (ctx->Write_Index + chunk) % APP_TX_DATA_SIZE;
+      src += chunk;
+      len -= chunk;
+    }
+  }
+  else
+  {
+    ctx->Write_Index = (ctx->Write_Index + len) % APP_TX_DATA_SIZE;
+  }
+}
+
+/**
+  * @brief  XON/XOFF from the device pause and resume the UART TX DMA
+  */
+static void CDC_Rx_Flow_Char(uint8_t cdc_index, uint8_t data)
 {
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
   UART_HandleTypeDef *handle = CDC_Index_To_UART_Handle(cdc_index);
 
-  if (HAL_UART_DeInit(handle) != HAL_OK)
+  if (data == XOFF_CHAR)
+  {
+    ctx->Tx_Paused = 1U;
+    CLEAR_BIT(handle->Instance->CR3, USART_CR3_DMAT);
+  }
+  else if (ctx->Tx_Paused != 0U)
+  {
+    ctx->Tx_Paused = 0U;
+    if (ctx->Tx_Data_Busy != 0U)
+    {
+      /* Unless a flow character is in flight, it restores the request itself */
+      if (READ_BIT(handle->Instance->CR1, USART_CR1_TXEIE) == 0U)
+      {
+        SET_BIT(handle->Instance->CR3, USART_CR3_DMAT);
+      }
+    }
+    else
+    {
+      CDC_Tx_Kick(cdc_index);
+    }
+  }
+}
+
+/**
+  * @brief  Timestamp mode: line idle, catch the first byte of the next burst
+  *         with the RXNE interrupt. The RX DMA still takes the byte, the
+  *         interrupt only reads the time (CDC_UART_IRQHandler). RXNEIE is
+  *         set by CDC_Burst_Enable, outside the HAL UART handler
+  */
+static void CDC_Burst_Arm(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+
+  ctx->Burst_Mark = __HAL_DMA_GET_COUNTER(CDC_Index_To_UART_Handle(cdc_index)->hdmarx);
+  ctx->Burst_Timed = 0U;
+  ctx->Burst_Armed = 1U;
+}
+
+/**
+  * @brief  Timestamp mode: the burst starts when the RX DMA moves off
+  *         Burst_Mark, timed as of the byte's start bit
+  */
+static void CDC_Burst_Catch(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+
+  if ((ctx->Burst_Armed != 0U) && (ctx->Burst_Timed == 0U) &&
+      (__HAL_DMA_GET_COUNTER(CDC_Index_To_UART_Handle(cdc_index)->hdmarx) != ctx->Burst_Mark))
+  {
+    /* RXNE comes with the stop bit, a character after the start bit */
+    ctx->Burst_Time = TIM2_Micros() - ctx->Char_Us;
+    ctx->Burst_Timed = 1U;
+  }
+}
+
+/**
+  * @brief  Timestamp mode: enable RXNEIE for an armed burst, unless its
+  *         first byte already came, then it is timed now
+  */
+static void CDC_Burst_Enable(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+
+  CDC_Burst_Catch(cdc_index);
+
+  if ((ctx->Burst_Armed != 0U) && (ctx->Burst_Timed == 0U))
+  {
+    SET_BIT(CDC_Index_To_UART_Handle(cdc_index)->Instance->CR1, USART_CR1_RXNEIE);
+  }
+}
+
+/**
+  * @brief  Queue the burst starting at Write_Index, pending bytes have
+  *         arrived since. Without the RXNE time, estimated from them
+  */
+static void CDC_Burst_Begin(uint8_t cdc_index, uint32_t pending)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+
+  if (ctx->Burst_Timed == 0U)
+  {
+    ctx->Burst_Time = TIM2_Micros() - (pending * ctx->Char_Us);
+  }
+
+  ctx->Burst_Armed = 0U;
+  CLEAR_BIT(CDC_Index_To_UART_Handle(cdc_index)->Instance->CR1, USART_CR1_RXNEIE);
+
+  /* Queue full, the data goes with the previous burst */
+  if (ctx->Burst_Count < BURST_QUEUE_SIZE)
+  {
+    ctx->Burst_Start[(ctx->Burst_First + ctx->Burst_Count) % BURST_QUEUE_SIZE] = ctx->Write_Index;
+    ctx->Burst_Stamp[(ctx->Burst_First + ctx->Burst_Count) % BURST_QUEUE_SIZE] = ctx->Burst_Time;
+    ctx->Burst_Count++;
+  }
+}
+
+/**
+  * @brief  Close the frame at Write_Index, empty frames are not queued
+  */
+static void CDC_Frame_Push(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+  uint32_t last = ctx->Read_Index;
+
+  if (ctx->Frame_Count != 0U)
+  {
+    last = ctx->Frame_End[(ctx->Frame_First + ctx->Frame_Count - 1U) % FRAME_QUEUE_SIZE];
+  }
+
+  if (ctx->Write_Index == last)
+  {
+    return;
+  }
+
+  if (ctx->Frame_Count == FRAME_QUEUE_SIZE)
+  {
+    /* Queue full, merged into the last frame */
+    ctx->Frame_Count--;
+  }
+  ctx->Frame_End[(ctx->Frame_First + ctx->Frame_Count) % FRAME_QUEUE_SIZE] = ctx->Write_Index;
+  ctx->Frame_Count++;
+}
+
+/**
+  * @brief  Drop the frame or packet not closed yet
+  */
+static void CDC_Frame_Drop(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+
+  if (ctx->Frame_Count != 0U)
+  {
+    ctx->Write_Index = ctx->Frame_End[(ctx->Frame_First + ctx->Frame_Count - 1U) % FRAME_QUEUE_SIZE];
+  }
+  else
+  {
+    ctx->Write_Index = ctx->Read_Index;
+  }
+}
+
+/**
+  * @brief  Packet mode: decode a span into the ring behind the RX DMA, the
+  *         output never overtakes the input. Runs of plain data are moved in
+  *         bulk, each delimiter closes a frame
+  */
+static void CDC_Packet_Decode(uint8_t cdc_index, uint8_t *src, uint32_t len)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+  uint32_t run;
+  uint8_t *stop;
+  uint8_t code;
+
+  while (len != 0U)
+  {
+    if (ctx->Packet_Mode == CDC_PACKET_COBS)
+    {
+      if (*src == 0x00U)
+      {
+        /* Delimiter, inside a block it cuts a broken packet */
+        if (ctx->Dec_Left != 0U)
+        {
+          ctx->Serial_State_Errors |= CDC_SERIAL_STATE_FRAMING;
+          CDC_Frame_Drop(cdc_index);
+        }
+        CDC_Frame_Push(cdc_index);
+        ctx->Dec_Code = 0U;
+        ctx->Dec_Left = 0U;
+        run = 1U;
+      }
+      else if (ctx->Dec_Left == 0U)
+      {
+        /* Code byte, the zero closing the previous block goes out first. The
+           ring compacted since, the zero may land on the code byte itself */
+        code = *src;
+        if ((ctx->Dec_Code != 0U) && (ctx->Dec_Code != 0xFFU))
+        {
+          TX_Buffer[cdc_index][ctx->Write_Index] = 0x00U;
+          ctx->Write_Index = (ctx->Write_Index + 1U) % APP_TX_DATA_SIZE;
+        }
+        ctx->Dec_Code = code;
+        ctx->Dec_Left = code - 1U;
+        run = 1U;
+      }
+      else
+      {
+        run = (len < ctx->Dec_Left) ? len : ctx->Dec_Left;
+        stop = memchr(src, 0x00U, run);
+        if (stop != NULL)
+        {
+          run = stop - src;
+        }
+        CDC_Rx_Accept(cdc_index, src, run);
+        ctx->Dec_Left -= run;
+      }
+    }
+    else /* SLIP */
+    {
+      if (ctx->Dec_Esc != 0U)
+      {
+        ctx->Dec_Esc = 0U;
+        TX_Buffer[cdc_index][ctx->Write_Index] = (*src == SLIP_ESC_END) ? SLIP_END : (*src == SLIP_ESC_ESC) ? SLIP_ESC : *src;
+        ctx->Write_Index = (ctx->Write_Index + 1U) % APP_TX_DATA_SIZE;
+        run = 1U;
+      }
+      else if (*src == SLIP_END)
+      {
+        CDC_Frame_Push(cdc_index);
+        run = 1U;
+      }
+      else if (*src == SLIP_ESC)
+      {
+        ctx->Dec_Esc = 1U;
+        run = 1U;
+      }
+      else
+      {
+        for (run = 1U; (run < len) && (src[run] != SLIP_END) && (src[run] != SLIP_ESC); run++)
+        {
+        }
+        CDC_Rx_Accept(cdc_index, src, run);
+      }
+    }
+
+    src += run;
+    len -= run;
+  }
+}
+
+/**
+  * @brief  Move what points into the ring (Read_Index, frame ends, burst
+  *         starts) up by delta, the data under it moved up as much
+  */
+static void CDC_Ring_Move_Marks(uint8_t cdc_index, uint32_t delta)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+  uint8_t n;
+
+  ctx->Read_Index = (ctx->Read_Index + delta) % APP_TX_DATA_SIZE;
+  for (n = 0U; n < ctx->Frame_Count; n++)
+  {
+    uint16_t *end = &ctx->Frame_End[(ctx->Frame_First + n) % FRAME_QUEUE_SIZE];
+
+    *end = (uint16_t)((*end + delta) % APP_TX_DATA_SIZE);
+  }
+  for (n = 0U; n < ctx->Burst_Count; n++)
+  {
+    uint16_t *start = &ctx->Burst_Start[(ctx->Burst_First + n) % BURST_QUEUE_SIZE];
+
+    *start = (uint16_t)((*start + delta) % APP_TX_DATA_SIZE);
+  }
+}
+
+/**
+  * @brief  Close the gap filtered bytes left between Write_Index and the RX
+  *         DMA, the data not read yet is moved up against the DMA so the
+  *         whole ring stays in use. IN transfers go from In_Buffer, none
+  *         reads the ring meanwhile
+  */
+static void CDC_Rx_Compact(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+  uint8_t *ring = TX_Buffer[cdc_index];
+  uint32_t gap = (ctx->Rx_Dma_Index + APP_TX_DATA_SIZE - ctx->Write_Index) % APP_TX_DATA_SIZE;
+  uint32_t left = CDC_Ring_Level(cdc_index);
+  uint32_t from = ctx->Write_Index;
+  uint32_t to = ctx->Rx_Dma_Index;
+  uint32_t chunk;
+
+  /* From the top down, a run neither side wraps in at a time */
+  while (left != 0U)
+  {
+    from = (from == 0U) ? APP_TX_DATA_SIZE : from;
+    to = (to == 0U) ? APP_TX_DATA_SIZE : to;
+    chunk = (left < from) ? left : from;
+    chunk = (chunk < to) ? chunk : to;
+    from -= chunk;
+    to -= chunk;
+    memmove(&ring[to], &ring[from], chunk);
+    left -= chunk;
+  }
+
+  CDC_Ring_Move_Marks(cdc_index, gap);
+  ctx->Write_Index = ctx->Rx_Dma_Index;
+}
+
+/**
+  * @brief  Take what the circular RX DMA wrote since the last call into the
+  *         ring, a span at a time. Called on DMA half/full transfer, on UART
+  *         idle line and on every tick
+  */
+static void CDC_Rx_Process(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+  UART_HandleTypeDef *handle = CDC_Index_To_UART_Handle(cdc_index);
+  uint32_t head;
+  uint32_t span;
+  uint8_t *src;
+
+  if (handle->RxState != HAL_UART_STATE_BUSY_RX)
+  {
+    return;
+  }
+
+  head = (APP_TX_DATA_SIZE - __HAL_DMA_GET_COUNTER(handle->hdmarx)) % APP_TX_DATA_SIZE;
+
+  /* No host took the ring while the DMA went round it, the oldest data is
+     overwritten. What the DMA wrote since the last call is still in order.
+     Reported as an overrun, the data is lost in the device */
+  if (((ctx->Rx_Dma_Index + APP_TX_DATA_SIZE - ctx->Read_Index) % APP_TX_DATA_SIZE) +
+          ((head + APP_TX_DATA_SIZE - ctx->Rx_Dma_Index) % APP_TX_DATA_SIZE) >=
+      APP_TX_DATA_SIZE)
+  {
+    ctx->Serial_State_Errors |= CDC_SERIAL_STATE_OVERRUN;
+    ctx->Read_Index = ctx->Rx_Dma_Index;
+    ctx->Write_Index = ctx->Rx_Dma_Index;
+    ctx->Frame_Count = 0U;
+    ctx->Frame_Broken = 0U;
+    ctx->Burst_Count = 0U;
+    ctx->Dec_Code = 0U;
+    ctx->Dec_Left = 0U;
+    ctx->Dec_Esc = 0U;
+  }
+
+  while (ctx->Rx_Dma_Index != head)
+  {
+    src = &TX_Buffer[cdc_index][ctx->Rx_Dma_Index];
+    if (head > ctx->Rx_Dma_Index)
+    {
+      span = head - ctx->Rx_Dma_Index;
+    }
+    else /* Rollback */
+    {
+      span = APP_TX_DATA_SIZE - ctx->Rx_Dma_Index;
+    }
+    ctx->Rx_Idle = 0U;
+
+    /* First data since the line went idle, the burst starts at Write_Index */
+    if (ctx->Burst_Armed != 0U)
+    {
+      CDC_Burst_Begin(cdc_index, (head + APP_TX_DATA_SIZE - ctx->Rx_Dma_Index) % APP_TX_DATA_SIZE);
+    }
+
+    ctx->Rx_Dma_Index = (ctx->Rx_Dma_Index + span) % APP_TX_DATA_SIZE;
+
+    if ((ctx->Dtr_Gating != 0U) && ((ctx->Control_Line_State & CDC_CONTROL_LINE_DTR) == 0U))
+    {
+      /* Port closed, dropped */
+      continue;
+    }
+
+    if (ctx->De_State != DE_IDLE)
+    {
+      /* RS-485 echo of our own transmission, dropped */
+      continue;
+    }
+
+    if (ctx->Rx_Clear_Mask != 0U)
+    {
+      CDC_Mask_Span(src, span, ctx->Rx_Clear_Mask, 0U);
+    }
+
+    if (ctx->Packet_Mode != CDC_PACKET_NONE)
+    {
+      CDC_Packet_Decode(cdc_index, src, span);
+    }
+    else if (ctx->Flow_Control == CDC_FLOW_CONTROL_XON_XOFF)
+    {
+      for (uint32_t i = 0; i < span; i++)
+      {
+        if ((src[i] == XON_CHAR) || (src[i] == XOFF_CHAR))
+        {
+          CDC_Rx_Flow_Char(cdc_index, src[i]);
+        }
+        else
+        {
+          TX_Buffer[cdc_index][ctx->Write_Index] = src[i];
+          ctx->Write_Index = (ctx->Write_Index + 1U) % APP_TX_DATA_SIZE;
+        }
+      }
+    }
+    else
+    {
+      CDC_Rx_Accept(cdc_index, src, span);
+    }
+  }
+
+  /* Close the gap filtered bytes left behind the DMA, the lap above counts
+     it as taken. Without moving anything once the ring is drained */
+  if (ctx->Read_Index == ctx->Write_Index)
+  {
+    ctx->Read_Index = ctx->Rx_Dma_Index;
+    ctx->Write_Index = ctx->Rx_Dma_Index;
+    /* Bursts left are empty, all of theirs was dropped */
+    ctx->Burst_Count = 0U;
+  }
+  else if (ctx->Write_Index != ctx->Rx_Dma_Index)
+  {
+    CDC_Rx_Compact(cdc_index);
+  }
+
+  /* Packets go as soon as they are complete, a stream without latency timer
+     or filled up to its threshold too */
+  if (((ctx->Packet_Mode != CDC_PACKET_NONE) && (ctx->Frame_Count != 0U)) ||
+      (ctx->Latency_Ms == 0U) ||
+      ((ctx->Fill_Threshold != 0U) && (CDC_Ring_Level(cdc_index) >= ctx->Fill_Threshold)))
+  {
+    CDC_Usb_Flush(cdc_index);
+  }
+
+  /* Stop the far end well before the ring overruns */
+  if ((ctx->Flow_Control != CDC_FLOW_CONTROL_NONE) && (ctx->Rx_Hold == 0U) &&
+      (CDC_Ring_Level(cdc_index) >= RX_HIGH_WATERMARK))
+  {
+    ctx->Rx_Hold = 1U;
+    if (ctx->Flow_Control == CDC_FLOW_CONTROL_RTS_CTS)
+    {
+      CDC_Update_RTS(cdc_index);
+    }
+    else
+    {
+      CDC_Send_Flow_Char(cdc_index, XOFF_CHAR);
+    }
+  }
+}
+
+/**
+  * @brief  Start the circular RX DMA over the whole ring. The DMA always
+  *         begins at the start of the buffer, what the host has not read yet
+  *         is rotated up to end at the top of it first
+  */
+static void CDC_Rx_Start(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+  UART_HandleTypeDef *handle = CDC_Index_To_UART_Handle(cdc_index);
+  uint32_t shift = ctx->Write_Index;
+
+  if (ctx->Frame_Timer != FRAME_TIMER_NONE)
+  {
+    TIM2_Stop_Timeout(cdc_index);
+    ctx->Frame_Timer = FRAME_TIMER_NONE;
+  }
+  ctx->Frame_Broken = 0U;
+
+  /* A frame not complete yet is not completed by the new reception */
+  if ((ctx->Modbus != 0U) || (ctx->Packet_Mode != CDC_PACKET_NONE))
+  {
+    shift = (ctx->Frame_Count != 0U)
+                ? ctx->Frame_End[(ctx->Frame_First + ctx->Frame_Count - 1U) % FRAME_QUEUE_SIZE]
+                : ctx->Read_Index;
+  }
+
+  /* Rotated down by shift in place, three reversals, no second 1K buffer.
+     IN transfers go from In_Buffer, none reads the ring */
+  CDC_Reverse(TX_Buffer[cdc_index], shift);
+  CDC_Reverse(&TX_Buffer[cdc_index][shift], APP_TX_DATA_SIZE - shift);
+  CDC_Reverse(TX_Buffer[cdc_index], APP_TX_DATA_SIZE);
+
+  CDC_Ring_Move_Marks(cdc_index, APP_TX_DATA_SIZE - shift);
+  ctx->Write_Index = 0U;
+  ctx->Rx_Dma_Index = 0U;
+
+  if (HAL_UART_Receive_DMA(handle, TX_Buffer[cdc_index], APP_TX_DATA_SIZE) != HAL_OK)
+  {
+    /* Transfer error in reception process */
+    Error_Handler();
+  }
+
+  /* Short bursts are taken in as soon as the line goes idle */
+  __HAL_UART_ENABLE_IT(handle, UART_IT_IDLE);
+
+  if (ctx->Timestamps != 0U)
+  {
+    CDC_Burst_Arm(cdc_index);
+    CDC_Burst_Enable(cdc_index);
+  }
+
+  ctx->Dec_Code = 0U;
+  ctx->Dec_Left = 0U;
+  ctx->Dec_Esc = 0U;
+}
+
+/**
+  * @brief  Timestamp mode: pack the ring into records for one IN transfer,
+  *         cut at burst starts, at the end of the ring and at 255 bytes
+  * @retval Size of the records in Record_Buffer
+  */
+static uint32_t CDC_Build_Records(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+  uint8_t *dst = Record_Buffer[cdc_index];
+  uint32_t size = 0U;
+  uint32_t end;
+  uint32_t len;
+
+  while ((ctx->Read_Index != ctx->Write_Index) &&
+         ((size + CDC_TIMESTAMP_HEADER_SIZE) < RECORD_BUFFER_SIZE))
+  {
+    /* Entering the next burst */
+    while ((ctx->Burst_Count != 0U) && (ctx->Burst_Start[ctx->Burst_First] == ctx->Read_Index))
+    {
+      ctx->Burst_Current = ctx->Burst_Stamp[ctx->Burst_First];
+      ctx->Burst_First = (ctx->Burst_First + 1U) % BURST_QUEUE_SIZE;
+      ctx->Burst_Count--;
+    }
+
+    end = (ctx->Burst_Count != 0U) ? ctx->Burst_Start[ctx->Burst_First] : ctx->Write_Index;
+    if (end > ctx->Read_Index)
+    {
+      len = end - ctx->Read_Index;
+    }
+    else /* Rollback */
+    {
+      len = APP_TX_DATA_SIZE - ctx->Read_Index;
+    }
+    if (len > CDC_TIMESTAMP_MAX_DATA)
+    {
+      len = CDC_TIMESTAMP_MAX_DATA;
+    }
+    if (len > (RECORD_BUFFER_SIZE - CDC_TIMESTAMP_HEADER_SIZE - size))
+    {
+      len = RECORD_BUFFER_SIZE - CDC_TIMESTAMP_HEADER_SIZE - size;
+    }
+
+    dst[size + 0U] = (uint8_t)len;
+    dst[size + 1U] = (uint8_t)(ctx->Burst_Current);
+    dst[size + 2U] = (uint8_t)(ctx->Burst_Current >> 8);
+    dst[size + 3U] = (uint8_t)(ctx->Burst_Current >> 16);
+    dst[size + 4U] = (uint8_t)(ctx->Burst_Current >> 24);
+    memcpy(&dst[size + CDC_TIMESTAMP_HEADER_SIZE], &TX_Buffer[cdc_index][ctx->Read_Index], len);
+
+    size += CDC_TIMESTAMP_HEADER_SIZE + len;
+    ctx->Read_Index = (ctx->Read_Index + len) % APP_TX_DATA_SIZE;
+  }
+
+  return size;
+}
+
+/**
+  * @brief  Hand the ring to the IN endpoint if it is free. In Modbus and
+  *         packet mode only completed frames go, one per transfer so each ends
+  *         in a short packet.
+  *         In timestamp mode the ring goes as records
+  */
+static void CDC_Usb_Flush(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+  USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef *)hUsbDeviceFS.pClassDataCDC[cdc_index];
+  uint32_t end = ctx->Write_Index;
+  uint32_t buffptr = ctx->Read_Index;
+  uint32_t buffsize;
+  uint8_t *buf = &TX_Buffer[cdc_index][buffptr];
+  uint8_t framed = (ctx->Modbus != 0U) || (ctx->Packet_Mode != CDC_PACKET_NONE);
+  uint8_t streaming;
+
+  /* Nor while the ring waits to be rotated by CDC_Apply_Settings */
+  if ((hcdc == NULL) || (hcdc->TxState != 0U) || ((Settings_Due & (1U << cdc_index)) != 0U))
+  {
+    return;
+  }
+
+  /* Line busy and the stream held to whole packets (below) */
+  streaming = (framed == 0U) && (ctx->Timestamps == 0U) && (ctx->Rx_Idle == 0U) &&
+              (ctx->Latency_Elapsed < (ctx->Latency_Ms + MAX_HOLD_MS));
+  hcdc->TxDeferZlp = streaming;
+
+  if (ctx->Timestamps != 0U)
+  {
+    /* Endpoint checked free above, the transfer cannot be refused */
+    buffsize = CDC_Build_Records(cdc_index);
+    if (buffsize != 0U)
+    {
+      USBD_CDC_SetTxBuffer(cdc_index, &hUsbDeviceFS, Record_Buffer[cdc_index], buffsize);
+      USBD_CDC_TransmitPacket(cdc_index, &hUsbDeviceFS);
+      ctx->Latency_Elapsed = 0U;
+    }
+    return;
+  }
+
+  if (framed != 0U)
+  {
+    /* The frame on the wire waits for its end */
+    if (ctx->Frame_Count == 0U)
+    {
+      return;
+    }
+    end = ctx->Frame_End[ctx->Frame_First];
+  }
+
+  /* Mid-stream only whole packets go, so the host gets full URBs. The rest
+     waits for the idle line, or MAX_HOLD_MS past the latency timer */
+  if (streaming != 0U)
+  {
+    buffsize = CDC_Ring_Level(cdc_index);
+    end = (buffptr + buffsize - (buffsize % CDC_DATA_FS_IN_PACKET_SIZE)) % APP_TX_DATA_SIZE;
+  }
+
+  if (buffptr == end)
+  {
+    /* Stream gone idle after a transfer ending in a full packet, close the host read */
+    if ((streaming == 0U) && (hcdc->TxZlpOwed != 0U))
+    {
+      USBD_CDC_SetTxBuffer(cdc_index, &hUsbDeviceFS, buf, 0U);
+      USBD_CDC_TransmitPacket(cdc_index, &hUsbDeviceFS);
+    }
+    return;
+  }
+
+  /* The PCD takes a transfer into the PMA a packet at a time while the RX
+     DMA goes on round the ring, so the transfer goes from a copy. Endpoint
+     checked free above, the last copy is not in flight. A longer span goes
+     in whole packets, the next transfer continues the host read */
+  buffsize = (end + APP_TX_DATA_SIZE - buffptr) % APP_TX_DATA_SIZE;
+  if (buffsize > IN_BUFFER_SIZE)
+  {
+    buffsize = IN_CHUNK_SIZE;
+    hcdc->TxDeferZlp = 1U;
+  }
+  if ((buffptr + buffsize) > APP_TX_DATA_SIZE) /* Rollback */
+  {
+    memcpy(In_Buffer[cdc_index], buf, APP_TX_DATA_SIZE - buffptr);
+    memcpy(&In_Buffer[cdc_index][APP_TX_DATA_SIZE - buffptr], TX_Buffer[cdc_index],
+           buffptr + buffsize - APP_TX_DATA_SIZE);
+  }
+  else
+  {
+    memcpy(In_Buffer[cdc_index], buf, buffsize);
+  }
+
+  USBD_CDC_SetTxBuffer(cdc_index, &hUsbDeviceFS, In_Buffer[cdc_index], buffsize);
+
+  if (USBD_CDC_TransmitPacket(cdc_index, &hUsbDeviceFS) == USBD_OK)
+  {
+    ctx->Read_Index = (buffptr + buffsize) % APP_TX_DATA_SIZE;
+    ctx->Latency_Elapsed = 0U;
+
+    if ((framed != 0U) && (ctx->Read_Index == end))
+    {
+      ctx->Frame_First = (ctx->Frame_First + 1U) % FRAME_QUEUE_SIZE;
+      ctx->Frame_Count--;
+    }
+  }
+}
+
+/**
+  * @brief  Close the frame at Write_Index and send it if the IN endpoint is
+  *         free. A frame broken by a 1.5 to 3.5 character gap is discarded
+  */
+static void CDC_Frame_End(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+
+  if (ctx->Frame_Timer != FRAME_TIMER_NONE)
+  {
+    TIM2_Stop_Timeout(cdc_index);
+    ctx->Frame_Timer = FRAME_TIMER_NONE;
+  }
+
+  CDC_Rx_Process(cdc_index);
+  if (ctx->Frame_Broken != 0U)
+  {
+    ctx->Frame_Broken = 0U;
+    CDC_Frame_Drop(cdc_index);
+  }
+  else
+  {
+    CDC_Frame_Push(cdc_index);
+  }
+  CDC_Usb_Flush(cdc_index);
+}
+
+/**
+  * @brief  Line idle for one character (USART IDLE), time the rest of the
+  *         inter-frame gap. A byte completes one character after its start,
+  *         so the RX DMA moving by the 1.5 check means a gap under 1.5
+  *         characters, and by the 3.5 check a gap between 1.5 and 3.5
+  */
+static void CDC_Frame_Gap_Start(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+
+  ctx->Frame_Mark = __HAL_DMA_GET_COUNTER(CDC_Index_To_UART_Handle(cdc_index)->hdmarx);
+  ctx->Frame_Timer = FRAME_TIMER_T15;
+  TIM2_Start_Timeout(cdc_index, ctx->Frame_Wait_Us[0]);
+}
+
+static void CDC_Frame_Timeout(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+  uint8_t moved = (__HAL_DMA_GET_COUNTER(CDC_Index_To_UART_Handle(cdc_index)->hdmarx) != ctx->Frame_Mark);
+
+  if (ctx->Frame_Timer == FRAME_TIMER_T15)
+  {
+    if (moved != 0U)
+    {
+      /* Same frame, the next idle line starts over */
+      ctx->Frame_Timer = FRAME_TIMER_NONE;
+    }
+    else
+    {
+      ctx->Frame_Timer = FRAME_TIMER_T35;
+      TIM2_Start_Timeout(cdc_index, ctx->Frame_Wait_Us[1]);
+    }
+  }
+  else if (moved != 0U)
+  {
+    /* Frame resumed after a 1.5 to 3.5 character gap, invalid in RTU. It is
+       received on to the next 3.5 character gap and discarded there */
+    ctx->Frame_Timer = FRAME_TIMER_NONE;
+    ctx->Frame_Broken = 1U;
+    ctx->Serial_State_Errors |= CDC_SERIAL_STATE_FRAMING;
+  }
+  else
+  {
+    CDC_Frame_End(cdc_index);
+  }
+}
+
+/**
+  * @brief  Packet mode: encode the next part of the USB transfer gathered in
+  *         RX_Buffer for the UART DMA. Plain runs are copied in bulk, COBS
+  *         blocks are found with memchr
+  */
+static void CDC_Encode_Chunk(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+  uint8_t *src = RX_Buffer[cdc_index];
+  uint8_t *dst = Encode_Buffer[cdc_index];
+  uint8_t *stop;
+  uint32_t n = 0U;
+  uint32_t run;
+
+  /* Room for a SLIP escape on every step */
+  while (((n + 1U) < ENCODE_CHUNK_SIZE) && (ctx->Enc_Step != ENC_IDLE))
+  {
+    switch (ctx->Enc_Step)
+    {
+    case ENC_BLOCK:
+      if (ctx->Packet_Mode == CDC_PACKET_COBS)
+      {
+        /* Code byte: data up to the next zero, 254 bytes at most */
+        run = ctx->Enc_Len - ctx->Enc_Pos;
+        if (run > COBS_MAX_RUN)
+        {
+          run = COBS_MAX_RUN;
+        }
+        stop = memchr(&src[ctx->Enc_Pos], 0x00U, run);
+        if (stop != NULL)
+        {
+          run = stop - &src[ctx->Enc_Pos];
+        }
+        ctx->Enc_Run = run;
+        ctx->Enc_Short = (run < COBS_MAX_RUN);
+        dst[n++] = run + 1U;
+      }
+      else
+      {
+        /* Leading END flushes line noise at the far end */
+        dst[n++] = SLIP_END;
+      }
+      ctx->Enc_Step = ENC_DATA;
+      break;
+
+    case ENC_DATA:
+      if (ctx->Packet_Mode == CDC_PACKET_COBS)
+      {
+        run = ENCODE_CHUNK_SIZE - n;
+        if (run > ctx->Enc_Run)
+        {
+          run = ctx->Enc_Run;
+        }
+        memcpy(&dst[n], &src[ctx->Enc_Pos], run);
+        n += run;
+        ctx->Enc_Pos += run;
+        ctx->Enc_Run -= run;
+
+        if (ctx->Enc_Run == 0U)
+        {
+          if (ctx->Enc_Pos == ctx->Enc_Len)
+          {
+            ctx->Enc_Step = ENC_END;
+          }
+          else
+          {
+            /* The zero ends a short block. A 254 byte block (code 0xFF) ends
+               without one, a zero right after it starts the next block */
+            if (ctx->Enc_Short != 0U)
+            {
+              ctx->Enc_Pos++;
+            }
+            ctx->Enc_Step = ENC_BLOCK;
+          }
+        }
+      }
+      else if (ctx->Enc_Pos == ctx->Enc_Len)
+      {
+        ctx->Enc_Step = ENC_END;
+      }
+      else if ((src[ctx->Enc_Pos] == SLIP_END) || (src[ctx->Enc_Pos] == SLIP_ESC))
+      {
+        dst[n++] = SLIP_ESC;
+        dst[n++] = (src[ctx->Enc_Pos] == SLIP_END) ? SLIP_ESC_END : SLIP_ESC_ESC;
+        ctx->Enc_Pos++;
+      }
+      else
+      {
+        for (run = 1U; ((n + run) < ENCODE_CHUNK_SIZE) && ((ctx->Enc_Pos + run) < ctx->Enc_Len) &&
+                       (src[ctx->Enc_Pos + run] != SLIP_END) && (src[ctx->Enc_Pos + run] != SLIP_ESC);
+             run++)
+        {
+        }
+        memcpy(&dst[n], &src[ctx->Enc_Pos], run);
+        n += run;
+        ctx->Enc_Pos += run;
+      }
+      break;
+
+    case ENC_END:
+    default:
+      dst[n++] = (ctx->Packet_Mode == CDC_PACKET_COBS) ? 0x00U : SLIP_END;
+      ctx->Enc_Step = ENC_IDLE;
+      break;
+    }
+  }
+
+  if ((ctx->Tx_Set_Mask | ctx->Tx_Clear_Mask) != 0U)
+  {
+    CDC_Mask_Span(dst, n, ctx->Tx_Clear_Mask, ctx->Tx_Set_Mask);
+  }
+
+  ctx->Tx_Pending_Buf = dst;
+  ctx->Tx_Pending_Len = n;
+}
+
+/**
+  * @brief  Apply the host's DTR/RTS, called from the control request so the
+  *         pins switch within the SETUP stage
+  */
+static void CDC_Set_Control_Line_State(uint8_t cdc_index, uint8_t state)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+  uint8_t opened = (state & CDC_CONTROL_LINE_DTR) & ~ctx->Control_Line_State;
+  uint8_t closed = ctx->Control_Line_State & CDC_CONTROL_LINE_DTR & ~state;
+
+  /* What arrived so far belongs to the old state */
+  CDC_Rx_Process(cdc_index);
+
+  ctx->Control_Line_State = state & (CDC_CONTROL_LINE_DTR | CDC_CONTROL_LINE_RTS);
+  if (opened != 0U)
+  {
+    CDC_Boot_Mark(BOOT_PORT_OPEN);
+  }
+
+  HAL_GPIO_WritePin(CDC_Channel[cdc_index].DTR_Port, CDC_Channel[cdc_index].DTR_Pin,
+                    (state & CDC_CONTROL_LINE_DTR) ? GPIO_PIN_RESET : GPIO_PIN_SET);
+  CDC_Update_RTS(cdc_index);
+
+  /* A port that opens or closes starts from an empty ring, nothing stale is forwarded */
+  if ((ctx->Dtr_Gating != 0U) && ((opened | closed) != 0U))
+  {
+    ctx->Read_Index = ctx->Write_Index;
+    ctx->Frame_Count = 0U;
+    ctx->Frame_Broken = 0U;
+    ctx->Burst_Count = 0U;
+    ctx->Dec_Code = 0U;
+    ctx->Dec_Left = 0U;
+    ctx->Dec_Esc = 0U;
+    CDC_Rx_Process(cdc_index);
+  }
+}
+
+void Change_UART_Setting(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+  UART_HandleTypeDef *handle = CDC_Index_To_UART_Handle(cdc_index);
+
+  /* What arrived at the old settings stays in the ring, CDC_Rx_Start keeps it */
+  CDC_Rx_Process(cdc_index);
+
+  /* MSP re-init takes the TX pin back anyway */
+  CDC_Break_Stop(cdc_index);
+  CDC_DE_Release(cdc_index);
+
+  if (HAL_UART_DeInit(handle) != HAL_OK)
+  {
+    /* Initialization Error */
+    Error_Handler();
+  }
+  /* set the Stop bit */
+  switch (ctx->Line_Coding.format)
+  {
+  case 0:
+    handle->Init.StopBits = UART_STOPBITS_1;
+    break;
+  case 2:
+    handle->Init.StopBits = UART_STOPBITS_2;
+    break;
+  default:
+    handle->Init.StopBits = UART_STOPBITS_1;
+    break;
+  }
+
+  /* set the parity bit, mark (3) and space (4) are emulated below */
+  switch (ctx->Line_Coding.paritytype)
+  {
+  case 0:
+    handle->Init.Parity = UART_PARITY_NONE;
+    break;
+  case 1:
+    handle->Init.Parity = UART_PARITY_ODD;
+    break;
+  case 2:
+    handle->Init.Parity = UART_PARITY_EVEN;
+    break;
+  default:
+    handle->Init.Parity = UART_PARITY_NONE;
+    break;
+  }
+
+  /* set the data type: the USART frames 8 or 9 bits parity included, the
+     other formats are emulated. Both DMA have a 16 bit peripheral side, so
+     bytes reach DR with bit 8 clear and bit 8 of received frames is dropped */
+  ctx->Tx_Set_Mask = 0U;
+  ctx->Tx_Clear_Mask = 0U;
+  ctx->Rx_Clear_Mask = 0U;
+
+  switch (ctx->Line_Coding.datatype)
+  {
+  case 0x07:
+    /* Bit 7 is the parity bit, or stands in for it */
+    handle->Init.WordLength = UART_WORDLENGTH_8B;
+    ctx->Rx_Clear_Mask = 0x80U;
+
+    if (ctx->Line_Coding.paritytype == 4U)
+    {
+      ctx->Tx_Clear_Mask = 0x80U;
+    }
+    else if (handle->Init.Parity == UART_PARITY_NONE)
+    {
+      /* Mark, or no parity sent as one more stop bit */
+      ctx->Tx_Set_Mask = 0x80U;
+    }
+    break;
+  case 0x08:
+  default:
+    if (ctx->Line_Coding.paritytype == 3U)
+    {
+      /* Mark bit sent as a first stop bit, received as the stop bit */
+      handle->Init.WordLength = UART_WORDLENGTH_8B;
+      handle->Init.StopBits = UART_STOPBITS_2;
+    }
+    else if ((ctx->Line_Coding.paritytype == 4U) || (handle->Init.Parity != UART_PARITY_NONE))
+    {
+      /* Space is a ninth data bit always sent as 0 */
+      handle->Init.WordLength = UART_WORDLENGTH_9B;
+    }
+    else
+    {
+      handle->Init.WordLength = UART_WORDLENGTH_8B;
+    }
+    break;
+  }
+
+  /* Multidrop bus: the ninth bit marks address characters, the USART stays
+     muted until one carries our node address and mutes again on the next
+     address for another node, so foreign frames never reach the ring */
+  if (ctx->Multidrop != 0U)
+  {
+    handle->Init.WordLength = UART_WORDLENGTH_9B;
+    handle->Init.Parity = UART_PARITY_NONE;
+    ctx->Tx_Set_Mask = 0U;
+    ctx->Tx_Clear_Mask = 0U;
+    ctx->Rx_Clear_Mask = 0U;
+  }
+
+  if (ctx->Line_Coding.bitrate == 0)
+  {
+    ctx->Line_Coding.bitrate = 115200;
+  }
+
+  handle->Init.BaudRate = ctx->Line_Coding.bitrate;
+  /* CTS gates the transmitter in hardware, RTS follows the ring level in software */
+  if (ctx->Flow_Control == CDC_FLOW_CONTROL_RTS_CTS)
+  {
+    handle->Init.HwFlowCtl = UART_HWCONTROL_CTS;
+  }
+  else
+  {
+    handle->Init.HwFlowCtl = UART_HWCONTROL_NONE;
+  }
+  ctx->Rx_Hold = 0U;
+  ctx->Tx_Paused = 0U;
+  ctx->Flow_Char = 0U;
+  CDC_Update_RTS(cdc_index);
+
+  handle->Init.Mode = UART_MODE_TX_RX;
+  handle->Init.OverSampling = UART_OVERSAMPLING_16;
+
+  ctx->Char_Us = CDC_Bits_To_Us(cdc_index, ((handle->Init.WordLength == UART_WORDLENGTH_9B) ? 10U : 9U) +
+                                           ((handle->Init.StopBits == UART_STOPBITS_2) ? 2U : 1U));
+
+  /* Modbus RTU gaps, fixed at 750 us and 1750 us above 19200 baud */
+  if (handle->Init.BaudRate > 19200U)
+  {
+    ctx->Frame_Wait_Us[0] = 750U;
+    ctx->Frame_Wait_Us[1] = 1750U - 750U - ctx->Char_Us;
+  }
+  else
+  {
+    ctx->Frame_Wait_Us[0] = ctx->Char_Us * 3U / 2U;
+    ctx->Frame_Wait_Us[1] = ctx->Char_Us; /* 3.5 - 1.5 - the character of the check */
+  }
+
+  if (ctx->Multidrop != 0U)
+  {
+    if (HAL_MultiProcessor_Init(handle, ctx->Multidrop & CDC_MULTIDROP_ADDRESS_MASK, UART_WAKEUPMETHOD_ADDRESSMARK) != HAL_OK)
+    {
+      /* Initialization Error */
+      Error_Handler();
+    }
+  }
+  else if (HAL_UART_Init(handle) != HAL_OK)
+  {
+    /* Initialization Error */
+    Error_Handler();
+  }
+
+  /** rx for uart and tx buffer of usb */
+  CDC_Rx_Start(cdc_index);
+
+  if (ctx->Multidrop != 0U)
+  {
+    /* Done before the TX kick below: it briefly claims gState */
+    HAL_MultiProcessor_EnterMuteMode(handle);
+  }
+
+  /* DeInit dropped the data that was on the DMA, release its OUT buffer */
+  if (ctx->Tx_Data_Busy != 0U)
+  {
+    ctx->Tx_Data_Busy = 0U;
+    ctx->Tx_Pending_Len = 0U;
+    if (ctx->Packet_Mode != CDC_PACKET_NONE)
+    {
+      ctx->Enc_Step = ENC_IDLE;
+      if (ctx->Out_Len == 0U)
+      {
+        /* Past the DMA complete of the last chunk the next transfer may be gathering */
+        USBD_CDC_SetRxBuffer(cdc_index, &hUsbDeviceFS, RX_Buffer[cdc_index]);
+        USBD_CDC_ReceivePacket(cdc_index, &hUsbDeviceFS);
+      }
+    }
+    else
+    {
+      CDC_Out_Release(cdc_index);
+    }
+  }
+  CDC_Tx_Kick(cdc_index);
+}
+
+/**
+  * @brief  Factory defaults of a channel: 115200 8N1 as CubeMX sets up the
+  *         UARTs, no flow control, stream mode
+  */
+static void CDC_Config_Defaults(uint8_t cdc_index, CDC_Config_TypeDef *config)
+{
+  config->Magic = CONFIG_MAGIC;
+  config->Channel = cdc_index;
+  config->Flow_Control = CDC_FLOW_CONTROL_NONE;
+  config->Bitrate = 0U;
+  config->Format = 0U;
+  config->Parity_Type = 0U;
+  config->Data_Type = 8U;
+  config->Latency_Ms = DEFAULT_LATENCY_MS;
+  config->Packet_Mode = CDC_PACKET_NONE;
+  config->Stored = 0U;
+}
+
+static uint16_t CDC_Config_Check(const CDC_Config_TypeDef *config)
+{
+  const uint16_t *half = (const uint16_t *)config;
+  uint16_t sum = 0U;
+
+  for (uint32_t n = 0U; n < (CONFIG_HALF_WORDS - 1U); n++)
+  {
+    sum += half[n];
+  }
+
+  return (uint16_t)~sum;
+}
+
+static uint8_t CDC_Config_Blank(const CDC_Config_TypeDef *config)
+{
+  const uint16_t *half = (const uint16_t *)config;
+
+  for (uint32_t n = 0U; n < CONFIG_HALF_WORDS; n++)
+  {
+    if (half[n] != 0xFFFFU)
+    {
+      return 0U;
+    }
+  }
+
+  return 1U;
+}
+
+static uint8_t CDC_Config_Header(const CDC_Config_TypeDef *config)
+{
+  return (config->Magic == CONFIG_MAGIC) && (config->Check == CDC_Config_Check(config)) &&
+         (config->Channel == CONFIG_HEADER);
+}
+
+/**
+  * @brief  Program a record into a blank slot
+  * @retval 1 if done, 0 on a failed write
+  */
+static uint8_t CDC_Config_Program(uint32_t address, const CDC_Config_TypeDef *config)
+{
+  const uint16_t *half = (const uint16_t *)config;
+
+  for (uint32_t n = 0U; n < CONFIG_HALF_WORDS; n++)
+  {
+    if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address + 2U * n, half[n]) != HAL_OK)
+    {
+      return 0U;
+    }
+  }
+
+  return 1U;
+}
+
+/**
+  * @brief  Append a record to the active config page
+  * @retval 1 if done, 0 if the page is full
+  */
+static uint8_t CDC_Config_Append(const CDC_Config_TypeDef *config)
+{
+  while (Config_Next < CONFIG_SLOTS)
+  {
+    /* Past a torn write the slot is not blank any more, nor is it valid */
+    Config_Next++;
+    if (CDC_Config_Program(Config_Page + (Config_Next - 1U) * sizeof(CDC_Config_TypeDef), config) != 0U)
+    {
+      return 1U;
+    }
+  }
+
+  return 0U;
+}
+
+/**
+  * @brief  Erase the other config page, write the stored records there and
+  *         its header last. Until the header is complete the active page is
+  *         the one it was, whenever the power goes
+  */
+static void CDC_Config_Compact(const CDC_Config_TypeDef *config)
+{
+  FLASH_EraseInitTypeDef erase = {0};
+  CDC_Config_TypeDef header;
+  uint32_t active = Config_Page;
+  uint32_t page = (active == CONFIG_PAGE_A) ? CONFIG_PAGE_B : CONFIG_PAGE_A;
+  uint32_t page_error;
+
+  erase.TypeErase = FLASH_TYPEERASE_PAGES;
+  erase.PageAddress = page;
+  erase.NbPages = 1U;
+  if (HAL_FLASHEx_Erase(&erase, &page_error) != HAL_OK)
+  {
+    return;
+  }
+
+  Config_Page = page;
+  Config_Next = 1U;
+  for (uint8_t i = 0U; i < NUMBER_OF_CDC; i++)
+  {
+    if (config[i].Stored != 0U)
+    {
+      CDC_Config_Append(&config[i]);
+    }
+  }
+
+  memset(&header, 0xFF, sizeof(header));
+  header.Magic = CONFIG_MAGIC;
+  header.Channel = CONFIG_HEADER;
+  header.Bitrate = Config_Seq + 1U;
+  header.Check = CDC_Config_Check(&header);
+  if (CDC_Config_Program(page, &header) != 0U)
+  {
+    Config_Seq = header.Bitrate;
+  }
+  else
+  {
+    /* Still the old one at the next boot, the next save copies again */
+    Config_Page = active;
+    Config_Next = CONFIG_SLOTS;
+  }
+}
+
+/**
+  * @brief  Load the boot defaults from the active config page and bring up
+  *         every channel with them, receiving into its ring before the host
+  *         gets to it. A scan of at most CONFIG_SLOTS records, a few microseconds
+  */
+void CDC_Config_Load(void)
+{
+  const CDC_Config_TypeDef *page_a = (const CDC_Config_TypeDef *)CONFIG_PAGE_A;
+  const CDC_Config_TypeDef *page_b = (const CDC_Config_TypeDef *)CONFIG_PAGE_B;
+  const CDC_Config_TypeDef *slot;
+
+  for (uint8_t i = 0U; i < NUMBER_OF_CDC; i++)
+  {
+    CDC_Config_Defaults(i, &Boot_Config[i]);
+  }
+
+  /* Both headers valid once a copy is done, until the next erases the older */
+  Config_Page = 0U;
+  Config_Next = CONFIG_SLOTS;
+  if (CDC_Config_Header(page_a) != 0U)
+  {
+    Config_Page = CONFIG_PAGE_A;
+    Config_Seq = page_a->Bitrate;
+  }
+  if ((CDC_Config_Header(page_b) != 0U) &&
+      ((Config_Page == 0U) || ((int32_t)(page_b->Bitrate - Config_Seq) > 0)))
+  {
+    Config_Page = CONFIG_PAGE_B;
+    Config_Seq = page_b->Bitrate;
+  }
+
+  /* Records are appended from the bottom, the page is used up to the first blank slot */
+  slot = (const CDC_Config_TypeDef *)Config_Page;
+  for (Config_Next = 1U; (Config_Page != 0U) && (Config_Next < CONFIG_SLOTS) &&
+                         (CDC_Config_Blank(&slot[Config_Next]) == 0U);
+       Config_Next++)
   {
-    /* Initialization Error */
-    Error_Handler();
+    if ((slot[Config_Next].Magic == CONFIG_MAGIC) && (slot[Config_Next].Check == CDC_Config_Check(&slot[Config_Next])) &&
+        (slot[Config_Next].Channel < NUMBER_OF_CDC))
+    {
+      Boot_Config[slot[Config_Next].Channel] = slot[Config_Next];
+    }
   }
-  /* set the Stop bit */
-  switch (Line_Coding[cdc_index].format)
+  if (Config_Page == 0U)
   {
-  case 0:
-    handle->Init.StopBits = UART_STOPBITS_1;
-    break;
-  case 2:
-    handle->Init.StopBits = UART_STOPBITS_2;
-    break;
-  default:
-    handle->Init.StopBits = UART_STOPBITS_1;
-    break;
+    /* The first save writes a page */
+    Config_Next = CONFIG_SLOTS;
   }
 
-  /* set the parity bit*/
-  switch (Line_Coding[cdc_index].paritytype)
+  for (uint8_t i = 0U; i < NUMBER_OF_CDC; i++)
   {
-  case 0:
-    handle->Init.Parity = UART_PARITY_NONE;
-    break;
-  case 1:
-    handle->Init.Parity = UART_PARITY_ODD;
-    break;
-  case 2:
-    handle->Init.Parity = UART_PARITY_EVEN;
-    break;
-  default:
-    handle->Init.Parity = UART_PARITY_NONE;
-    break;
+    CDC_Ctx[i].Line_Coding.bitrate = Boot_Config[i].Bitrate;
+    CDC_Ctx[i].Line_Coding.format = Boot_Config[i].Format;
+    CDC_Ctx[i].Line_Coding.paritytype = Boot_Config[i].Parity_Type;
+    CDC_Ctx[i].Line_Coding.datatype = Boot_Config[i].Data_Type;
+    CDC_Ctx[i].Flow_Control = Boot_Config[i].Flow_Control;
+    CDC_Ctx[i].Latency_Ms = Boot_Config[i].Latency_Ms;
+    CDC_Ctx[i].Packet_Mode = Boot_Config[i].Packet_Mode;
+
+    /* Before the UART can call back */
+    Uart_Channel[UART_SLOT(CDC_Channel[i].huart->Instance)] = i;
+    Change_UART_Setting(i);
   }
+}
 
-  /*set the data type : only 8bits and 9bits is supported */
-  switch (Line_Coding[cdc_index].datatype)
+/**
+  * @brief  Reconfigure the UARTs whose settings changed on EP0. Runs at the
+  *         end of the USB interrupt, the status stage is armed by then and the
+  *         host's request done while the UART is deinitialized
+  */
+void CDC_Apply_Settings(void)
+{
+  for (uint8_t i = 0U; (Settings_Due != 0U) && (i < NUMBER_OF_CDC); i++)
   {
-  case 0x07:
-    /* With this configuration a parity (Even or Odd) must be set */
-    handle->Init.WordLength = UART_WORDLENGTH_8B;
-    break;
-  case 0x08:
-    if (handle->Init.Parity == UART_PARITY_NONE)
-    {
-      handle->Init.WordLength = UART_WORDLENGTH_8B;
-    }
-    else
+    if ((Settings_Due & (1U << i)) != 0U)
     {
-      handle->Init.WordLength = UART_WORDLENGTH_9B;
+      Change_UART_Setting(i);
+      Settings_Due &= (uint8_t)~(1U << i);
+      CDC_Tx_Kick(i);
     }
-
-    break;
-  default:
-    handle->Init.WordLength = UART_WORDLENGTH_8B;
-    break;
   }
+}
+
+/**
+  * @brief  Program the boot defaults saved on EP0, from the main loop. The
+  *         flash stalls the CPU for a record (about 0.5 ms) or a page copy
+  *         (20 to 40 ms erase), the UART DMA running on, but no interrupt is
+  *         held up behind it and the HAL flash timeouts see the tick
+  */
+void CDC_Config_Service(void)
+{
+  CDC_Config_TypeDef config[NUMBER_OF_CDC];
+  uint8_t due;
 
-  if (Line_Coding[cdc_index].bitrate == 0)
+  if (Config_Due == 0U)
   {
-    Line_Coding[cdc_index].bitrate = 115200;
+    return;
   }
 
-  handle->Init.BaudRate = Line_Coding[cdc_index].bitrate;
-  handle->Init.HwFlowCtl = UART_HWCONTROL_NONE;
-  handle->Init.Mode = UART_MODE_TX_RX;
-  handle->Init.OverSampling = UART_OVERSAMPLING_16;
+  /* Boot_Config is written by EP0 requests in the USB interrupt */
+  HAL_NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+  due = Config_Due;
+  Config_Due = 0U;
+  memcpy(config, Boot_Config, sizeof(config));
+  HAL_NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
 
-  if (HAL_UART_Init(handle) != HAL_OK)
+  HAL_FLASH_Unlock();
+  for (uint8_t i = 0U; i < NUMBER_OF_CDC; i++)
   {
-    /* Initialization Error */
-    Error_Handler();
+    if (((due & (1U << i)) != 0U) && (CDC_Config_Append(&config[i]) == 0U))
+    {
+      /* The copy takes every channel's record */
+      CDC_Config_Compact(config);
+      break;
+    }
   }
+  HAL_FLASH_Lock();
+}
 
-  /** rx for uart and tx buffer of usb */
-  if (HAL_UART_Receive_IT(handle, TX_Buffer[cdc_index], 1) != HAL_OK)
+/**
+  * @brief  Note when a boot milestone is first reached, in TIM2 microseconds
+  *         since SysInit. Boot_Us is read with the debugger
+  */
+void CDC_Boot_Mark(uint8_t mark)
+{
+  if (Boot_Us[mark] == 0U)
   {
-    /* Transfer error in reception process */
-    Error_Handler();
+    Boot_Us[mark] = TIM2_Micros();
   }
 }
 /* USER CODE END PRIVATE_FUNCTIONS_DECLARATION */
@@ -283,17 +2235,25 @@ USBD_CDC_ItfTypeDef USBD_Interface_fops_FS =
 static int8_t CDC_Init_FS(uint8_t cdc_index)
 {
   /* USER CODE BEGIN 3 */
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
 
   /* ##-1- Set Application Buffers */
   USBD_CDC_SetRxBuffer(cdc_index, &hUsbDeviceFS, RX_Buffer[cdc_index]);
 
-  /*##-2- Start the TIM Base generation in interrupt mode ####################*/
-  /* Start Channel1 */
-  if (HAL_TIM_Base_Start_IT(&htim4) != HAL_OK)
-  {
-    /* Starting Error */
-    Error_Handler();
-  }
+  /* The class arms the OUT endpoint at the bottom of the ring */
+  ctx->Out_Head = 0U;
+  ctx->Out_Tail = 0U;
+  ctx->Out_Dma_Len = 0U;
+  ctx->Out_Armed = 1U;
+
+  /* New host, report any asserted modem input on the next tick */
+  ctx->Serial_State_Lines = 0U;
+
+  ctx->Latency_Ms = Boot_Config[cdc_index].Latency_Ms;
+  ctx->Fill_Threshold = 0U;
+
+  /* The UARTs and the tick run since boot, the ring holds what came meanwhile */
+  CDC_Boot_Mark(BOOT_CONFIGURED);
 
   return (USBD_OK);
   /* USER CODE END 3 */
@@ -306,12 +2266,23 @@ static int8_t CDC_Init_FS(uint8_t cdc_index)
 static int8_t CDC_DeInit_FS(uint8_t cdc_index)
 {
   /* USER CODE BEGIN 4 */
-  /* DeInitialize the UART peripheral */
-  if (HAL_UART_DeInit(CDC_Index_To_UART_Handle(cdc_index)) != HAL_OK)
-  {
-    /* Initialization Error */
-    Error_Handler();
-  }
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+
+  /* Host gone, release the modem lines */
+  CDC_Set_Control_Line_State(cdc_index, 0U);
+  CDC_Break_Stop(cdc_index);
+  ctx->Break_Request = 0U;
+  CDC_DE_Release(cdc_index);
+
+  /* Reception goes on for the next host. What the UART was sending is
+     dropped, the OUT buffers start over in CDC_Init_FS */
+  HAL_UART_AbortTransmit(CDC_Index_To_UART_Handle(cdc_index));
+  ctx->Tx_Data_Busy = 0U;
+  ctx->Tx_Pending_Len = 0U;
+  ctx->Tx_Paused = 0U;
+  ctx->Flow_Char = 0U;
+  ctx->Out_Len = 0U;
+  ctx->Enc_Step = ENC_IDLE;
   return (USBD_OK);
   /* USER CODE END 4 */
 }
@@ -326,6 +2297,15 @@ static int8_t CDC_DeInit_FS(uint8_t cdc_index)
 static int8_t CDC_Control_FS(uint8_t cdc_index, uint8_t cmd, uint8_t *pbuf, uint16_t length)
 {
   /* USER CODE BEGIN 5 */
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+
+  /* A vendor setting sent as a read, or a read as a setting, would take the
+     setup packet for data or the other way round */
+  if ((cmd >= CDC_VENDOR_SET_FLOW_CONTROL) && ((length != 0U) != (cmd >= CDC_VENDOR_GET_TX_GAPS)))
+  {
+    return (USBD_FAIL);
+  }
+
   switch (cmd)
   {
   case CDC_SEND_ENCAPSULATED_COMMAND:
@@ -366,34 +2346,241 @@ static int8_t CDC_Control_FS(uint8_t cdc_index, uint8_t cmd, uint8_t *pbuf, uint
     /* 6      | bDataBits  |   1   | Number Data bits (5, 6, 7, 8 or 16).          */
     /*******************************************************************************/
   case CDC_SET_LINE_CODING:
-    Line_Coding[cdc_index].bitrate = (uint32_t)(pbuf[0] | (pbuf[1] << 8) |
-                                                (pbuf[2] << 16) | (pbuf[3] << 24));
-    Line_Coding[cdc_index].format = pbuf[4];
-    Line_Coding[cdc_index].paritytype = pbuf[5];
-    Line_Coding[cdc_index].datatype = pbuf[6];
+    ctx->Line_Coding.bitrate = (uint32_t)(pbuf[0] | (pbuf[1] << 8) |
+                                         (pbuf[2] << 16) | (pbuf[3] << 24));
+    ctx->Line_Coding.format = pbuf[4];
+    ctx->Line_Coding.paritytype = pbuf[5];
+    ctx->Line_Coding.datatype = pbuf[6];
 
-    Change_UART_Setting(cdc_index);
+    Settings_Due |= (uint8_t)(1U << cdc_index);
     break;
 
   case CDC_GET_LINE_CODING:
-    pbuf[0] = (uint8_t)(Line_Coding[cdc_index].bitrate);
-    pbuf[1] = (uint8_t)(Line_Coding[cdc_index].bitrate >> 8);
-    pbuf[2] = (uint8_t)(Line_Coding[cdc_index].bitrate >> 16);
-    pbuf[3] = (uint8_t)(Line_Coding[cdc_index].bitrate >> 24);
-    pbuf[4] = Line_Coding[cdc_index].format;
-    pbuf[5] = Line_Coding[cdc_index].paritytype;
-    pbuf[6] = Line_Coding[cdc_index].datatype;
+    pbuf[0] = (uint8_t)(ctx->Line_Coding.bitrate);
+    pbuf[1] = (uint8_t)(ctx->Line_Coding.bitrate >> 8);
+    pbuf[2] = (uint8_t)(ctx->Line_Coding.bitrate >> 16);
+    pbuf[3] = (uint8_t)(ctx->Line_Coding.bitrate >> 24);
+    pbuf[4] = ctx->Line_Coding.format;
+    pbuf[5] = ctx->Line_Coding.paritytype;
+    pbuf[6] = ctx->Line_Coding.datatype;
     break;
 
   case CDC_SET_CONTROL_LINE_STATE:
-
+    CDC_Set_Control_Line_State(cdc_index, (uint8_t)((USBD_SetupReqTypedef *)pbuf)->wValue);
     break;
 
+    /* wValue: break length in ms, 0xFFFF until a SEND_BREAK of 0 */
   case CDC_SEND_BREAK:
+    if (((USBD_SetupReqTypedef *)pbuf)->wValue == 0U)
+    {
+      CDC_Break_Stop(cdc_index);
+    }
+    else
+    {
+      /* Starts once the byte on the wire has gone out, timed by TIM2 */
+      ctx->Break_Request = ((USBD_SetupReqTypedef *)pbuf)->wValue;
+    }
+    CDC_Tx_Kick(cdc_index);
+    break;
+
+  case CDC_VENDOR_SET_FLOW_CONTROL:
+    /* RS-485 is half duplex and its DE takes the RTS pin, RTU frames are binary */
+    if (((ctx->Rs485 | ctx->Modbus) != 0U) && (((USBD_SetupReqTypedef *)pbuf)->wValue != CDC_FLOW_CONTROL_NONE))
+    {
+      return (USBD_FAIL);
+    }
+    /* So are COBS and SLIP packets */
+    if ((ctx->Packet_Mode != CDC_PACKET_NONE) && (((USBD_SetupReqTypedef *)pbuf)->wValue == CDC_FLOW_CONTROL_XON_XOFF))
+    {
+      return (USBD_FAIL);
+    }
+    switch (((USBD_SetupReqTypedef *)pbuf)->wValue)
+    {
+    case CDC_FLOW_CONTROL_NONE:
+      ctx->Flow_Control = CDC_FLOW_CONTROL_NONE;
+      break;
+    case CDC_FLOW_CONTROL_RTS_CTS:
+      /* USART1 CTS (PA11) is taken by USB */
+      if (CDC_Index_To_UART_Handle(cdc_index)->Instance == USART1)
+      {
+        return (USBD_FAIL);
+      }
+      ctx->Flow_Control = CDC_FLOW_CONTROL_RTS_CTS;
+      break;
+    case CDC_FLOW_CONTROL_XON_XOFF:
+      ctx->Flow_Control = CDC_FLOW_CONTROL_XON_XOFF;
+      break;
+    default:
+      return (USBD_FAIL);
+    }
+
+    Settings_Due |= (uint8_t)(1U << cdc_index);
+    break;
+
+  case CDC_VENDOR_SET_DTR_GATING:
+    ctx->Dtr_Gating = (((USBD_SetupReqTypedef *)pbuf)->wValue != 0U);
+    break;
+
+  case CDC_VENDOR_SET_MULTIDROP:
+    if ((((USBD_SetupReqTypedef *)pbuf)->wValue & ~(CDC_MULTIDROP_ENABLE | CDC_MULTIDROP_ADDRESS_MASK)) != 0U)
+    {
+      return (USBD_FAIL);
+    }
+    ctx->Multidrop = ((USBD_SetupReqTypedef *)pbuf)->wValue;
+    if ((ctx->Multidrop & CDC_MULTIDROP_ENABLE) == 0U)
+    {
+      ctx->Multidrop = 0U;
+    }
+
+    Settings_Due |= (uint8_t)(1U << cdc_index);
+    break;
+
+  case CDC_VENDOR_SET_RS485:
+    if (ctx->Flow_Control != CDC_FLOW_CONTROL_NONE)
+    {
+      return (USBD_FAIL);
+    }
+    ctx->Rs485 = (((USBD_SetupReqTypedef *)pbuf)->wValue != 0U);
+
+    /* Release the bus, or give the pin back to RTS */
+    CDC_DE_Release(cdc_index);
+    CDC_Update_RTS(cdc_index);
+    break;
+
+  case CDC_VENDOR_SET_RS485_GUARD:
+    ctx->Rs485_Guard = ((USBD_SetupReqTypedef *)pbuf)->wValue;
+    break;
+
+  case CDC_VENDOR_SET_MODBUS:
+    if ((ctx->Flow_Control != CDC_FLOW_CONTROL_NONE) || (ctx->Timestamps != 0U) ||
+        (ctx->Packet_Mode != CDC_PACKET_NONE))
+    {
+      return (USBD_FAIL);
+    }
+    if (ctx->Frame_Timer != FRAME_TIMER_NONE)
+    {
+      TIM2_Stop_Timeout(cdc_index);
+      ctx->Frame_Timer = FRAME_TIMER_NONE;
+    }
+    /* Whatever the ring holds goes out on the next tick or with the first frame */
+    ctx->Frame_Count = 0U;
+    ctx->Frame_Broken = 0U;
+    ctx->Modbus = (((USBD_SetupReqTypedef *)pbuf)->wValue != 0U);
+    break;
+
+  case CDC_VENDOR_SET_TIMESTAMPS:
+    if ((ctx->Modbus != 0U) || (ctx->Packet_Mode != CDC_PACKET_NONE))
+    {
+      return (USBD_FAIL);
+    }
+    /* What the ring holds goes as one burst from now */
+    CDC_Rx_Process(cdc_index);
+    ctx->Burst_Count = 0U;
+    ctx->Burst_Current = TIM2_Micros();
+    ctx->Timestamps = (((USBD_SetupReqTypedef *)pbuf)->wValue != 0U);
+
+    if ((ctx->Timestamps != 0U) && (CDC_Index_To_UART_Handle(cdc_index)->RxState == HAL_UART_STATE_BUSY_RX))
+    {
+      CDC_Burst_Arm(cdc_index);
+      CDC_Burst_Enable(cdc_index);
+    }
+    else
+    {
+      ctx->Burst_Armed = 0U;
+      CLEAR_BIT(CDC_Index_To_UART_Handle(cdc_index)->Instance->CR1, USART_CR1_RXNEIE);
+    }
+    break;
+
+  case CDC_VENDOR_SET_PACKET:
+    if ((((USBD_SetupReqTypedef *)pbuf)->wValue > CDC_PACKET_SLIP) ||
+        (ctx->Modbus != 0U) || (ctx->Timestamps != 0U) ||
+        (ctx->Flow_Control == CDC_FLOW_CONTROL_XON_XOFF))
+    {
+      return (USBD_FAIL);
+    }
+    /* Not in the middle of a packet from USB, the OUT buffer may be gathering
+       it, nor with stream data on its way to the UART */
+    if ((ctx->Out_Len != 0U) || (ctx->Enc_Step != ENC_IDLE) ||
+        (ctx->Out_Head != ctx->Out_Tail) ||
+        (ctx->Tx_Data_Busy != 0U) || (ctx->Tx_Pending_Len != 0U))
+    {
+      return (USBD_FAIL);
+    }
+
+    /* Both modes start the OUT endpoint at the bottom of RX_Buffer */
+    ctx->Out_Head = 0U;
+    ctx->Out_Tail = 0U;
+    ctx->Out_Armed = 1U;
+    USBD_CDC_SetRxBuffer(cdc_index, &hUsbDeviceFS, RX_Buffer[cdc_index]);
+    USBD_CDC_ReceivePacket(cdc_index, &hUsbDeviceFS);
+
+    /* What the ring holds goes as a stream, decoding starts at the next packet */
+    CDC_Rx_Process(cdc_index);
+    ctx->Frame_Count = 0U;
+    ctx->Dec_Code = 0U;
+    ctx->Dec_Left = 0U;
+    ctx->Dec_Esc = 0U;
+    ctx->Packet_Mode = (uint8_t)((USBD_SetupReqTypedef *)pbuf)->wValue;
+    break;
+
+  case CDC_VENDOR_SET_LATENCY:
+    if (((USBD_SetupReqTypedef *)pbuf)->wValue > 0xFFU)
+    {
+      return (USBD_FAIL);
+    }
+    ctx->Latency_Ms = (uint8_t)((USBD_SetupReqTypedef *)pbuf)->wValue;
+    break;
+
+  case CDC_VENDOR_SET_FILL:
+    /* Whole packets, and below the flow control high watermark to ever be reached */
+    if (((USBD_SetupReqTypedef *)pbuf)->wValue > RX_HIGH_WATERMARK)
+    {
+      return (USBD_FAIL);
+    }
+    ctx->Fill_Threshold = ((USBD_SetupReqTypedef *)pbuf)->wValue -
+                          (((USBD_SetupReqTypedef *)pbuf)->wValue % CDC_DATA_FS_IN_PACKET_SIZE);
+    break;
+
+  case CDC_VENDOR_SAVE_CONFIG:
+    if (((USBD_SetupReqTypedef *)pbuf)->wValue > 1U)
+    {
+      return (USBD_FAIL);
+    }
+    CDC_Config_Defaults(cdc_index, &Boot_Config[cdc_index]);
+    if (((USBD_SetupReqTypedef *)pbuf)->wValue != 0U)
+    {
+      Boot_Config[cdc_index].Flow_Control = ctx->Flow_Control;
+      Boot_Config[cdc_index].Bitrate = ctx->Line_Coding.bitrate;
+      Boot_Config[cdc_index].Format = ctx->Line_Coding.format;
+      Boot_Config[cdc_index].Parity_Type = ctx->Line_Coding.paritytype;
+      Boot_Config[cdc_index].Data_Type = ctx->Line_Coding.datatype;
+      Boot_Config[cdc_index].Latency_Ms = ctx->Latency_Ms;
+      Boot_Config[cdc_index].Packet_Mode = ctx->Packet_Mode;
+      Boot_Config[cdc_index].Stored = 1U;
+    }
+    Boot_Config[cdc_index].Check = CDC_Config_Check(&Boot_Config[cdc_index]);
+
+    /* Programmed from the main loop, flash writes stall the CPU */
+    Config_Due |= (uint8_t)(1U << cdc_index);
+    break;
 
+  case CDC_VENDOR_GET_TX_GAPS:
+    if (length != 4U)
+    {
+      return (USBD_FAIL);
+    }
+    pbuf[0] = (uint8_t)(ctx->Tx_Gaps);
+    pbuf[1] = (uint8_t)(ctx->Tx_Gaps >> 8);
+    pbuf[2] = (uint8_t)(ctx->Tx_Gaps >> 16);
+    pbuf[3] = (uint8_t)(ctx->Tx_Gaps >> 24);
     break;
 
   default:
+    /* Stall vendor requests we do not know */
+    if (cmd >= CDC_VENDOR_SET_FLOW_CONTROL)
+    {
+      return (USBD_FAIL);
+    }
     break;
   }
 
@@ -419,7 +2606,48 @@ static int8_t CDC_Control_FS(uint8_t cdc_index, uint8_t cmd, uint8_t *pbuf, uint
 static int8_t CDC_Receive_FS(uint8_t cdc_index, uint8_t *Buf, uint32_t *Len)
 {
   /* USER CODE BEGIN 6 */
-  HAL_UART_Transmit_DMA(CDC_Index_To_UART_Handle(cdc_index), Buf, *Len);
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+
+  if (ctx->Packet_Mode != CDC_PACKET_NONE)
+  {
+    ctx->Out_Len += *Len;
+
+    /* A full packet continues the transfer, the next one lands behind it */
+    if ((*Len == CDC_DATA_FS_OUT_PACKET_SIZE) && ((ctx->Out_Len + CDC_DATA_FS_OUT_PACKET_SIZE) <= APP_RX_DATA_SIZE))
+    {
+      USBD_CDC_SetRxBuffer(cdc_index, &hUsbDeviceFS, &RX_Buffer[cdc_index][ctx->Out_Len]);
+      USBD_CDC_ReceivePacket(cdc_index, &hUsbDeviceFS);
+      return (USBD_OK);
+    }
+
+    /* Short packet or ZLP, the whole transfer is one packet for the UART */
+    USBD_CDC_SetRxBuffer(cdc_index, &hUsbDeviceFS, RX_Buffer[cdc_index]);
+    if (ctx->Out_Len == 0U)
+    {
+      USBD_CDC_ReceivePacket(cdc_index, &hUsbDeviceFS);
+      return (USBD_OK);
+    }
+    ctx->Enc_Pos = 0U;
+    ctx->Enc_Len = ctx->Out_Len;
+    ctx->Enc_Step = ENC_BLOCK;
+    ctx->Out_Len = 0U;
+
+    CDC_Encode_Chunk(cdc_index);
+    CDC_Tx_Kick(cdc_index);
+    return (USBD_OK);
+  }
+
+  /* Stream mode, the packet landed at the head of the OUT ring (a ZLP adds
+     nothing). The endpoint takes the next slot right away if there is room */
+  if ((ctx->Tx_Set_Mask | ctx->Tx_Clear_Mask) != 0U)
+  {
+    CDC_Mask_Span(Buf, *Len, ctx->Tx_Clear_Mask, ctx->Tx_Set_Mask);
+  }
+
+  ctx->Out_Head += *Len;
+  ctx->Out_Armed = 0U;
+  CDC_Out_Arm(cdc_index);
+  CDC_Tx_Kick(cdc_index);
   return (USBD_OK);
   /* USER CODE END 6 */
 }
@@ -427,58 +2655,230 @@ static int8_t CDC_Receive_FS(uint8_t cdc_index, uint8_t *Buf, uint32_t *Len)
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_IMPLEMENTATION */
 void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
 {
-  /* Initiate next USB packet transfer once UART completes transfer (transmitting data over Tx line) */
-  USBD_CDC_ReceivePacket(UART_Handle_TO_CDC_Index(huart), &hUsbDeviceFS);
+  uint8_t cdc_index = UART_Handle_TO_CDC_Index(huart);
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+
+  if (ctx->Tx_Data_Busy != 0U)
+  {
+    /* The last span was freed at its DMA complete, data here came too late to chain */
+    ctx->Tx_Data_Busy = 0U;
+    if ((ctx->Break_Request == 0U) && (ctx->Tx_Paused == 0U) && (CDC_Out_Pending(cdc_index) != 0U))
+    {
+      ctx->Tx_Gaps++;
+    }
+  }
+
+  CDC_Tx_Kick(cdc_index);
+}
+
+/**
+  * @brief  Called from the USART interrupt ahead of the HAL handler. Takes the
+  *         idle line and the receive errors of the circular RX DMA, which the
+  *         HAL would abort on, and inserts a pending XON/XOFF while the DMA
+  *         request of a USB packet is masked
+  * @param  cdc_index: channel of the interrupt, UART cdc_index + 1
+  */
+void CDC_UART_IRQHandler(uint8_t cdc_index)
+{
+  CDC_Context_TypeDef *ctx = &CDC_Ctx[cdc_index];
+  UART_HandleTypeDef *huart;
+  uint32_t isrflags;
+  uint32_t head;
+
+  if (cdc_index >= NUMBER_OF_CDC)
+  {
+    /* UART not built as a channel */
+    return;
+  }
+
+  huart = CDC_Channel[cdc_index].huart;
+  isrflags = READ_REG(huart->Instance->SR);
+
+  /* Timestamp mode, first byte after an idle line. RXNEIE is only ever ours
+     and the byte the DMA's: it is cleared before HAL_UART_IRQHandler, whose
+     UART_Receive_IT would read DR into a reception it does not own, and set
+     again by CDC_UART_IRQ_Done */
+  if (READ_BIT(huart->Instance->CR1, USART_CR1_RXNEIE) != 0U)
+  {
+    CLEAR_BIT(huart->Instance->CR1, USART_CR1_RXNEIE);
+    while ((READ_BIT(huart->Instance->SR, USART_SR_RXNE) != 0U) &&
+           (READ_BIT(huart->hdmarx->Instance->CCR, DMA_CCR_EN) != 0U))
+    {
+    }
+    CDC_Burst_Catch(cdc_index);
+  }
+
+  if (((isrflags & (USART_SR_PE | USART_SR_FE | USART_SR_NE | USART_SR_ORE | USART_SR_IDLE)) != 0U) &&
+      (READ_BIT(huart->Instance->CR3, USART_CR3_DMAR) != 0U))
+  {
+    /* Let the DMA take the byte first, the DR read then ends the SR/DR clear sequence */
+    while ((READ_BIT(huart->Instance->SR, USART_SR_RXNE) != 0U) &&
+           (READ_BIT(huart->hdmarx->Instance->CCR, DMA_CCR_EN) != 0U))
+    {
+    }
+    (void)READ_REG(huart->Instance->DR);
+
+    /* Faulty byte is the last one the DMA wrote, a framing error on 0x00 is a break */
+    head = APP_TX_DATA_SIZE - __HAL_DMA_GET_COUNTER(huart->hdmarx);
+    if ((isrflags & USART_SR_FE) != 0U)
+    {
+      ctx->Serial_State_Errors |= (TX_Buffer[cdc_index][(head + APP_TX_DATA_SIZE - 1U) % APP_TX_DATA_SIZE] == 0U) ? CDC_SERIAL_STATE_BREAK : CDC_SERIAL_STATE_FRAMING;
+    }
+    if ((isrflags & USART_SR_PE) != 0U)
+    {
+      ctx->Serial_State_Errors |= CDC_SERIAL_STATE_PARITY;
+    }
+    if ((isrflags & USART_SR_ORE) != 0U)
+    {
+      ctx->Serial_State_Errors |= CDC_SERIAL_STATE_OVERRUN;
+    }
+
+    CDC_Rx_Process(cdc_index);
+
+    /* Modbus frames end on line silence, not while we drive the bus or hold a break */
+    if (((isrflags & USART_SR_IDLE) != 0U) && (ctx->Modbus != 0U) &&
+        (ctx->De_State == DE_IDLE) && (ctx->Break_Active == 0U))
+    {
+      CDC_Frame_Gap_Start(cdc_index);
+    }
+
+    if (((isrflags & USART_SR_IDLE) != 0U) && (ctx->Timestamps != 0U))
+    {
+      CDC_Burst_Arm(cdc_index);
+    }
+
+    /* End of a burst, its short packet may go now */
+    if ((isrflags & USART_SR_IDLE) != 0U)
+    {
+      ctx->Rx_Idle = 1U;
+      if (ctx->Latency_Ms == 0U)
+      {
+        CDC_Usb_Flush(cdc_index);
+      }
+    }
+  }
+
+  if ((ctx->Flow_Char != 0U) &&
+      (READ_BIT(huart->Instance->CR1, USART_CR1_TXEIE) != 0U) &&
+      (READ_BIT(huart->Instance->SR, USART_SR_TXE) != 0U) &&
+      (ctx->Tx_Data_Busy != 0U))
+  {
+    huart->Instance->DR = ctx->Flow_Char;
+    ctx->Flow_Char = 0U;
+    CLEAR_BIT(huart->Instance->CR1, USART_CR1_TXEIE);
+
+    if (ctx->Tx_Paused == 0U)
+    {
+      SET_BIT(huart->Instance->CR3, USART_CR3_DMAT);
+    }
+  }
+}
+
+/**
+  * @brief  Called from the USART interrupt after the HAL handler. A burst
+  *         still waiting for its first byte gets RXNEIE back
+  * @param  cdc_index: channel of the interrupt, UART cdc_index + 1
+  */
+void CDC_UART_IRQ_Done(uint8_t cdc_index)
+{
+  if ((cdc_index < NUMBER_OF_CDC) && (CDC_Ctx[cdc_index].Timestamps != 0U))
+  {
+    CDC_Burst_Enable(cdc_index);
+  }
+}
+
+/**
+  * @brief  Modbus gap check, end of a DE guard time or of a timed break
+  */
+void TIM2_Timeout_Callback(uint8_t timeout_index)
+{
+  if (CDC_Ctx[timeout_index].Frame_Timer != FRAME_TIMER_NONE)
+  {
+    CDC_Frame_Timeout(timeout_index);
+    return;
+  }
+
+  if (CDC_Ctx[timeout_index].De_State == DE_SETUP)
+  {
+    CDC_Ctx[timeout_index].De_State = DE_DRIVING;
+  }
+  else if (CDC_Ctx[timeout_index].De_State == DE_HOLD)
+  {
+    CDC_DE_Release(timeout_index);
+  }
+  else
+  {
+    CDC_Break_Stop(timeout_index);
+  }
+  CDC_Tx_Kick(timeout_index);
 }
 
 void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim)
 {
   for (uint8_t i = 0; i < NUMBER_OF_CDC; i++)
   {
-    uint32_t buffptr;
-    uint32_t buffsize;
+    uint16_t lines;
+
+    CDC_Rx_Process(i);
+
+    /* Latency timer, restarted by every IN transfer. It only holds what is
+       short of a packet, whole packets go as soon as the endpoint is free or
+       a fast line fills the ring while the timer runs */
+    if (CDC_Ctx[i].Latency_Elapsed != 0xFFFFU)
+    {
+      CDC_Ctx[i].Latency_Elapsed++;
+    }
+    if ((CDC_Ctx[i].Latency_Elapsed >= CDC_Ctx[i].Latency_Ms) || (CDC_Ring_Level(i) >= CDC_DATA_FS_IN_PACKET_SIZE))
+    {
+      CDC_Usb_Flush(i);
+    }
 
-    if (Read_Index[i] != Write_Index[i])
+    /* Ring drained below the low watermark, let the far end send again */
+    if ((CDC_Ctx[i].Rx_Hold != 0U) && (CDC_Ring_Level(i) <= RX_LOW_WATERMARK))
     {
-      if (Read_Index[i] > Write_Index[i]) /* Rollback */
+      CDC_Ctx[i].Rx_Hold = 0U;
+      if (CDC_Ctx[i].Flow_Control == CDC_FLOW_CONTROL_RTS_CTS)
       {
-        buffsize = APP_TX_DATA_SIZE - Read_Index[i];
+        CDC_Update_RTS(i);
       }
       else
       {
-        buffsize = Write_Index[i] - Read_Index[i];
+        CDC_Send_Flow_Char(i, XON_CHAR);
       }
+    }
 
-      buffptr = Read_Index[i];
-
-      USBD_CDC_SetTxBuffer(i, &hUsbDeviceFS, &TX_Buffer[i][buffptr], buffsize);
+    /* At most one SERIAL_STATE per tick, errors pile up while one is in flight */
+    lines = CDC_Read_Modem_Lines(i);
 
-      if (USBD_CDC_TransmitPacket(i, &hUsbDeviceFS) == USBD_OK)
+    if ((CDC_Ctx[i].Serial_State_Errors != 0U) || (lines != CDC_Ctx[i].Serial_State_Lines))
+    {
+      if (USBD_CDC_SendSerialState(i, &hUsbDeviceFS, lines | CDC_Ctx[i].Serial_State_Errors) == USBD_OK)
       {
-        Read_Index[i] += buffsize;
-        if (Read_Index[i] == APP_RX_DATA_SIZE)
-        {
-          Read_Index[i] = 0;
-        }
+        CDC_Ctx[i].Serial_State_Lines = lines;
+        CDC_Ctx[i].Serial_State_Errors = 0U;
       }
     }
   }
 }
 
+void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart)
+{
+  CDC_Rx_Process(UART_Handle_TO_CDC_Index(huart));
+}
+
 void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
 {
-  uint8_t cdc_index = UART_Handle_TO_CDC_Index(huart);
-  /* Increment Index for buffer writing */
-  Write_Index[cdc_index]++;
+  /* Circular DMA, the reception goes on */
+  CDC_Rx_Process(UART_Handle_TO_CDC_Index(huart));
+}
 
-  /* To avoid buffer overflow */
-  if (Write_Index[cdc_index] == APP_RX_DATA_SIZE)
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+  /* Receive errors are taken in CDC_UART_IRQHandler, this is a DMA error */
+  if (huart->RxState == HAL_UART_STATE_READY)
   {
-    Write_Index[cdc_index] = 0;
+    CDC_Rx_Start(UART_Handle_TO_CDC_Index(huart));
   }
-
-  /* Start another reception: provide the buffer pointer with offset and the buffer size */
-  HAL_UART_Receive_IT(huart, (TX_Buffer[cdc_index] + Write_Index[cdc_index]), 1);
 }
 /* USER CODE END PRIVATE_FUNCTIONS_IMPLEMENTATION */
 
@@ -49,6 +49,13 @@
   * @{
   */
 /* USER CODE BEGIN EXPORTED_DEFINES */
+/* Boot_Us milestones */
+#define BOOT_UARTS_UP 0U   /* every channel receiving */
+#define BOOT_USB_START 1U  /* USBD_Start, the device answers the bus from here */
+#define BOOT_BUS_RESET 2U  /* first reset from the host */
+#define BOOT_CONFIGURED 3U /* SET_CONFIGURATION */
+#define BOOT_PORT_OPEN 4U  /* first DTR from the host, on any channel */
+#define BOOT_MARKS 5U
 
 /* USER CODE END EXPORTED_DEFINES */
 
@@ -91,6 +98,7 @@
 extern USBD_CDC_ItfTypeDef USBD_Interface_fops_FS;
 
 /* USER CODE BEGIN EXPORTED_VARIABLES */
+extern uint32_t Boot_Us[BOOT_MARKS];
 
 /* USER CODE END EXPORTED_VARIABLES */
 
@@ -106,6 +114,12 @@ extern USBD_CDC_ItfTypeDef USBD_Interface_fops_FS;
 uint8_t CDC_Transmit_FS(uint8_t cdc_index, uint8_t* Buf, uint16_t Len);
 
 /* USER CODE BEGIN EXPORTED_FUNCTIONS */
+void CDC_UART_IRQHandler(uint8_t cdc_index);
+void CDC_UART_IRQ_Done(uint8_t cdc_index);
+void CDC_Apply_Settings(void);
+void CDC_Config_Load(void);
+void CDC_Config_Service(void);
+void CDC_Boot_Mark(uint8_t mark);
 
 /* USER CODE END EXPORTED_FUNCTIONS */
 
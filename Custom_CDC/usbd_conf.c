@@ -27,6 +27,7 @@
 #include "usbd_cdc.h"
 
 /* USER CODE BEGIN Includes */
+#include "usbd_cdc_if.h"
 
 /* USER CODE END Includes */
 
@@ -185,6 +186,8 @@ void HAL_PCD_ResetCallback(PCD_HandleTypeDef *hpcd)
 
   /* Reset Device. */
   USBD_LL_Reset((USBD_HandleTypeDef*)hpcd->pData);
+
+  CDC_Boot_Mark(BOOT_BUS_RESET);
 }
 
 /**
@@ -334,18 +337,18 @@ USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef *pdev)
   HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , 0x80 , PCD_SNG_BUF, 0x80);
   /* USER CODE END EndPoint_Configuration */
   /* USER CODE BEGIN EndPoint_Configuration_CDC */
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , CDC0_IN_EP , PCD_SNG_BUF, 0x80+48);
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , CDC0_OUT_EP , PCD_SNG_BUF, 0x80+96);
-
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , CDC1_IN_EP , PCD_SNG_BUF, 0x80+96+48);
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , CDC1_OUT_EP , PCD_SNG_BUF, 0x80+96+96);
-
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , CDC2_IN_EP , PCD_SNG_BUF, 0x80+96+96+48);
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , CDC2_OUT_EP , PCD_SNG_BUF, 0x80+96+96+96);
-
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , CDC0_CMD_EP , PCD_SNG_BUF, 0x80+96+96+96+8);
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , CDC1_CMD_EP , PCD_SNG_BUF, 0x80+96+96+96+16);
-  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , CDC2_CMD_EP , PCD_SNG_BUF, 0x80+96+96+96+24);
+  /* Layout from usbd_cdc.h, checked against the 512 byte PMA at compile time */
+#if (CDC_MUX != 0U)
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , CDC_MUX_IN_EP , PCD_SNG_BUF, CDC_PMA_MUX_IN);
+  HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , CDC_MUX_OUT_EP , PCD_SNG_BUF, CDC_PMA_MUX_OUT);
+#else
+  for (uint8_t i = 0; i < NUMBER_OF_CDC; i++)
+  {
+    HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , CDC_IN_EP_OF(i) , PCD_SNG_BUF, CDC_PMA_IN_OF(i));
+    HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , CDC_OUT_EP_OF(i) , PCD_SNG_BUF, CDC_PMA_OUT_OF(i));
+    HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData , CDC_CMD_EP_OF(i) , PCD_SNG_BUF, CDC_PMA_CMD_OF(i));
+  }
+#endif
 
   /* USER CODE END EndPoint_Configuration_CDC */
   return USBD_OK;
@@ -37,6 +37,23 @@
 
 /* USER CODE BEGIN INCLUDE */
 
+/* Channels built as a vendor class bulk interface instead of CDC ACM, bit n
+   for channel n. Windows binds them to WinUSB from the MS OS 2.0 descriptors,
+   which the host finds through the BOS descriptor */
+#ifndef CDC_VENDOR_CHANNELS
+#define CDC_VENDOR_CHANNELS 0x00U
+#endif
+
+/* 1 builds the multiplexed device instead: one vendor interface, all
+   channels over one bulk pair (CDC_MUX_xxx in usbd_cdc.h) */
+#ifndef CDC_MUX
+#define CDC_MUX 0U
+#endif
+
+#if ((CDC_VENDOR_CHANNELS != 0U) || (CDC_MUX != 0U))
+#define USBD_LPM_ENABLED 1U
+#endif
+
 /* USER CODE END INCLUDE */
 
 /** @addtogroup USBD_OTG_DRIVER
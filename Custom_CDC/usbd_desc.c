@@ -25,7 +25,7 @@
 #include "usbd_conf.h"
 
 /* USER CODE BEGIN INCLUDE */
-
+#include "usbd_cdc.h"
 /* USER CODE END INCLUDE */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -67,11 +67,12 @@
 #define USBD_LANGID_STRING     1033
 #define USBD_MANUFACTURER_STRING     "STMicroelectronics"
 #define USBD_PID_FS     23455
-#define USBD_PRODUCT_STRING_FS     "STM32 4 Channel USB Serial"
+#define USBD_PRODUCT_STRING_FS     "STM32 " CDC_CHANNELS_STRING " Channel USB Serial"
 #define USBD_CONFIGURATION_STRING_FS     "CDC Config"
 #define USBD_INTERFACE_STRING_FS     "CDC Interface"
 
 /* USER CODE BEGIN PRIVATE_DEFINES */
+#define USB_SIZ_BOS_DESC            0x28
 
 /* USER CODE END PRIVATE_DEFINES */
 
@@ -120,6 +121,9 @@ uint8_t * USBD_FS_ProductStrDescriptor(USBD_SpeedTypeDef speed, uint16_t *length
 uint8_t * USBD_FS_SerialStrDescriptor(USBD_SpeedTypeDef speed, uint16_t *length);
 uint8_t * USBD_FS_ConfigStrDescriptor(USBD_SpeedTypeDef speed, uint16_t *length);
 uint8_t * USBD_FS_InterfaceStrDescriptor(USBD_SpeedTypeDef speed, uint16_t *length);
+#if (USBD_LPM_ENABLED == 1U)
+uint8_t * USBD_FS_BOSDescriptor(USBD_SpeedTypeDef speed, uint16_t *length);
+#endif /* (USBD_LPM_ENABLED == 1U) */
 
 /**
   * @}
@@ -139,6 +143,9 @@ USBD_DescriptorsTypeDef FS_Desc =
 , USBD_FS_SerialStrDescriptor
 , USBD_FS_ConfigStrDescriptor
 , USBD_FS_InterfaceStrDescriptor
+#if (USBD_LPM_ENABLED == 1U)
+, USBD_FS_BOSDescriptor
+#endif /* (USBD_LPM_ENABLED == 1U) */
 };
 
 #if defined ( __ICCARM__ ) /* IAR Compiler */
@@ -149,7 +156,12 @@ __ALIGN_BEGIN uint8_t USBD_FS_DeviceDesc[USB_LEN_DEV_DESC] __ALIGN_END =
 {
   0x12,                       /*bLength */
   USB_DESC_TYPE_DEVICE,       /*bDescriptorType*/
+#if (USBD_LPM_ENABLED == 1U)
+  0x01,                       /*bcdUSB */ /* changed to USB version 2.01
+                                             in order to support BOS Desc */
+#else
   0x00,                       /*bcdUSB */
+#endif /* (USBD_LPM_ENABLED == 1U) */
   0x02,
   0xEF,                       /*bDeviceClass*/
   0x02,                       /*bDeviceSubClass*/
@@ -169,6 +181,46 @@ __ALIGN_BEGIN uint8_t USBD_FS_DeviceDesc[USB_LEN_DEV_DESC] __ALIGN_END =
 
 /* USB_DeviceDescriptor */
 
+#if (USBD_LPM_ENABLED == 1U)
+#if defined ( __ICCARM__ ) /* IAR Compiler */
+  #pragma data_alignment=4
+#endif /* defined ( __ICCARM__ ) */
+/** BOS descriptor, points Windows at the MS OS 2.0 descriptor set of the
+    vendor channels. */
+__ALIGN_BEGIN uint8_t USBD_FS_BOSDesc[USB_SIZ_BOS_DESC] __ALIGN_END =
+{
+  0x05,                       /*bLength */
+  USB_DESC_TYPE_BOS,          /*Device Descriptor Type*/
+  LOBYTE(USB_SIZ_BOS_DESC),   /*Total length of BOS descriptor and all of its sub descs */
+  HIBYTE(USB_SIZ_BOS_DESC),
+  0x02,                       /*Number of device capabilities*/
+
+  /* USB 2.0 extension */
+  0x07,                       /*bLength */
+  0x10,                       /*Device Capability Descriptor Type*/
+  0x02,                       /*USB 2.0 extension capability type*/
+  0x00,                       /*bmAttributes: no LPM */
+  0x00,
+  0x00,
+  0x00,
+
+  /* Microsoft OS 2.0 platform capability */
+  0x1C,                       /*bLength */
+  0x10,                       /*Device Capability Descriptor Type*/
+  0x05,                       /*Platform capability type*/
+  0x00,                       /*bReserved*/
+  0xDF, 0x60, 0xDD, 0xD8,     /*PlatformCapabilityUUID D8DD60DF-4589-4CC7-9CD2-659D9E648A9F*/
+  0x89, 0x45, 0xC7, 0x4C,
+  0x9C, 0xD2, 0x65, 0x9D,
+  0x9E, 0x64, 0x8A, 0x9F,
+  0x00, 0x00, 0x03, 0x06,     /*dwWindowsVersion: Windows 8.1 */
+  LOBYTE(CDC_MS_OS_20_SET_SIZE), /*wMSOSDescriptorSetTotalLength*/
+  HIBYTE(CDC_MS_OS_20_SET_SIZE),
+  CDC_MS_VENDOR_CODE,         /*bMS_VendorCode*/
+  0x00                        /*bAltEnumCode*/
+};
+#endif /* (USBD_LPM_ENABLED == 1U) */
+
 /**
   * @}
   */
@@ -227,6 +279,21 @@ uint8_t * USBD_FS_DeviceDescriptor(USBD_SpeedTypeDef speed, uint16_t *length)
   return USBD_FS_DeviceDesc;
 }
 
+#if (USBD_LPM_ENABLED == 1U)
+/**
+  * @brief  Return the BOS descriptor
+  * @param  speed : Current device speed
+  * @param  length : Pointer to data length variable
+  * @retval Pointer to descriptor buffer
+  */
+uint8_t * USBD_FS_BOSDescriptor(USBD_SpeedTypeDef speed, uint16_t *length)
+{
+  UNUSED(speed);
+  *length = sizeof(USBD_FS_BOSDesc);
+  return (uint8_t*)USBD_FS_BOSDesc;
+}
+#endif /* (USBD_LPM_ENABLED == 1U) */
+
 /**
   * @brief  Return the LangID string descriptor
   * @param  speed : Current device speed
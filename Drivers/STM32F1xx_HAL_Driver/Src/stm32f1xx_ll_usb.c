@@ -2518,6 +2518,55 @@ void USB_WritePMA(USB_TypeDef *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, ui
 
   pdwVal = (__IO uint16_t *)(BaseAddr + 0x400U + ((uint32_t)wPMABufAddr * PMA_ACCESS));
 
+#if PMA_ACCESS > 1U
+  /* Aligned user buffers: one load feeds two PMA half-words, 16 bytes per
+     turn so a full 48 or 64 byte packet needs no per-byte work. Whatever is
+     left over goes through the byte loop below */
+  if (((uint32_t)pBuf & 3U) == 0U)
+  {
+    uint32_t *pWord = (uint32_t *)pBuf;
+    uint32_t w0, w1, w2, w3;
+
+    for (i = n >> 3; i != 0U; i--)
+    {
+      w0 = pWord[0];
+      w1 = pWord[1];
+      w2 = pWord[2];
+      w3 = pWord[3];
+      pdwVal[0] = (uint16_t)w0;
+      pdwVal[2] = (uint16_t)(w0 >> 16);
+      pdwVal[4] = (uint16_t)w1;
+      pdwVal[6] = (uint16_t)(w1 >> 16);
+      pdwVal[8] = (uint16_t)w2;
+      pdwVal[10] = (uint16_t)(w2 >> 16);
+      pdwVal[12] = (uint16_t)w3;
+      pdwVal[14] = (uint16_t)(w3 >> 16);
+      pdwVal += 16U;
+      pWord += 4U;
+    }
+
+    pBuf = (uint8_t *)pWord;
+    n &= 7U;
+  }
+  else if (((uint32_t)pBuf & 1U) == 0U)
+  {
+    uint16_t *pHalf = (uint16_t *)pBuf;
+
+    for (i = n >> 2; i != 0U; i--)
+    {
+      pdwVal[0] = pHalf[0];
+      pdwVal[2] = pHalf[1];
+      pdwVal[4] = pHalf[2];
+      pdwVal[6] = pHalf[3];
+      pdwVal += 8U;
+      pHalf += 4U;
+    }
+
+    pBuf = (uint8_t *)pHalf;
+    n &= 3U;
+  }
+#endif
+
   for (i = n; i != 0U; i--)
   {
     temp1 = *pBuf;
@@ -2552,6 +2601,44 @@ void USB_ReadPMA(USB_TypeDef *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uin
 
   pdwVal = (__IO uint16_t *)(BaseAddr + 0x400U + ((uint32_t)wPMABufAddr * PMA_ACCESS));
 
+#if PMA_ACCESS > 1U
+  /* Same split as USB_WritePMA: two PMA half-words make one store */
+  if (((uint32_t)pBuf & 3U) == 0U)
+  {
+    uint32_t *pWord = (uint32_t *)pBuf;
+
+    for (i = n >> 3; i != 0U; i--)
+    {
+      pWord[0] = (uint32_t)pdwVal[0] | ((uint32_t)pdwVal[2] << 16);
+      pWord[1] = (uint32_t)pdwVal[4] | ((uint32_t)pdwVal[6] << 16);
+      pWord[2] = (uint32_t)pdwVal[8] | ((uint32_t)pdwVal[10] << 16);
+      pWord[3] = (uint32_t)pdwVal[12] | ((uint32_t)pdwVal[14] << 16);
+      pdwVal += 16U;
+      pWord += 4U;
+    }
+
+    pBuf = (uint8_t *)pWord;
+    n &= 7U;
+  }
+  else if (((uint32_t)pBuf & 1U) == 0U)
+  {
+    uint16_t *pHalf = (uint16_t *)pBuf;
+
+    for (i = n >> 2; i != 0U; i--)
+    {
+      pHalf[0] = pdwVal[0];
+      pHalf[1] = pdwVal[2];
+      pHalf[2] = pdwVal[4];
+      pHalf[3] = pdwVal[6];
+      pdwVal += 8U;
+      pHalf += 4U;
+    }
+
+    pBuf = (uint8_t *)pHalf;
+    n &= 3U;
+  }
+#endif
+
   for (i = n; i != 0U; i--)
   {
     temp = *(__IO uint16_t *)pdwVal;
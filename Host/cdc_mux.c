@@ -0,0 +1,142 @@
+/**
+  ******************************************************************************
+  * @file    cdc_mux.c
+  * @brief   Host side records of the multiplexed build, see cdc_mux.h
+  ******************************************************************************
+  */
+
+#include <string.h>
+#include "cdc_mux.h"
+
+int CDC_Mux_Parse(const uint8_t *buf, size_t len, CDC_Mux_Data_Fn on_data, CDC_Mux_State_Fn on_state, void *ctx)
+{
+  size_t pos = 0U;
+
+  while (pos < len)
+  {
+    uint8_t header;
+    size_t size;
+
+    if (((pos + CDC_MUX_HEADER_SIZE) > len) || ((pos + CDC_MUX_HEADER_SIZE + buf[pos + 1U]) > len))
+    {
+      return -1;
+    }
+
+    header = buf[pos];
+    size = buf[pos + 1U];
+
+    switch (header & CDC_MUX_TYPE_MASK)
+    {
+    case CDC_MUX_DATA:
+    case CDC_MUX_END:
+      if (((header & CDC_MUX_CHANNEL_MASK) != CDC_MUX_PAD) && (on_data != NULL))
+      {
+        on_data(ctx, header & CDC_MUX_CHANNEL_MASK, &buf[pos + CDC_MUX_HEADER_SIZE], size,
+                (header & CDC_MUX_TYPE_MASK) == CDC_MUX_END);
+      }
+      break;
+
+    case CDC_MUX_SERIAL_STATE:
+      if ((size >= 2U) && (on_state != NULL))
+      {
+        on_state(ctx, header & CDC_MUX_CHANNEL_MASK,
+                 (uint16_t)(buf[pos + 2U] | (buf[pos + 3U] << 8)));
+      }
+      break;
+
+    default:
+      /* Unknown record type, skipped */
+      break;
+    }
+
+    pos += CDC_MUX_HEADER_SIZE + size;
+  }
+
+  return 0;
+}
+
+void CDC_Mux_Out_Init(CDC_Mux_Out_TypeDef *out, uint8_t *buf, size_t size)
+{
+  out->buf = buf;
+  out->size = size - (size % CDC_MUX_PACKET_SIZE);
+  out->len = 0U;
+}
+
+/**
+  * @brief  Fill the rest of the current packet with a record for no channel
+  */
+static void CDC_Mux_Out_Pad(CDC_Mux_Out_TypeDef *out, size_t free)
+{
+  out->buf[out->len] = CDC_MUX_DATA | CDC_MUX_PAD;
+  out->buf[out->len + 1U] = (uint8_t)(free - CDC_MUX_HEADER_SIZE);
+  memset(&out->buf[out->len + CDC_MUX_HEADER_SIZE], 0, free - CDC_MUX_HEADER_SIZE);
+  out->len += free;
+}
+
+size_t CDC_Mux_Out_Put(CDC_Mux_Out_TypeDef *out, unsigned channel, const uint8_t *data, size_t len, int end)
+{
+  size_t taken = 0U;
+
+  if ((len == 0U) && (end == 0))
+  {
+    return 0U;
+  }
+
+  while (out->len < out->size)
+  {
+    size_t left = len - taken;
+    size_t free = CDC_MUX_PACKET_SIZE - (out->len % CDC_MUX_PACKET_SIZE);
+    size_t chunk;
+
+    /* A packet never ends in a single spare byte, no record fits there */
+    if ((free < (CDC_MUX_HEADER_SIZE + 1U)) && (left != 0U))
+    {
+      CDC_Mux_Out_Pad(out, free);
+      continue;
+    }
+
+    chunk = (left < (free - CDC_MUX_HEADER_SIZE)) ? left : (free - CDC_MUX_HEADER_SIZE);
+    if ((free - CDC_MUX_HEADER_SIZE - chunk) == 1U)
+    {
+      if (chunk == 0U)
+      {
+        CDC_Mux_Out_Pad(out, free);
+        continue;
+      }
+      chunk--;
+    }
+
+    out->buf[out->len] = (uint8_t)((((chunk == left) && (end != 0)) ? CDC_MUX_END : CDC_MUX_DATA) |
+                                   (channel & CDC_MUX_CHANNEL_MASK));
+    out->buf[out->len + 1U] = (uint8_t)chunk;
+    memcpy(&out->buf[out->len + CDC_MUX_HEADER_SIZE], &data[taken], chunk);
+    out->len += CDC_MUX_HEADER_SIZE + chunk;
+    taken += chunk;
+
+    if (taken == len)
+    {
+      break;
+    }
+  }
+
+  return taken;
+}
+
+size_t CDC_Mux_Out_Room(const CDC_Mux_Out_TypeDef *out)
+{
+  size_t free;
+  size_t room;
+
+  if (out->len >= out->size)
+  {
+    return 0U;
+  }
+
+  free = CDC_MUX_PACKET_SIZE - (out->len % CDC_MUX_PACKET_SIZE);
+  room = (free > CDC_MUX_HEADER_SIZE) ? (free - CDC_MUX_HEADER_SIZE) : 0U;
+  room += ((out->size - out->len - free) / CDC_MUX_PACKET_SIZE) * CDC_MUX_MAX_DATA;
+
+  /* Two bytes short: data ending one byte before the end of the last packet
+     would need a record of its own for that byte */
+  return (room > 2U) ? (room - 2U) : 0U;
+}
@@ -0,0 +1,79 @@
+/**
+  ******************************************************************************
+  * @file    cdc_mux.h
+  * @brief   Host side records of the multiplexed build (CDC_MUX in
+  *          usbd_conf.h): all channels over one vendor bulk pair.
+  *
+  *          Every 64 byte packet holds whole records: CDC_MUX_xxx | channel,
+  *          data length, data. A transfer of several packets is packed so no
+  *          record crosses a packet boundary, CDC_MUX_PAD records fill the
+  *          gaps. Class and vendor requests go to interface 0 with the
+  *          channel in the high byte of wIndex.
+  ******************************************************************************
+  */
+
+#ifndef __CDC_MUX_H
+#define __CDC_MUX_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Same values as usbd_cdc.h */
+#define CDC_MUX_IN_EP 0x81U
+#define CDC_MUX_OUT_EP 0x01U
+#define CDC_MUX_INTERFACE 0U
+#define CDC_MUX_PACKET_SIZE 64U
+#define CDC_MUX_HEADER_SIZE 2U
+#define CDC_MUX_MAX_DATA (CDC_MUX_PACKET_SIZE - CDC_MUX_HEADER_SIZE)
+#define CDC_MUX_CHANNEL_MASK 0x0FU
+#define CDC_MUX_PAD 0x0FU
+#define CDC_MUX_TYPE_MASK 0xF0U
+#define CDC_MUX_DATA 0x00U         /* data, the transfer goes on in a later record */
+#define CDC_MUX_END 0x10U          /* data ending the transfer, as a short packet would */
+#define CDC_MUX_SERIAL_STATE 0x20U /* IN only, SERIAL_STATE bitmap, 2 bytes */
+
+#define CDC_MUX_VID 0x0483U
+#define CDC_MUX_PID 0x5B9FU
+
+/* Data for a channel, end set on the record closing a device transfer */
+typedef void (*CDC_Mux_Data_Fn)(void *ctx, unsigned channel, const uint8_t *data, size_t len, int end);
+
+/* SERIAL_STATE bitmap of a channel */
+typedef void (*CDC_Mux_State_Fn)(void *ctx, unsigned channel, uint16_t serial_state);
+
+/**
+  * @brief  Split one IN transfer into its records
+  * @retval 0, -1 if a record runs past the end (the rest is skipped)
+  */
+int CDC_Mux_Parse(const uint8_t *buf, size_t len, CDC_Mux_Data_Fn on_data, CDC_Mux_State_Fn on_state, void *ctx);
+
+/* OUT transfer being packed */
+typedef struct
+{
+  uint8_t *buf;
+  size_t size; /* multiple of CDC_MUX_PACKET_SIZE */
+  size_t len;
+} CDC_Mux_Out_TypeDef;
+
+void CDC_Mux_Out_Init(CDC_Mux_Out_TypeDef *out, uint8_t *buf, size_t size);
+
+/**
+  * @brief  Append data for a channel, the last record CDC_MUX_END when end is
+  *         set and all of it fits. Bytes that do not fit are left to the next
+  *         transfer
+  * @retval bytes taken
+  */
+size_t CDC_Mux_Out_Put(CDC_Mux_Out_TypeDef *out, unsigned channel, const uint8_t *data, size_t len, int end);
+
+/* Data bytes that surely still fit in the transfer, record headers counted */
+size_t CDC_Mux_Out_Room(const CDC_Mux_Out_TypeDef *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CDC_MUX_H */
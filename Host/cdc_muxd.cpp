@@ -0,0 +1,1067 @@
+/**
+  ******************************************************************************
+  * @file    cdc_muxd.cpp
+  * @brief   Linux daemon for the multiplexed build (CDC_MUX): claims the
+  *          vendor interface, keeps several bulk transfers queued both ways
+  *          and presents every channel as a pty.
+  *
+  *          c++ -std=c++17 -O2 -o cdc_muxd cdc_muxd.cpp cdc_mux.c \
+  *              $(pkg-config --cflags --libs libusb-1.0)
+  *
+  *          cdc_muxd [-d vid:pid] [-n channels] [-l link_prefix]
+  *                   [-b channel:baud]... [-q in:out] [-s seconds]
+  *                   [-B seconds [-m message_size] [-r bytes_per_second]]
+  *
+  *          One thread, one poll() over the ptys and the libusb fds. IN
+  *          transfers go back to the endpoint from their own callback, so the
+  *          device never waits for the host to ask; their data is queued per
+  *          channel and written to its pty once per loop. OUT transfers take
+  *          whatever all ptys have, up to -q of them in flight.
+  *
+  *          -s prints the counters every so many seconds, SIGUSR1 at once,
+  *          with the TX gaps the device counted on each channel (times its
+  *          UART went idle with OUT data waiting, '-' if it does not say).
+  *          -B runs a loopback benchmark in place of the ptys: each channel
+  *          sends numbered, timestamped messages that must come back in
+  *          order, then throughput and round trip latency are printed. The
+  *          board needs TX wired to RX on every channel, the simulated device
+  *          of sim/usb_sim.c loops back by itself.
+  ******************************************************************************
+  */
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <libusb.h>
+#include "cdc_mux.h"
+
+namespace
+{
+
+constexpr unsigned Max_Channels = 3U;
+constexpr int Transfer_Size = 4096;      /* 64 packets */
+constexpr size_t Slice_Size = CDC_MUX_MAX_DATA;
+constexpr size_t Backlog_Limit = 65536U; /* per pty, further data is dropped */
+constexpr size_t Header_Size = 12U;      /* benchmark message: time, number */
+
+constexpr uint8_t Set_Line_Coding = 0x20U;
+constexpr uint8_t Set_Control_Line_State = 0x22U;
+constexpr uint8_t Get_Tx_Gaps = 0xE0U; /* CDC_VENDOR_GET_TX_GAPS */
+
+using Clock = std::chrono::steady_clock;
+
+volatile sig_atomic_t Stop_Requested = 0;
+volatile sig_atomic_t Report_Requested = 0;
+
+struct Options
+{
+  uint16_t vid = CDC_MUX_VID;
+  uint16_t pid = CDC_MUX_PID;
+  unsigned channels = Max_Channels;
+  const char *link_prefix = nullptr;
+  uint32_t baud[Max_Channels] = {0U};
+  unsigned in_flight = 4U;
+  unsigned out_flight = 2U;
+  unsigned report_period = 0U;
+  unsigned bench_seconds = 0U;
+  size_t message_size = 64U;
+  uint64_t rate = 0U; /* per channel, 0 as fast as the device takes it */
+};
+
+struct Counters
+{
+  uint64_t in_bytes = 0U; /* channel data */
+  uint64_t out_bytes = 0U;
+  uint64_t in_wire = 0U;  /* transfer bytes, record headers and padding counted */
+  uint64_t out_wire = 0U;
+  uint64_t in_transfers = 0U;
+  uint64_t out_transfers = 0U;
+  uint64_t dropped = 0U;
+  int64_t tx_gaps[Max_Channels] = {-1, -1, -1}; /* device's count, -1 when it does not say */
+};
+
+uint64_t Now_Ns()
+{
+  return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+/* Where the data of a channel comes from and goes to */
+class Channel
+{
+public:
+  virtual ~Channel() = default;
+
+  /* Polled for POLLIN and POLLOUT, -1 when Ready() alone decides */
+  virtual int Fd() const
+  {
+    return -1;
+  }
+
+  /* Data to read now, revents of Fd() */
+  virtual bool Ready(short revents) const = 0;
+
+  /* Up to max bytes for the device, a short read when no more is at hand */
+  virtual size_t Read(uint8_t *buf, size_t max) = 0;
+
+  /* Data from the device, handed on by Flush() */
+  virtual void Deliver(const uint8_t *data, size_t len) = 0;
+
+  virtual bool Write_Pending() const
+  {
+    return false;
+  }
+
+  virtual void Flush()
+  {
+  }
+};
+
+class Pty_Channel : public Channel
+{
+public:
+  explicit Pty_Channel(Counters &counters) : counters_(counters)
+  {
+  }
+
+  ~Pty_Channel() override
+  {
+    if (!link_.empty())
+    {
+      unlink(link_.c_str());
+    }
+    if (slave_ >= 0)
+    {
+      close(slave_);
+    }
+    if (master_ >= 0)
+    {
+      close(master_);
+    }
+  }
+
+  bool Open(unsigned index, const char *link_prefix)
+  {
+    char name[64];
+    struct termios tio;
+
+    master_ = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if ((master_ < 0) || (grantpt(master_) != 0) || (unlockpt(master_) != 0) ||
+        (ptsname_r(master_, name, sizeof(name)) != 0))
+    {
+      return false;
+    }
+
+    /* Kept open so the master does not hang up between clients */
+    slave_ = open(name, O_RDWR | O_NOCTTY);
+    if (slave_ < 0)
+    {
+      return false;
+    }
+
+    /* Raw by default, the data is not a terminal session */
+    tcgetattr(slave_, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave_, TCSANOW, &tio);
+
+    if (link_prefix != nullptr)
+    {
+      std::string link = std::string(link_prefix) + std::to_string(index);
+
+      unlink(link.c_str());
+      if (symlink(name, link.c_str()) != 0)
+      {
+        perror(link.c_str());
+      }
+      else
+      {
+        link_ = link;
+      }
+    }
+
+    printf("channel %u: %s\n", index, name);
+    return true;
+  }
+
+  int Fd() const override
+  {
+    return master_;
+  }
+
+  bool Ready(short revents) const override
+  {
+    return (revents & POLLIN) != 0;
+  }
+
+  size_t Read(uint8_t *buf, size_t max) override
+  {
+    ssize_t n = read(master_, buf, max);
+
+    return (n > 0) ? (size_t)n : 0U;
+  }
+
+  void Deliver(const uint8_t *data, size_t len) override
+  {
+    /* Nobody reading, dropped as a closed port would */
+    if ((backlog_.size() + len) > Backlog_Limit)
+    {
+      counters_.dropped += len;
+      return;
+    }
+    backlog_.insert(backlog_.end(), data, data + len);
+  }
+
+  bool Write_Pending() const override
+  {
+    return !backlog_.empty();
+  }
+
+  /* All records of the loop in one write */
+  void Flush() override
+  {
+    ssize_t n;
+
+    if (backlog_.empty())
+    {
+      return;
+    }
+
+    n = write(master_, backlog_.data(), backlog_.size());
+    if (n > 0)
+    {
+      backlog_.erase(backlog_.begin(), backlog_.begin() + n);
+    }
+  }
+
+private:
+  Counters &counters_;
+  int master_ = -1;
+  int slave_ = -1;
+  std::string link_;
+  std::vector<uint8_t> backlog_;
+};
+
+/* Messages: send time in ns and number, then a pattern of the number */
+class Bench_Channel : public Channel
+{
+public:
+  Bench_Channel(size_t message_size, uint64_t rate, uint64_t start_ns)
+      : size_(message_size), rate_(rate), start_ns_(start_ns), tx_(message_size), rx_(message_size)
+  {
+  }
+
+  bool Ready(short revents) const override
+  {
+    (void)revents;
+    return Due() != 0U;
+  }
+
+  size_t Read(uint8_t *buf, size_t max) override
+  {
+    size_t n = (size_t)std::min<uint64_t>(max, Due());
+
+    for (size_t k = 0U; k < n; k++)
+    {
+      if (tx_pos_ == 0U)
+      {
+        Compose();
+      }
+      buf[k] = tx_[tx_pos_];
+      tx_pos_ = (tx_pos_ + 1U) % size_;
+    }
+
+    sent_ += n;
+    return n;
+  }
+
+  void Deliver(const uint8_t *data, size_t len) override
+  {
+    received_ += len;
+    last_ns_ = Now_Ns();
+
+    for (size_t k = 0U; k < len; k++)
+    {
+      rx_[rx_pos_++] = data[k];
+      if (rx_pos_ == size_)
+      {
+        Check();
+        rx_pos_ = 0U;
+      }
+    }
+  }
+
+  void Stop_Sending()
+  {
+    sending_ = false;
+  }
+
+  bool Done() const
+  {
+    return (tx_pos_ == 0U) && (received_ >= sent_);
+  }
+
+  uint64_t Sent() const
+  {
+    return sent_;
+  }
+
+  uint64_t Received() const
+  {
+    return received_;
+  }
+
+  uint64_t Errors() const
+  {
+    return errors_;
+  }
+
+  uint64_t Last_Ns() const
+  {
+    return last_ns_;
+  }
+
+  const std::vector<uint32_t> &Latency_Us() const
+  {
+    return latency_us_;
+  }
+
+private:
+  /* Bytes to send now: what the rate allows, and a message begun is always finished */
+  uint64_t Due() const
+  {
+    uint64_t owed = (tx_pos_ != 0U) ? (size_ - tx_pos_) : 0U;
+    uint64_t allowed = 0U;
+
+    if (sending_)
+    {
+      allowed = (rate_ == 0U) ? UINT64_MAX : ((Now_Ns() - start_ns_) * rate_ / 1000000000U);
+      allowed = (allowed > sent_) ? (allowed - sent_) : 0U;
+    }
+    return std::max(owed, allowed);
+  }
+
+  static uint8_t Pattern(uint32_t number, size_t k)
+  {
+    return (uint8_t)(number * 7U + k);
+  }
+
+  void Compose()
+  {
+    uint64_t now = Now_Ns();
+
+    memcpy(&tx_[0], &now, sizeof(now));
+    memcpy(&tx_[8], &tx_number_, sizeof(tx_number_));
+    for (size_t k = Header_Size; k < size_; k++)
+    {
+      tx_[k] = Pattern(tx_number_, k);
+    }
+    tx_number_++;
+  }
+
+  void Check()
+  {
+    uint64_t sent_ns;
+    uint32_t number;
+    bool intact = true;
+
+    memcpy(&sent_ns, &rx_[0], sizeof(sent_ns));
+    memcpy(&number, &rx_[8], sizeof(number));
+    for (size_t k = Header_Size; k < size_; k++)
+    {
+      intact = intact && (rx_[k] == Pattern(number, k));
+    }
+
+    if (!intact || (number != rx_number_))
+    {
+      errors_++;
+    }
+    rx_number_ = number + 1U;
+
+    if (intact)
+    {
+      latency_us_.push_back((uint32_t)((last_ns_ - sent_ns) / 1000U));
+    }
+  }
+
+  size_t size_;
+  uint64_t rate_;
+  uint64_t start_ns_;
+  bool sending_ = true;
+  std::vector<uint8_t> tx_;
+  size_t tx_pos_ = 0U;
+  uint32_t tx_number_ = 0U;
+  uint64_t sent_ = 0U;
+  std::vector<uint8_t> rx_;
+  size_t rx_pos_ = 0U;
+  uint32_t rx_number_ = 0U;
+  uint64_t received_ = 0U;
+  uint64_t errors_ = 0U;
+  uint64_t last_ns_ = 0U;
+  std::vector<uint32_t> latency_us_;
+};
+
+class Mux_Link
+{
+public:
+  Mux_Link(std::vector<std::unique_ptr<Channel>> &channels, Counters &counters)
+      : channels_(channels), counters_(counters)
+  {
+  }
+
+  ~Mux_Link()
+  {
+    Cancel_All();
+    for (libusb_transfer *transfer : transfers_)
+    {
+      libusb_free_transfer(transfer);
+    }
+    if (handle_ != nullptr)
+    {
+      libusb_release_interface(handle_, CDC_MUX_INTERFACE);
+      libusb_close(handle_);
+    }
+    if (ctx_ != nullptr)
+    {
+      libusb_exit(ctx_);
+    }
+  }
+
+  bool Open(uint16_t vid, uint16_t pid)
+  {
+    int ret;
+
+    if ((libusb_init(&ctx_) != 0) || ((handle_ = libusb_open_device_with_vid_pid(ctx_, vid, pid)) == nullptr))
+    {
+      fprintf(stderr, "device %04x:%04x not found\n", vid, pid);
+      return false;
+    }
+
+    ret = libusb_claim_interface(handle_, CDC_MUX_INTERFACE);
+    if (ret != 0)
+    {
+      fprintf(stderr, "claim interface: %s\n", libusb_error_name(ret));
+      return false;
+    }
+    return true;
+  }
+
+  int Control_Out(unsigned channel, uint8_t request, uint16_t value, uint8_t *data, uint16_t len)
+  {
+    return libusb_control_transfer(handle_,
+                                   LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+                                   request, value, (uint16_t)((channel << 8) | CDC_MUX_INTERFACE), data, len, 1000);
+  }
+
+  int Control_In(unsigned channel, uint8_t request, uint8_t *data, uint16_t len)
+  {
+    return libusb_control_transfer(handle_,
+                                   LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE,
+                                   request, 0U, (uint16_t)((channel << 8) | CDC_MUX_INTERFACE), data, len, 1000);
+  }
+
+  /* Times each UART went idle with OUT data waiting in the device, firmware
+     without the request stalls it */
+  void Read_Tx_Gaps()
+  {
+    for (unsigned i = 0U; i < channels_.size(); i++)
+    {
+      uint8_t count[4];
+
+      counters_.tx_gaps[i] = -1;
+      if (Control_In(i, Get_Tx_Gaps, count, sizeof(count)) == (int)sizeof(count))
+      {
+        counters_.tx_gaps[i] = (int64_t)((uint32_t)count[0] | ((uint32_t)count[1] << 8) |
+                                         ((uint32_t)count[2] << 16) | ((uint32_t)count[3] << 24));
+      }
+    }
+  }
+
+  /* All IN transfers to the endpoint, the OUT ones to the free list */
+  bool Start(unsigned in_count, unsigned out_count)
+  {
+    buffers_.resize(in_count + out_count);
+
+    for (unsigned i = 0U; i < (in_count + out_count); i++)
+    {
+      libusb_transfer *transfer = libusb_alloc_transfer(0);
+
+      if (transfer == nullptr)
+      {
+        return false;
+      }
+      transfers_.push_back(transfer);
+      buffers_[i].resize(Transfer_Size);
+
+      if (i < in_count)
+      {
+        libusb_fill_bulk_transfer(transfer, handle_, CDC_MUX_IN_EP, buffers_[i].data(), Transfer_Size, In_Done,
+                                  this, 0U);
+        if (libusb_submit_transfer(transfer) != 0)
+        {
+          return false;
+        }
+        busy_++;
+      }
+      else
+      {
+        libusb_fill_bulk_transfer(transfer, handle_, CDC_MUX_OUT_EP, buffers_[i].data(), Transfer_Size, Out_Done,
+                                  this, 0U);
+        out_free_.push_back(transfer);
+      }
+    }
+    return true;
+  }
+
+  /* A free OUT transfer, nullptr when all are in flight */
+  libusb_transfer *Out_Acquire()
+  {
+    libusb_transfer *transfer;
+
+    if (out_free_.empty() || stopping_)
+    {
+      return nullptr;
+    }
+    transfer = out_free_.back();
+    out_free_.pop_back();
+    return transfer;
+  }
+
+  void Out_Release(libusb_transfer *transfer)
+  {
+    out_free_.push_back(transfer);
+  }
+
+  void Out_Submit(libusb_transfer *transfer, size_t len)
+  {
+    int ret;
+
+    transfer->length = (int)len;
+    ret = libusb_submit_transfer(transfer);
+    if (ret != 0)
+    {
+      fprintf(stderr, "OUT: %s\n", libusb_error_name(ret));
+      failed_ = true;
+      out_free_.push_back(transfer);
+      return;
+    }
+    busy_++;
+  }
+
+  bool Out_Available() const
+  {
+    return !out_free_.empty();
+  }
+
+  bool Failed() const
+  {
+    return failed_;
+  }
+
+  libusb_context *Context() const
+  {
+    return ctx_;
+  }
+
+  /* Cancels what is in flight and waits for the callbacks */
+  void Cancel_All()
+  {
+    struct timeval tv = {0, 100000};
+
+    stopping_ = true;
+    for (libusb_transfer *transfer : transfers_)
+    {
+      libusb_cancel_transfer(transfer);
+    }
+    for (int i = 0; (i < 20) && (busy_ != 0U); i++)
+    {
+      libusb_handle_events_timeout_completed(ctx_, &tv, nullptr);
+    }
+  }
+
+private:
+  static void LIBUSB_CALL In_Done(libusb_transfer *transfer)
+  {
+    Mux_Link *link = static_cast<Mux_Link *>(transfer->user_data);
+
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+    {
+      link->counters_.in_transfers++;
+      link->counters_.in_wire += (uint64_t)transfer->actual_length;
+      CDC_Mux_Parse(transfer->buffer, (size_t)transfer->actual_length, On_Data, On_State, link);
+
+      /* Straight back, the endpoint is never without a transfer */
+      if (!link->stopping_)
+      {
+        int ret = libusb_submit_transfer(transfer);
+
+        if (ret == 0)
+        {
+          return;
+        }
+        fprintf(stderr, "IN: %s\n", libusb_error_name(ret));
+        link->failed_ = true;
+      }
+    }
+    else if (transfer->status != LIBUSB_TRANSFER_CANCELLED)
+    {
+      fprintf(stderr, "IN: transfer status %d\n", (int)transfer->status);
+      link->failed_ = true;
+    }
+    link->busy_--;
+  }
+
+  static void LIBUSB_CALL Out_Done(libusb_transfer *transfer)
+  {
+    Mux_Link *link = static_cast<Mux_Link *>(transfer->user_data);
+
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+    {
+      link->counters_.out_transfers++;
+      link->counters_.out_wire += (uint64_t)transfer->actual_length;
+    }
+    else if (transfer->status != LIBUSB_TRANSFER_CANCELLED)
+    {
+      fprintf(stderr, "OUT: transfer status %d\n", (int)transfer->status);
+      link->failed_ = true;
+    }
+    link->out_free_.push_back(transfer);
+    link->busy_--;
+  }
+
+  static void On_Data(void *ctx, unsigned channel, const uint8_t *data, size_t len, int end)
+  {
+    Mux_Link *link = static_cast<Mux_Link *>(ctx);
+    (void)end;
+
+    if (channel < link->channels_.size())
+    {
+      link->counters_.in_bytes += len;
+      link->channels_[channel]->Deliver(data, len);
+    }
+  }
+
+  /* A pty has no modem lines to show it on */
+  static void On_State(void *ctx, unsigned channel, uint16_t serial_state)
+  {
+    (void)ctx;
+    (void)channel;
+    (void)serial_state;
+  }
+
+  std::vector<std::unique_ptr<Channel>> &channels_;
+  Counters &counters_;
+  libusb_context *ctx_ = nullptr;
+  libusb_device_handle *handle_ = nullptr;
+  std::vector<libusb_transfer *> transfers_;
+  std::vector<std::vector<uint8_t>> buffers_;
+  std::vector<libusb_transfer *> out_free_;
+  unsigned busy_ = 0U; /* transfers in flight */
+  bool stopping_ = false;
+  bool failed_ = false;
+};
+
+/* Rates since the last report, transfers with their average size, then
+   the device's TX gap count of each channel */
+void Report(const Counters &now, Counters &last, size_t channels, double seconds, double interval)
+{
+  double in_transfers = (double)(now.in_transfers - last.in_transfers);
+  double out_transfers = (double)(now.out_transfers - last.out_transfers);
+  double in_size = (in_transfers != 0.0) ? ((double)(now.in_wire - last.in_wire) / in_transfers) : 0.0;
+  double out_size = (out_transfers != 0.0) ? ((double)(now.out_wire - last.out_wire) / out_transfers) : 0.0;
+
+  printf("%7.1f s  in %9.0f B/s  out %9.0f B/s  IN %6.0f/s %5.0f B  OUT %6.0f/s %5.0f B  dropped %llu\n", seconds,
+         (double)(now.in_bytes - last.in_bytes) / interval, (double)(now.out_bytes - last.out_bytes) / interval,
+         in_transfers / interval, in_size, out_transfers / interval, out_size, (unsigned long long)now.dropped);
+  printf("%7s    tx gaps", "");
+  for (size_t i = 0U; i < channels; i++)
+  {
+    if (now.tx_gaps[i] < 0)
+    {
+      printf(" -");
+    }
+    else
+    {
+      printf(" %lld", (long long)now.tx_gaps[i]);
+    }
+  }
+  printf("\n");
+  fflush(stdout);
+  last = now;
+}
+
+void Bench_Report(const std::vector<std::unique_ptr<Channel>> &channels, const Counters &counters,
+                  uint64_t start_ns)
+{
+  std::vector<uint32_t> latency;
+  uint64_t total = 0U;
+  uint64_t end_ns = start_ns;
+
+  for (size_t i = 0U; i < channels.size(); i++)
+  {
+    const Bench_Channel *ch = static_cast<const Bench_Channel *>(channels[i].get());
+    double seconds = (double)(ch->Last_Ns() - start_ns) / 1e9;
+
+    printf("channel %zu: sent %llu B, back %llu B, %.0f B/s, %llu bad messages, tx gaps %lld\n", i,
+           (unsigned long long)ch->Sent(), (unsigned long long)ch->Received(),
+           (seconds > 0.0) ? ((double)ch->Received() / seconds) : 0.0, (unsigned long long)ch->Errors(),
+           (long long)counters.tx_gaps[i]);
+    latency.insert(latency.end(), ch->Latency_Us().begin(), ch->Latency_Us().end());
+    total += ch->Received();
+    end_ns = std::max(end_ns, ch->Last_Ns());
+  }
+
+  if (end_ns > start_ns)
+  {
+    printf("all: %.0f B/s, wire use IN %.1f%% OUT %.1f%%\n", (double)total * 1e9 / (double)(end_ns - start_ns),
+           (counters.in_wire != 0U) ? (100.0 * (double)counters.in_bytes / (double)counters.in_wire) : 0.0,
+           (counters.out_wire != 0U) ? (100.0 * (double)counters.out_bytes / (double)counters.out_wire) : 0.0);
+  }
+
+  if (!latency.empty())
+  {
+    uint64_t sum = 0U;
+
+    std::sort(latency.begin(), latency.end());
+    for (uint32_t us : latency)
+    {
+      sum += us;
+    }
+    printf("latency us: min %u avg %llu p50 %u p90 %u p99 %u max %u (%zu messages)\n", latency.front(),
+           (unsigned long long)(sum / latency.size()), latency[latency.size() / 2U],
+           latency[latency.size() * 9U / 10U], latency[latency.size() * 99U / 100U], latency.back(), latency.size());
+  }
+}
+
+/* Fills the free OUT transfers, the channels taking turns a slice at a
+   time: the device NAKs the whole pipe while one channel has no room, so no
+   channel's data gets far ahead of the others'. A channel's records stay
+   CDC_MUX_DATA while it has more, the record after its last read ends them */
+void Pack(Mux_Link &link, std::vector<std::unique_ptr<Channel>> &channels, std::vector<bool> &ready,
+          std::vector<bool> &open, Counters &counters, unsigned &first)
+{
+  libusb_transfer *transfer;
+  uint8_t chunk[Slice_Size];
+
+  while ((transfer = link.Out_Acquire()) != nullptr)
+  {
+    CDC_Mux_Out_TypeDef out;
+    bool more = true;
+
+    CDC_Mux_Out_Init(&out, transfer->buffer, Transfer_Size);
+
+    while (more && (CDC_Mux_Out_Room(&out) != 0U))
+    {
+      more = false;
+      for (size_t k = 0U; k < channels.size(); k++)
+      {
+        size_t i = (first + k) % channels.size();
+        size_t ask = std::min(CDC_Mux_Out_Room(&out), Slice_Size);
+        size_t len;
+
+        if (!ready[i] || (ask == 0U))
+        {
+          continue;
+        }
+
+        len = channels[i]->Read(chunk, ask);
+        ready[i] = (len == ask);
+        if ((len != 0U) || open[i])
+        {
+          CDC_Mux_Out_Put(&out, (unsigned)i, chunk, len, ready[i] ? 0 : 1);
+          open[i] = ready[i];
+          counters.out_bytes += len;
+        }
+        more = more || ready[i];
+      }
+    }
+    first = (first + 1U) % (unsigned)channels.size();
+
+    if (out.len == 0U)
+    {
+      link.Out_Release(transfer);
+      break;
+    }
+    link.Out_Submit(transfer, out.len);
+  }
+}
+
+int Run(Mux_Link &link, std::vector<std::unique_ptr<Channel>> &channels, Counters &counters, const Options &opt)
+{
+  const libusb_pollfd **usb_fds = libusb_get_pollfds(link.Context());
+  std::vector<pollfd> fds;
+  std::vector<int> fd_of(channels.size());
+  std::vector<bool> ready(channels.size());
+  std::vector<bool> open(channels.size());
+  Counters last;
+  uint64_t start_ns = Now_Ns();
+  uint64_t last_report_ns = start_ns;
+  uint64_t stop_sending_ns = start_ns + (uint64_t)opt.bench_seconds * 1000000000U;
+  uint64_t drain_ns = stop_sending_ns + 3000000000U;
+  unsigned first = 0U;
+  bool bench = (opt.bench_seconds != 0U);
+  bool sending = bench;
+
+  if (usb_fds == nullptr)
+  {
+    fprintf(stderr, "libusb has no pollable fds\n");
+    return 1;
+  }
+
+  while ((Stop_Requested == 0) && !link.Failed())
+  {
+    struct timeval zero = {0, 0};
+    uint64_t now;
+
+    fds.clear();
+    for (size_t i = 0U; i < channels.size(); i++)
+    {
+      int fd = channels[i]->Fd();
+
+      fd_of[i] = -1;
+      if (fd >= 0)
+      {
+        fd_of[i] = (int)fds.size();
+        fds.push_back({fd,
+                       (short)((link.Out_Available() ? POLLIN : 0) | (channels[i]->Write_Pending() ? POLLOUT : 0)),
+                       0});
+      }
+    }
+    for (size_t i = 0U; usb_fds[i] != nullptr; i++)
+    {
+      fds.push_back({usb_fds[i]->fd, usb_fds[i]->events, 0});
+    }
+
+    /* The benchmark paces itself by the clock */
+    if ((poll(fds.data(), fds.size(), bench ? 1 : 200) < 0) && (errno != EINTR))
+    {
+      perror("poll");
+      break;
+    }
+
+    libusb_handle_events_timeout_completed(link.Context(), &zero, nullptr);
+
+    for (size_t i = 0U; i < channels.size(); i++)
+    {
+      ready[i] = open[i] || channels[i]->Ready((fd_of[i] >= 0) ? fds[(size_t)fd_of[i]].revents : 0);
+    }
+    Pack(link, channels, ready, open, counters, first);
+
+    for (auto &ch : channels)
+    {
+      ch->Flush();
+    }
+
+    now = Now_Ns();
+    if ((Report_Requested != 0) ||
+        ((opt.report_period != 0U) && ((now - last_report_ns) >= (uint64_t)opt.report_period * 1000000000U)))
+    {
+      Report_Requested = 0;
+      link.Read_Tx_Gaps();
+      Report(counters, last, channels.size(), (double)(now - start_ns) / 1e9, (double)(now - last_report_ns) / 1e9);
+      last_report_ns = now;
+    }
+
+    if (bench)
+    {
+      bool done = true;
+
+      if (sending && (now >= stop_sending_ns))
+      {
+        sending = false;
+        for (auto &ch : channels)
+        {
+          static_cast<Bench_Channel *>(ch.get())->Stop_Sending();
+        }
+      }
+      for (auto &ch : channels)
+      {
+        done = done && static_cast<Bench_Channel *>(ch.get())->Done();
+      }
+      if ((!sending && done) || (now >= drain_ns))
+      {
+        break;
+      }
+    }
+  }
+
+  libusb_free_pollfds(usb_fds);
+
+  if (bench)
+  {
+    link.Read_Tx_Gaps();
+    Bench_Report(channels, counters, start_ns);
+  }
+  return link.Failed() ? 1 : 0;
+}
+
+int Parse_Args(int argc, char **argv, Options &opt)
+{
+  int opt_char;
+  unsigned a;
+  unsigned b;
+
+  while ((opt_char = getopt(argc, argv, "d:n:l:b:q:s:B:m:r:")) != -1)
+  {
+    switch (opt_char)
+    {
+    case 'd':
+      if (sscanf(optarg, "%x:%x", &a, &b) != 2)
+      {
+        return -1;
+      }
+      opt.vid = (uint16_t)a;
+      opt.pid = (uint16_t)b;
+      break;
+    case 'n':
+      opt.channels = (unsigned)strtoul(optarg, nullptr, 0);
+      if ((opt.channels == 0U) || (opt.channels > Max_Channels))
+      {
+        return -1;
+      }
+      break;
+    case 'l':
+      opt.link_prefix = optarg;
+      break;
+    case 'b':
+      if ((sscanf(optarg, "%u:%u", &a, &b) != 2) || (a >= Max_Channels))
+      {
+        return -1;
+      }
+      opt.baud[a] = b;
+      break;
+    case 'q':
+      if ((sscanf(optarg, "%u:%u", &a, &b) != 2) || (a == 0U) || (b == 0U))
+      {
+        return -1;
+      }
+      opt.in_flight = a;
+      opt.out_flight = b;
+      break;
+    case 's':
+      opt.report_period = (unsigned)strtoul(optarg, nullptr, 0);
+      break;
+    case 'B':
+      opt.bench_seconds = (unsigned)strtoul(optarg, nullptr, 0);
+      break;
+    case 'm':
+      opt.message_size = strtoul(optarg, nullptr, 0);
+      if (opt.message_size < Header_Size)
+      {
+        return -1;
+      }
+      break;
+    case 'r':
+      opt.rate = strtoull(optarg, nullptr, 0);
+      break;
+    default:
+      return -1;
+    }
+  }
+
+  /* -n may come after -b, the channels are only known now */
+  for (a = opt.channels; a < Max_Channels; a++)
+  {
+    if (opt.baud[a] != 0U)
+    {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void On_Signal(int sig)
+{
+  if (sig == SIGUSR1)
+  {
+    Report_Requested = 1;
+  }
+  else
+  {
+    Stop_Requested = 1;
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+  Options opt;
+  Counters counters;
+  std::vector<std::unique_ptr<Channel>> channels;
+  struct sigaction sa = {};
+  int ret;
+
+  if (Parse_Args(argc, argv, opt) != 0)
+  {
+    fprintf(stderr,
+            "usage: %s [-d vid:pid] [-n channels] [-l link_prefix] [-b channel:baud]... [-q in:out]\n"
+            "          [-s seconds] [-B seconds [-m message_size] [-r bytes_per_second]]\n",
+            argv[0]);
+    return 2;
+  }
+
+  sa.sa_handler = On_Signal;
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+  sigaction(SIGUSR1, &sa, nullptr);
+
+  {
+    Mux_Link link(channels, counters);
+
+    if (!link.Open(opt.vid, opt.pid))
+    {
+      return 1;
+    }
+
+    for (unsigned i = 0U; i < opt.channels; i++)
+    {
+      if (opt.bench_seconds != 0U)
+      {
+        channels.push_back(std::make_unique<Bench_Channel>(opt.message_size, opt.rate, Now_Ns()));
+      }
+      else
+      {
+        auto pty = std::make_unique<Pty_Channel>(counters);
+
+        if (!pty->Open(i, opt.link_prefix))
+        {
+          perror("pty");
+          return 1;
+        }
+        channels.push_back(std::move(pty));
+      }
+
+      if (opt.baud[i] != 0U)
+      {
+        uint8_t coding[7] = {(uint8_t)opt.baud[i], (uint8_t)(opt.baud[i] >> 8), (uint8_t)(opt.baud[i] >> 16),
+                             (uint8_t)(opt.baud[i] >> 24), 0U, 0U, 8U};
+
+        link.Control_Out(i, Set_Line_Coding, 0U, coding, sizeof(coding));
+      }
+
+      /* DTR and RTS up, channels gated on DTR pass data */
+      link.Control_Out(i, Set_Control_Line_State, 0x03U, nullptr, 0U);
+    }
+    fflush(stdout);
+
+    if (!link.Start(opt.in_flight, opt.out_flight))
+    {
+      fprintf(stderr, "cannot queue transfers\n");
+      return 1;
+    }
+
+    ret = Run(link, channels, counters, opt);
+  }
+
+  return ret;
+}
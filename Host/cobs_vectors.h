@@ -0,0 +1,53 @@
+/**
+  ******************************************************************************
+  * @file    cobs_vectors.h
+  * @brief   COBS test vectors of packet mode (CDC_VENDOR_SET_PACKET): a
+  *          packet and its encoding on the UART, without the 0x00 delimiter.
+  *          Bytes in hex, "a..b" for the bytes a to b in order.
+  *
+  *          The first eleven are the usual examples of the encoding, the rest
+  *          hit the block edges: a zero right after a full 254 byte block,
+  *          packets ending on one, and packets the IN side sends in more than
+  *          one transfer or closes with a ZLP. cdc_bench -c runs every vector
+  *          through the firmware both ways.
+  ******************************************************************************
+  */
+
+#ifndef COBS_VECTORS_H
+#define COBS_VECTORS_H
+
+typedef struct
+{
+  const char *packet;
+  const char *encoded;
+} Cobs_Vector_TypeDef;
+
+static const Cobs_Vector_TypeDef Cobs_Vectors[] = {
+    {"00", "01 01"},
+    {"00 00", "01 01 01"},
+    {"00 11 00", "01 02 11 01"},
+    {"11 22 00 33", "03 11 22 02 33"},
+    {"11 22 33 44", "05 11 22 33 44"},
+    {"11 00 00 00", "02 11 01 01 01"},
+    {"01..FE", "FF 01..FE"},
+    {"00 01..FE", "01 FF 01..FE"},
+    {"01..FF", "FF 01..FE 02 FF"},
+    {"02..FF 00", "FF 02..FF 01 01"},
+    {"03..FF 00 01", "FE 03..FF 02 01"},
+
+    /* Zero after a full block: the block has no zero of its own */
+    {"01..FE 00 07", "FF 01..FE 01 02 07"},
+    {"01..FE 00", "FF 01..FE 01 01"},
+    {"01..FE 00 00 07", "FF 01..FE 01 01 02 07"},
+    {"00 01..FE 00", "01 FF 01..FE 01 01"},
+
+    /* Two full blocks, 508 bytes: more than one IN transfer */
+    {"01..FE 01..FE", "FF 01..FE FF 01..FE"},
+    {"01..FE 01..FE 00", "FF 01..FE FF 01..FE 01 01"},
+
+    /* Two OUT packets exactly, then ten IN packets exactly (a ZLP ends both) */
+    {"01..80", "81 01..80"},
+    {"01..F0 01..F0", "FF 01..F0 01..0E E3 0F..F0"},
+};
+
+#endif /* COBS_VECTORS_H */
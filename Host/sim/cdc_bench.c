@@ -0,0 +1,1482 @@
+/**
+  ******************************************************************************
+  * @file    cdc_bench.c
+  * @brief   Per-channel build (CDC_MUX off) on the host: the firmware's own
+  *          usbd_cdc_if.c and usbd_cdc.c over emulated UARTs, DMA channels
+  *          and a full speed bus, in simulated time. Measures both directions
+  *          of every channel without a board.
+  *
+  *          FW="-I../Core/Inc -I../Custom_CDC -I../Custom_CDC/Class/CDC/Inc \
+  *              -I../Custom_CDC/Core/Inc -I../Drivers/CMSIS/Include \
+  *              -I../Drivers/CMSIS/Device/ST/STM32F1xx/Include \
+  *              -I../Drivers/STM32F1xx_HAL_Driver/Inc \
+  *              -DSTM32F103xB -DUSE_HAL_DRIVER -DCDC_VENDOR_CHANNELS=0x7U"
+  *          cc -O2 -no-pie -o cdc_bench $FW sim/cdc_bench.c \
+  *             ../Custom_CDC/usbd_cdc_if.c ../Custom_CDC/Class/CDC/Src/usbd_cdc.c
+  *
+  *          cdc_bench [-n channels] [-b baud] [-t seconds] [-g burst:gap_us]
+  *                    [-w out_percent] [-l latency_ms] [-u urb_size]
+  *                    [-p from_ms:for_ms] [-i irq_ns] [-x every] [-c]
+  *
+  *          The far end of each UART sends a pseudo random stream at the line
+  *          coding, continuously or in bursts (-g), and the host reads it as
+  *          cdc_acm does: URBs of two packets (-u) that complete when full or
+  *          on a short packet. -p stops the host reading for a while. -w has
+  *          the host write to every channel at a share of the line rate. -l
+  *          needs the channels built as vendor channels, as above, and so
+  *          does -x: XON/XOFF flow control, with an XON from the far end
+  *          every so many characters for the bridge to filter out. Interrupts
+  *          are taken -i ns after they are raised, one at a time.
+  *
+  *          -c runs the COBS vectors of ../cobs_vectors.h through channel 0
+  *          in packet mode instead: the far end sends every encoding, the host
+  *          must read every packet as one transfer, and the host writes every
+  *          packet, the UART must send its encoding. Exits 1 on a mismatch.
+  *
+  *          Every byte the host gets is checked against what was sent: data
+  *          the bridge drops shows as a jump ahead, data from the wrong place
+  *          in the stream as corrupt. The UART output is checked against what
+  *          the host wrote.
+  *
+  *          The peripherals are plain memory mapped at their own addresses,
+  *          -no-pie keeps the firmware's buffers below 4G for the DMA
+  *          addresses it passes as uint32_t. The HAL calls the firmware makes
+  *          are emulated here.
+  ******************************************************************************
+  */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "main.h"
+#include "usart.h"
+#include "tim.h"
+#include "usbd_cdc.h"
+#include "usbd_cdc_if.h"
+#include "usbd_ctlreq.h"
+#include "../cobs_vectors.h"
+
+#define SIM_PERIPH_SIZE 0x24000U          /* APB1, APB2 and the DMA on AHB */
+#define SIM_FLASH_BASE 0x0800F000U        /* last 4K, the config pages */
+#define SIM_FLASH_SIZE 0x1000U
+#define SIM_SLOTS_PER_FRAME 19U           /* full speed bulk packets in 1 ms */
+#define SIM_SLOT_NS (1000000U / SIM_SLOTS_PER_FRAME)
+#define SIM_OUT_WINDOW 4096U              /* host bytes queued per channel, like a tty buffer */
+#define SIM_MATCH 8U                      /* bytes that place a jump in the sent stream */
+#define SIM_LATENCY_BIN_US 50U
+#define SIM_LATENCY_BINS 2000U
+#define SIM_SR_RC_W0 (USART_SR_TC | USART_SR_RXNE) /* the only SR bits software clears by writing */
+#define SIM_NEVER UINT64_MAX
+#define SIM_COBS_VECTORS (sizeof(Cobs_Vectors) / sizeof(Cobs_Vectors[0]))
+#define SIM_COBS_MAX 1024U                /* bytes of a vector */
+
+enum
+{
+  IRQ_DMA_RX,
+  IRQ_DMA_TX = IRQ_DMA_RX + NUMBER_OF_CDC,
+  IRQ_TIM2 = IRQ_DMA_TX + NUMBER_OF_CDC,
+  IRQ_TIM4,
+  IRQ_UART,
+  IRQ_COUNT = IRQ_UART + NUMBER_OF_CDC
+};
+
+typedef struct
+{
+  uint32_t sr;            /* USART status, the register only holds it while the firmware runs */
+
+  /* Far end to RX pin, into the circular RX DMA */
+  uint64_t rx_next_ns;    /* next character complete */
+  uint64_t rx_idle_ns;    /* IDLE raised then if nothing else comes */
+  uint32_t rx_burst_left;
+  uint32_t rx_seed;
+  uint32_t rx_since_xon;
+  uint8_t rx_half;        /* DMA half and full transfer flags */
+  uint8_t rx_full;
+  uint8_t *sent;          /* every byte sent, and when it was complete */
+  uint32_t *sent_us;
+  size_t sent_len;
+  size_t sent_cap;
+  unsigned long overrun;  /* characters lost with the RX DMA stopped */
+
+  /* TX pin, fed by the TX DMA or a single interrupt driven byte */
+  const uint8_t *tx_src;
+  uint32_t tx_left;
+  uint8_t tx_dma_done;
+  uint8_t tx_it_byte;
+  uint8_t tx_it_pending;
+  uint8_t dr_full;
+  uint8_t dr;
+  uint8_t shift_busy;
+  uint8_t shift;
+  uint64_t shift_end_ns;
+  uint64_t idle_since_ns; /* line idle with host data outstanding, 0 if not */
+  unsigned long tx_bytes;
+  unsigned long tx_bad;
+  unsigned long gaps;
+  uint64_t gap_ns;
+  uint32_t tx_seed;
+
+  /* IN endpoint, packets copied to the PMA one at a time as the HAL does */
+  const uint8_t *in_buf;
+  uint32_t in_len;
+  uint32_t in_pos;
+  uint8_t in_busy;
+  uint8_t pma[CDC_DATA_FS_IN_PACKET_SIZE];
+  uint32_t pma_len;
+  uint8_t notify_busy;
+
+  /* OUT endpoint */
+  uint8_t *out_buf;
+  uint8_t out_armed;
+  uint32_t out_len;
+
+  /* Host */
+  uint32_t urb_fill;
+  size_t urb_start;       /* sent position of the first byte of the URB */
+  unsigned long urbs;
+  unsigned long in_transfers;
+  unsigned long in_packets;
+  unsigned long short_packets;
+  unsigned long zlps;
+  unsigned long notifications;
+  size_t pos;             /* next byte of sent expected */
+  unsigned long rx_bytes;
+  unsigned long dropped;
+  unsigned long jumps;
+  unsigned long corrupt;
+  unsigned long latency[SIM_LATENCY_BINS];
+  unsigned long latency_count;
+  uint32_t out_backlog;   /* written by the host, not yet on the bus */
+  uint32_t out_seed;
+  uint64_t out_credit;    /* host write rate left over, in bytes * 1000 * 100 */
+  unsigned long out_bytes;
+} Sim_Channel_TypeDef;
+
+typedef struct
+{
+  unsigned channels;
+  uint32_t baud;
+  unsigned seconds;
+  uint32_t burst;
+  uint32_t gap_us;
+  unsigned out_percent;
+  int latency_ms;
+  uint32_t urb_size;
+  uint64_t pause_from_ns;
+  uint64_t pause_to_ns;
+  uint32_t irq_ns;
+  uint32_t xon_every;
+  uint8_t cobs;
+} Sim_Options_TypeDef;
+
+/* -c, on channel 0 */
+typedef struct
+{
+  uint8_t packet[SIM_COBS_VECTORS][SIM_COBS_MAX];
+  size_t packet_len[SIM_COBS_VECTORS];
+  uint8_t line[SIM_COBS_VECTORS * SIM_COBS_MAX]; /* every encoding and its delimiter */
+  size_t line_len;
+  size_t rx_pos;          /* far end's next line byte */
+  size_t tx_pos;          /* line byte the UART must send next */
+  unsigned long tx_bad;
+  unsigned out_vector;    /* host writing it */
+  size_t out_pos;
+  uint8_t out_zlp;        /* transfer ended on a full packet */
+  unsigned in_vector;     /* host reading it */
+  size_t in_len;
+  uint8_t in[SIM_COBS_MAX];
+  unsigned in_bad;
+} Sim_Cobs_TypeDef;
+
+UART_HandleTypeDef huart1;
+UART_HandleTypeDef huart2;
+UART_HandleTypeDef huart3;
+TIM_HandleTypeDef htim4;
+USBD_HandleTypeDef hUsbDeviceFS;
+
+static DMA_HandleTypeDef Dma_Rx[NUMBER_OF_CDC];
+static DMA_HandleTypeDef Dma_Tx[NUMBER_OF_CDC];
+static PCD_HandleTypeDef Pcd;
+static Sim_Channel_TypeDef Ch[NUMBER_OF_CDC];
+static Sim_Options_TypeDef Opt = {NUMBER_OF_CDC, 115200U, 2U, 0U, 0U, 0U, -1,
+                                  2U * CDC_DATA_FS_IN_PACKET_SIZE, 0U, 0U, 1500U, 0U, 0U};
+static Sim_Cobs_TypeDef Cobs;
+static uint64_t Now_Ns;
+static uint64_t Irq_Due[IRQ_COUNT];
+static uint64_t Cpu_Free_Ns;
+static uint64_t Timeout_Ns[NUMBER_OF_CDC];
+static unsigned Slot_Next;
+static uint8_t *Ctl_Rx_Buf;
+static uint8_t *Ctl_Tx_Buf;
+static uint16_t Ctl_Tx_Len;
+static uint8_t Ctl_Stall;
+
+static UART_HandleTypeDef *const Uart[3] = {&huart1, &huart2, &huart3};
+static USART_TypeDef *const Uart_Base[3] = {USART1, USART2, USART3};
+static DMA_Channel_TypeDef *const Dma_Rx_Base[3] = {DMA1_Channel5, DMA1_Channel6, DMA1_Channel3};
+static DMA_Channel_TypeDef *const Dma_Tx_Base[3] = {DMA1_Channel4, DMA1_Channel7, DMA1_Channel2};
+
+static uint32_t Sim_Random(uint32_t *seed)
+{
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 17;
+  *seed ^= *seed << 5;
+  return *seed;
+}
+
+static unsigned Sim_Index(UART_HandleTypeDef *huart)
+{
+  for (unsigned i = 0U; i < NUMBER_OF_CDC; i++)
+  {
+    if (Uart[i] == huart)
+    {
+      return i;
+    }
+  }
+  fprintf(stderr, "unknown UART handle\n");
+  exit(1);
+}
+
+static uint64_t Sim_Char_Ns(unsigned i)
+{
+  UART_HandleTypeDef *h = Uart[i];
+  uint32_t bits = 1U + ((h->Init.WordLength == UART_WORDLENGTH_9B) ? 9U : 8U) +
+                  ((h->Init.StopBits == UART_STOPBITS_2) ? 2U : 1U);
+
+  return (h->Init.BaudRate != 0U) ? ((uint64_t)bits * 1000000000ULL / h->Init.BaudRate) : 1000000ULL;
+}
+
+static void Sim_Raise(unsigned irq)
+{
+  if (Irq_Due[irq] == 0U)
+  {
+    Irq_Due[irq] = Now_Ns + Opt.irq_ns;
+  }
+}
+
+/* Status bits as the sim changes them, in the register too while the firmware runs */
+static void Sim_Sr(unsigned i, uint32_t clear, uint32_t set)
+{
+  Ch[i].sr = (Ch[i].sr & ~clear) | set;
+  Uart_Base[i]->SR = (Uart_Base[i]->SR & ~clear) | set;
+}
+
+/* Around every entry to the firmware: SR only takes the clears it can do on
+   the chip (__HAL_UART_CLEAR_FLAG writes all the other bits as ones), DR
+   written is a character for the transmitter */
+static void Sim_Enter(void)
+{
+  for (unsigned i = 0U; i < NUMBER_OF_CDC; i++)
+  {
+    Uart_Base[i]->SR = Ch[i].sr;
+    Uart_Base[i]->DR = 0xFFFFU;
+  }
+}
+
+static void Sim_Tx_Feed(unsigned i);
+
+static void Sim_Leave(void)
+{
+  for (unsigned i = 0U; i < NUMBER_OF_CDC; i++)
+  {
+    Ch[i].sr &= ~(SIM_SR_RC_W0 & ~Uart_Base[i]->SR);
+    Uart_Base[i]->SR = Ch[i].sr;
+    if (Uart_Base[i]->DR != 0xFFFFU)
+    {
+      if (Ch[i].dr_full != 0U)
+      {
+        fprintf(stderr, "channel %u: DR written while full\n", i);
+        exit(1);
+      }
+      Ch[i].dr = (uint8_t)Uart_Base[i]->DR;
+      Ch[i].dr_full = 1U;
+      Sim_Sr(i, USART_SR_TC | USART_SR_TXE, 0U);
+    }
+    Sim_Tx_Feed(i);
+  }
+}
+
+/* HAL and BSP parts the firmware calls ---------------------------------------*/
+
+void Error_Handler(void)
+{
+  fprintf(stderr, "Error_Handler at %.3f ms\n", (double)Now_Ns / 1e6);
+  exit(1);
+}
+
+uint32_t TIM2_Micros(void)
+{
+  return (uint32_t)(Now_Ns / 1000U);
+}
+
+void TIM2_Start_Timeout(uint8_t timeout_index, uint32_t us)
+{
+  Timeout_Ns[timeout_index] = Now_Ns + (uint64_t)us * 1000U;
+}
+
+void TIM2_Stop_Timeout(uint8_t timeout_index)
+{
+  Timeout_Ns[timeout_index] = 0U;
+}
+
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init)
+{
+  (void)GPIOx;
+  (void)GPIO_Init;
+}
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+  (void)GPIOx;
+  (void)GPIO_Pin;
+  /* Modem inputs at their pulled, deasserted level */
+  return GPIO_PIN_SET;
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState)
+{
+  (void)GPIOx;
+  (void)GPIO_Pin;
+  (void)PinState;
+}
+
+void HAL_NVIC_DisableIRQ(IRQn_Type IRQn)
+{
+  /* The firmware only runs one entry at a time here */
+  (void)IRQn;
+}
+
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn)
+{
+  (void)IRQn;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void)
+{
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock(void)
+{
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data)
+{
+  (void)TypeProgram;
+  /* NOR flash, bits only go from 1 to 0 */
+  *(volatile uint16_t *)(uintptr_t)Address &= (uint16_t)Data;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError)
+{
+  memset((void *)(uintptr_t)pEraseInit->PageAddress, 0xFF, pEraseInit->NbPages * FLASH_PAGE_SIZE);
+  *PageError = 0xFFFFFFFFU;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart)
+{
+  unsigned i = Sim_Index(huart);
+
+  huart->Instance->CR1 = USART_CR1_UE | USART_CR1_TE | USART_CR1_RE;
+  huart->Instance->CR3 = 0U;
+  Sim_Sr(i, ~0U, USART_SR_TC | USART_SR_TXE);
+  huart->gState = HAL_UART_STATE_READY;
+  huart->RxState = HAL_UART_STATE_READY;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_MultiProcessor_Init(UART_HandleTypeDef *huart, uint8_t Address, uint32_t WakeUpMethod)
+{
+  (void)Address;
+  (void)WakeUpMethod;
+  return HAL_UART_Init(huart);
+}
+
+HAL_StatusTypeDef HAL_MultiProcessor_EnterMuteMode(UART_HandleTypeDef *huart)
+{
+  (void)huart;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_DeInit(UART_HandleTypeDef *huart)
+{
+  unsigned i = Sim_Index(huart);
+
+  huart->Instance->CR1 = 0U;
+  huart->Instance->CR3 = 0U;
+  huart->hdmarx->Instance->CCR = 0U;
+  huart->hdmatx->Instance->CCR = 0U;
+  huart->gState = HAL_UART_STATE_RESET;
+  huart->RxState = HAL_UART_STATE_RESET;
+  Ch[i].tx_left = 0U;
+  Ch[i].tx_it_pending = 0U;
+  Ch[i].rx_half = 0U;
+  Ch[i].rx_full = 0U;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+  huart->pRxBuffPtr = pData;
+  huart->RxXferSize = Size;
+  huart->RxState = HAL_UART_STATE_BUSY_RX;
+  huart->hdmarx->Instance->CNDTR = Size;
+  huart->hdmarx->Instance->CCR = DMA_CCR_EN | DMA_CCR_CIRC;
+  SET_BIT(huart->Instance->CR1, USART_CR1_PEIE);
+  SET_BIT(huart->Instance->CR3, USART_CR3_EIE | USART_CR3_DMAR);
+  return HAL_OK;
+}
+
+/* What UART_DMATransmitCplt does: TC interrupt, then the callback */
+static void Sim_Dma_Tx_Cplt(DMA_HandleTypeDef *hdma)
+{
+  UART_HandleTypeDef *huart = (UART_HandleTypeDef *)hdma->Parent;
+
+  huart->TxXferCount = 0U;
+  CLEAR_BIT(huart->Instance->CR3, USART_CR3_DMAT);
+  SET_BIT(huart->Instance->CR1, USART_CR1_TCIE);
+}
+
+HAL_StatusTypeDef HAL_DMA_Start_IT(DMA_HandleTypeDef *hdma, uint32_t SrcAddress, uint32_t DstAddress, uint32_t DataLength)
+{
+  unsigned i = Sim_Index((UART_HandleTypeDef *)hdma->Parent);
+
+  (void)DstAddress;
+  Ch[i].tx_src = (const uint8_t *)(uintptr_t)SrcAddress;
+  Ch[i].tx_left = DataLength;
+  hdma->Instance->CNDTR = DataLength;
+  hdma->Instance->CCR |= DMA_CCR_EN;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+  unsigned i = Sim_Index(huart);
+
+  if (huart->gState != HAL_UART_STATE_READY)
+  {
+    return HAL_BUSY;
+  }
+  huart->pTxBuffPtr = pData;
+  huart->TxXferSize = Size;
+  huart->TxXferCount = Size;
+  huart->gState = HAL_UART_STATE_BUSY_TX;
+  huart->hdmatx->XferCpltCallback = Sim_Dma_Tx_Cplt;
+  Ch[i].tx_src = pData;
+  Ch[i].tx_left = Size;
+  huart->hdmatx->Instance->CNDTR = Size;
+  huart->hdmatx->Instance->CCR |= DMA_CCR_EN;
+  Sim_Sr(i, USART_SR_TC, 0U);
+  SET_BIT(huart->Instance->CR3, USART_CR3_DMAT);
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_IT(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+  unsigned i = Sim_Index(huart);
+
+  if ((huart->gState != HAL_UART_STATE_READY) || (Size != 1U))
+  {
+    return HAL_BUSY;
+  }
+  huart->gState = HAL_UART_STATE_BUSY_TX;
+  Ch[i].tx_it_byte = *pData;
+  Ch[i].tx_it_pending = 1U;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortTransmit(UART_HandleTypeDef *huart)
+{
+  unsigned i = Sim_Index(huart);
+
+  CLEAR_BIT(huart->Instance->CR1, USART_CR1_TXEIE | USART_CR1_TCIE);
+  CLEAR_BIT(huart->Instance->CR3, USART_CR3_DMAT);
+  huart->hdmatx->Instance->CCR &= ~DMA_CCR_EN;
+  Ch[i].tx_left = 0U;
+  Ch[i].tx_it_pending = 0U;
+  huart->gState = HAL_UART_STATE_READY;
+  return HAL_OK;
+}
+
+/* The parts of HAL_UART_IRQHandler a circular DMA reception and a DMA or
+   single byte transmission reach: the end of the transmission */
+static void Sim_HAL_UART_IRQHandler(UART_HandleTypeDef *huart)
+{
+  if (READ_BIT(huart->Instance->CR1, USART_CR1_RXNEIE) != 0U)
+  {
+    fprintf(stderr, "HAL_UART_IRQHandler entered with RXNEIE, UART_Receive_IT would take the DMA's byte\n");
+    exit(1);
+  }
+  if ((READ_BIT(huart->Instance->CR1, USART_CR1_TCIE) != 0U) && (READ_BIT(huart->Instance->SR, USART_SR_TC) != 0U))
+  {
+    CLEAR_BIT(huart->Instance->CR1, USART_CR1_TCIE);
+    huart->gState = HAL_UART_STATE_READY;
+    HAL_UART_TxCpltCallback(huart);
+  }
+}
+
+/* USB LL driver and the control endpoint of the core -------------------------*/
+
+static int Sim_Ep_Channel(uint8_t ep_addr)
+{
+  for (unsigned i = 0U; i < NUMBER_OF_CDC; i++)
+  {
+    if ((ep_addr == CDC_IN_EP_OF(i)) || (ep_addr == CDC_OUT_EP_OF(i)) || (ep_addr == CDC_CMD_EP_OF(i)))
+    {
+      return (int)i;
+    }
+  }
+  fprintf(stderr, "unknown endpoint 0x%02X\n", ep_addr);
+  exit(1);
+}
+
+USBD_StatusTypeDef USBD_LL_OpenEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t ep_type, uint16_t ep_mps)
+{
+  (void)pdev;
+  (void)ep_type;
+  if ((ep_addr & 0x80U) != 0U)
+  {
+    Pcd.IN_ep[ep_addr & 0xFU].maxpacket = ep_mps;
+  }
+  return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_CloseEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
+{
+  (void)pdev;
+  (void)ep_addr;
+  return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_Transmit(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t *pbuf, uint16_t size)
+{
+  int i;
+
+  /* The PCD takes any address here as an IN endpoint, the stock ZLP passes the number */
+  ep_addr |= 0x80U;
+  i = Sim_Ep_Channel(ep_addr);
+  (void)pdev;
+  if (ep_addr == CDC_CMD_EP_OF(i))
+  {
+    Ch[i].notify_busy = 1U;
+    return USBD_OK;
+  }
+
+  /* First packet to the PMA now, each next one once the previous is sent */
+  Ch[i].in_buf = pbuf;
+  Ch[i].in_len = size;
+  Ch[i].in_pos = 0U;
+  Ch[i].pma_len = (size < CDC_DATA_FS_IN_PACKET_SIZE) ? size : CDC_DATA_FS_IN_PACKET_SIZE;
+  memcpy(Ch[i].pma, pbuf, Ch[i].pma_len);
+  Ch[i].in_busy = 1U;
+  return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t *pbuf, uint16_t size)
+{
+  int i = Sim_Ep_Channel(ep_addr);
+
+  (void)pdev;
+  (void)size;
+  Ch[i].out_buf = pbuf;
+  Ch[i].out_armed = 1U;
+  return USBD_OK;
+}
+
+uint32_t USBD_LL_GetRxDataSize(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
+{
+  (void)pdev;
+  return Ch[Sim_Ep_Channel(ep_addr)].out_len;
+}
+
+USBD_StatusTypeDef USBD_CtlSendData(USBD_HandleTypeDef *pdev, uint8_t *pbuf, uint16_t len)
+{
+  (void)pdev;
+  Ctl_Tx_Buf = pbuf;
+  Ctl_Tx_Len = len;
+  return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_CtlPrepareRx(USBD_HandleTypeDef *pdev, uint8_t *pbuf, uint16_t len)
+{
+  (void)pdev;
+  (void)len;
+  Ctl_Rx_Buf = pbuf;
+  return USBD_OK;
+}
+
+void USBD_CtlError(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
+{
+  (void)pdev;
+  (void)req;
+  Ctl_Stall = 1U;
+}
+
+/* Simulation ------------------------------------------------------------------*/
+
+/* A control request to channel i's interface, handled as the USB interrupt does */
+static int Sim_Control(unsigned i, uint8_t type, uint8_t request, uint16_t value, const uint8_t *data, uint16_t len)
+{
+  USBD_SetupReqTypedef req = {type, request, value, (uint16_t)CDC_COMM_ITF_OF(i), len};
+
+  Ctl_Stall = 0U;
+  Ctl_Rx_Buf = NULL;
+  Sim_Enter();
+  USBD_CDC.Setup(&hUsbDeviceFS, &req);
+  if ((Ctl_Stall == 0U) && (Ctl_Rx_Buf != NULL))
+  {
+    memcpy(Ctl_Rx_Buf, data, len);
+    USBD_CDC.EP0_RxReady(&hUsbDeviceFS);
+  }
+  CDC_Apply_Settings();
+  /* Next pass of the main loop */
+  CDC_Config_Service();
+  Sim_Leave();
+  return (Ctl_Stall != 0U) ? -1 : 0;
+}
+
+/* Vendor read of a channel, bytes returned or -1 for a stall */
+static int Sim_Control_In(unsigned i, uint8_t request, uint8_t *data, uint16_t len)
+{
+  USBD_SetupReqTypedef req = {0xC1U, request, 0U, (uint16_t)CDC_COMM_ITF_OF(i), len};
+
+  Ctl_Stall = 0U;
+  Ctl_Tx_Buf = NULL;
+  Ctl_Tx_Len = 0U;
+  Sim_Enter();
+  USBD_CDC.Setup(&hUsbDeviceFS, &req);
+  Sim_Leave();
+  if ((Ctl_Stall != 0U) || (Ctl_Tx_Buf == NULL))
+  {
+    return -1;
+  }
+  memcpy(data, Ctl_Tx_Buf, MIN(Ctl_Tx_Len, len));
+  return MIN(Ctl_Tx_Len, len);
+}
+
+static void Sim_Sent_Push(Sim_Channel_TypeDef *c, uint8_t data)
+{
+  if (c->sent_len == c->sent_cap)
+  {
+    c->sent_cap = (c->sent_cap != 0U) ? (c->sent_cap * 2U) : 65536U;
+    c->sent = realloc(c->sent, c->sent_cap);
+    c->sent_us = realloc(c->sent_us, c->sent_cap * sizeof(uint32_t));
+    if ((c->sent == NULL) || (c->sent_us == NULL))
+    {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  c->sent[c->sent_len] = data;
+  c->sent_us[c->sent_len] = (uint32_t)(Now_Ns / 1000U);
+  c->sent_len++;
+}
+
+/* A character from the far end is complete on the RX pin */
+static void Sim_Rx_Char(unsigned i)
+{
+  Sim_Channel_TypeDef *c = &Ch[i];
+  UART_HandleTypeDef *h = Uart[i];
+  DMA_Channel_TypeDef *dma = h->hdmarx->Instance;
+  uint8_t data;
+
+  if (Opt.cobs != 0U)
+  {
+    data = Cobs.line[Cobs.rx_pos++];
+  }
+  else if ((Opt.xon_every != 0U) && (++c->rx_since_xon >= Opt.xon_every))
+  {
+    /* Filtered by the bridge, not for the host */
+    c->rx_since_xon = 0U;
+    data = 0x11U;
+  }
+  else
+  {
+    data = (uint8_t)Sim_Random(&c->rx_seed);
+    if ((Opt.xon_every != 0U) && ((data == 0x11U) || (data == 0x13U)))
+    {
+      /* No flow characters in the data */
+      data ^= 0x40U;
+    }
+    Sim_Sent_Push(c, data);
+  }
+
+  if ((READ_BIT(h->Instance->CR3, USART_CR3_DMAR) != 0U) && ((dma->CCR & DMA_CCR_EN) != 0U))
+  {
+    uint32_t size = h->RxXferSize;
+
+    h->pRxBuffPtr[size - dma->CNDTR] = data;
+    dma->CNDTR--;
+    if (dma->CNDTR == size / 2U)
+    {
+      c->rx_half = 1U;
+      Sim_Raise(IRQ_DMA_RX + i);
+    }
+    if (dma->CNDTR == 0U)
+    {
+      dma->CNDTR = size;
+      c->rx_full = 1U;
+      Sim_Raise(IRQ_DMA_RX + i);
+    }
+    if (READ_BIT(h->Instance->CR1, USART_CR1_RXNEIE) != 0U)
+    {
+      /* The DMA takes the byte before the interrupt gets to it */
+      Sim_Raise(IRQ_UART + i);
+    }
+  }
+  else
+  {
+    c->overrun++;
+  }
+
+  c->rx_idle_ns = Now_Ns + Sim_Char_Ns(i);
+}
+
+/* Host data written and not on the TX pin yet */
+static uint64_t Sim_Outstanding(const Sim_Channel_TypeDef *c)
+{
+  return (uint64_t)c->out_bytes + c->out_backlog - c->tx_bytes;
+}
+
+/* Move data into DR and DR into the shift register, as TXE and the DMA request allow */
+static void Sim_Tx_Feed(unsigned i)
+{
+  Sim_Channel_TypeDef *c = &Ch[i];
+  UART_HandleTypeDef *h = Uart[i];
+
+  for (;;)
+  {
+    if (c->dr_full == 0U)
+    {
+      if (c->tx_it_pending != 0U)
+      {
+        c->dr = c->tx_it_byte;
+        c->dr_full = 1U;
+        c->tx_it_pending = 0U;
+        Sim_Sr(i, USART_SR_TC, 0U);
+        SET_BIT(h->Instance->CR1, USART_CR1_TCIE);
+      }
+      else if ((c->tx_left != 0U) && (READ_BIT(h->Instance->CR3, USART_CR3_DMAT) != 0U) &&
+               ((h->hdmatx->Instance->CCR & DMA_CCR_EN) != 0U))
+      {
+        c->dr = *c->tx_src++;
+        c->dr_full = 1U;
+        c->tx_left--;
+        h->hdmatx->Instance->CNDTR = c->tx_left;
+        Sim_Sr(i, USART_SR_TC, 0U);
+        if (c->tx_left == 0U)
+        {
+          c->tx_dma_done = 1U;
+          Sim_Raise(IRQ_DMA_TX + i);
+        }
+      }
+    }
+
+    if ((c->shift_busy == 0U) && (c->dr_full != 0U))
+    {
+      if (c->idle_since_ns != 0U)
+      {
+        c->gaps++;
+        c->gap_ns += Now_Ns - c->idle_since_ns;
+        c->idle_since_ns = 0U;
+      }
+      c->shift = c->dr;
+      c->dr_full = 0U;
+      c->shift_busy = 1U;
+      c->shift_end_ns = Now_Ns + Sim_Char_Ns(i);
+      continue;
+    }
+    break;
+  }
+
+  Sim_Sr(i, (c->dr_full != 0U) ? USART_SR_TXE : 0U, (c->dr_full == 0U) ? USART_SR_TXE : 0U);
+  if ((READ_BIT(h->Instance->CR1, USART_CR1_TXEIE) != 0U) && (c->dr_full == 0U))
+  {
+    Sim_Raise(IRQ_UART + i);
+  }
+}
+
+/* The character in the shift register is out on the TX pin */
+static void Sim_Tx_Char(unsigned i)
+{
+  Sim_Channel_TypeDef *c = &Ch[i];
+  UART_HandleTypeDef *h = Uart[i];
+
+  c->shift_busy = 0U;
+  c->tx_bytes++;
+  if (Opt.cobs != 0U)
+  {
+    if ((Cobs.tx_pos >= Cobs.line_len) || (c->shift != Cobs.line[Cobs.tx_pos]))
+    {
+      Cobs.tx_bad++;
+    }
+    Cobs.tx_pos++;
+  }
+  else if (c->shift != (uint8_t)Sim_Random(&c->tx_seed))
+  {
+    c->tx_bad++;
+  }
+
+  Sim_Tx_Feed(i);
+  if (c->shift_busy == 0U)
+  {
+    Sim_Sr(i, 0U, USART_SR_TC);
+    if (Sim_Outstanding(c) != 0U)
+    {
+      c->idle_since_ns = Now_Ns;
+    }
+    if (READ_BIT(h->Instance->CR1, USART_CR1_TCIE) != 0U)
+    {
+      Sim_Raise(IRQ_UART + i);
+    }
+  }
+}
+
+/* One IN data packet at the host, checked against what the far end sent */
+static void Sim_Host_Packet(Sim_Channel_TypeDef *c, const uint8_t *data, uint32_t len)
+{
+  for (uint32_t b = 0U; b < len; b++)
+  {
+    uint32_t k;
+    size_t p;
+
+    c->rx_bytes++;
+    if ((c->pos < c->sent_len) && (c->sent[c->pos] == data[b]))
+    {
+      c->pos++;
+      continue;
+    }
+
+    /* Out of step: find where in the stream the rest of the packet is */
+    k = ((len - b) < SIM_MATCH) ? (len - b) : SIM_MATCH;
+    for (p = c->pos + 1U; (p + k) <= c->sent_len; p++)
+    {
+      if (memcmp(&c->sent[p], &data[b], k) == 0)
+      {
+        break;
+      }
+    }
+    if ((p + k) <= c->sent_len)
+    {
+      c->dropped += p - c->pos;
+      c->jumps++;
+      c->pos = p + 1U;
+    }
+    else
+    {
+      c->corrupt++;
+      c->pos++;
+    }
+  }
+}
+
+/* Bytes of a vector, "a..b" for a run */
+static size_t Sim_Cobs_Parse(const char *text, uint8_t *out)
+{
+  size_t n = 0U;
+  unsigned first;
+  unsigned last;
+  int used;
+
+  while (sscanf(text, " %x%n", &first, &used) == 1)
+  {
+    text += used;
+    last = first;
+    if (sscanf(text, "..%x%n", &last, &used) == 1)
+    {
+      text += used;
+    }
+    while ((first <= last) && (n < SIM_COBS_MAX))
+    {
+      out[n++] = (uint8_t)first++;
+    }
+  }
+  return n;
+}
+
+static void Sim_Cobs_Init(void)
+{
+  for (unsigned v = 0U; v < SIM_COBS_VECTORS; v++)
+  {
+    Cobs.packet_len[v] = Sim_Cobs_Parse(Cobs_Vectors[v].packet, Cobs.packet[v]);
+    Cobs.line_len += Sim_Cobs_Parse(Cobs_Vectors[v].encoded, &Cobs.line[Cobs.line_len]);
+    Cobs.line[Cobs.line_len++] = 0x00U;
+  }
+}
+
+/* The host's next OUT packet: every packet one transfer, a ZLP after a full last packet */
+static uint32_t Sim_Cobs_Out(uint8_t *buf)
+{
+  size_t left = Cobs.packet_len[Cobs.out_vector] - Cobs.out_pos;
+  uint32_t len = (left < CDC_DATA_FS_OUT_PACKET_SIZE) ? (uint32_t)left : CDC_DATA_FS_OUT_PACKET_SIZE;
+
+  if (Cobs.out_zlp != 0U)
+  {
+    len = 0U;
+  }
+  memcpy(buf, &Cobs.packet[Cobs.out_vector][Cobs.out_pos], len);
+  Cobs.out_pos += len;
+  Cobs.out_zlp = (Cobs.out_pos == Cobs.packet_len[Cobs.out_vector]) && (len == CDC_DATA_FS_OUT_PACKET_SIZE);
+  if ((Cobs.out_pos == Cobs.packet_len[Cobs.out_vector]) && (Cobs.out_zlp == 0U))
+  {
+    Cobs.out_vector++;
+    Cobs.out_pos = 0U;
+  }
+  return len;
+}
+
+/* One IN packet at the host, a short one ends the packet of the vector */
+static void Sim_Cobs_In(const uint8_t *data, uint32_t len)
+{
+  if ((Cobs.in_len + len) <= SIM_COBS_MAX)
+  {
+    memcpy(&Cobs.in[Cobs.in_len], data, len);
+  }
+  Cobs.in_len += len;
+  if (len == CDC_DATA_FS_IN_PACKET_SIZE)
+  {
+    return;
+  }
+
+  if ((Cobs.in_vector >= SIM_COBS_VECTORS) || (Cobs.in_len != Cobs.packet_len[Cobs.in_vector]) ||
+      (memcmp(Cobs.in, Cobs.packet[Cobs.in_vector], Cobs.in_len) != 0))
+  {
+    printf("COBS IN : vector %u read as %zu bytes, not as sent\n", Cobs.in_vector, Cobs.in_len);
+    Cobs.in_bad++;
+  }
+  Cobs.in_vector++;
+  Cobs.in_len = 0U;
+}
+
+static int Sim_Cobs_Report(void)
+{
+  printf("COBS IN : %u of %u packets read, %u wrong\n", Cobs.in_vector, (unsigned)SIM_COBS_VECTORS, Cobs.in_bad);
+  printf("COBS OUT: %zu of %zu encoded bytes on the UART, %lu wrong\n", Cobs.tx_pos, Cobs.line_len, Cobs.tx_bad);
+
+  return (Cobs.in_vector != SIM_COBS_VECTORS) || (Cobs.in_bad != 0U) || (Cobs.tx_pos != Cobs.line_len) ||
+         (Cobs.tx_bad != 0U);
+}
+
+/* URB back to cdc_acm, its bytes reach the tty now */
+static void Sim_Host_Urb_Done(Sim_Channel_TypeDef *c)
+{
+  uint32_t now_us = (uint32_t)(Now_Ns / 1000U);
+
+  for (size_t p = c->urb_start; (p < c->pos) && (p < c->sent_len); p++)
+  {
+    uint32_t bin = (now_us - c->sent_us[p]) / SIM_LATENCY_BIN_US;
+
+    c->latency[(bin < SIM_LATENCY_BINS) ? bin : (SIM_LATENCY_BINS - 1U)]++;
+    c->latency_count++;
+  }
+  c->urb_start = c->pos;
+  c->urb_fill = 0U;
+  c->urbs++;
+}
+
+static void Sim_Irq(unsigned irq)
+{
+  unsigned i;
+
+  Sim_Enter();
+  if (irq < IRQ_DMA_TX)
+  {
+    i = irq - IRQ_DMA_RX;
+    /* The HAL takes half transfer first, a pending full transfer enters again */
+    if (Ch[i].rx_half != 0U)
+    {
+      Ch[i].rx_half = 0U;
+      HAL_UART_RxHalfCpltCallback(Uart[i]);
+    }
+    else if (Ch[i].rx_full != 0U)
+    {
+      Ch[i].rx_full = 0U;
+      HAL_UART_RxCpltCallback(Uart[i]);
+    }
+    if ((Ch[i].rx_half | Ch[i].rx_full) != 0U)
+    {
+      Sim_Raise(irq);
+    }
+  }
+  else if (irq < IRQ_TIM2)
+  {
+    i = irq - IRQ_DMA_TX;
+    if (Ch[i].tx_dma_done != 0U)
+    {
+      Ch[i].tx_dma_done = 0U;
+      Uart[i]->hdmatx->Instance->CCR &= ~DMA_CCR_EN;
+      Uart[i]->hdmatx->XferCpltCallback(Uart[i]->hdmatx);
+    }
+  }
+  else if (irq == IRQ_TIM2)
+  {
+    for (i = 0U; i < NUMBER_OF_CDC; i++)
+    {
+      if ((Timeout_Ns[i] != 0U) && (Timeout_Ns[i] <= Now_Ns))
+      {
+        Timeout_Ns[i] = 0U;
+        TIM2_Timeout_Callback((uint8_t)i);
+      }
+    }
+  }
+  else if (irq == IRQ_TIM4)
+  {
+    HAL_TIM_PeriodElapsedCallback(&htim4);
+  }
+  else
+  {
+    i = irq - IRQ_UART;
+    CDC_UART_IRQHandler((uint8_t)i);
+    Sim_HAL_UART_IRQHandler(Uart[i]);
+    CDC_UART_IRQ_Done((uint8_t)i);
+    /* The SR then DR read took IDLE away */
+    Ch[i].sr &= ~USART_SR_IDLE;
+  }
+  Sim_Leave();
+}
+
+/* One bulk packet slot of the frame, round robin over the endpoints with something to move */
+static void Sim_Usb_Slot(void)
+{
+  uint8_t host_reads = (Now_Ns < Opt.pause_from_ns) || (Now_Ns >= Opt.pause_to_ns);
+
+  for (unsigned n = 0U; n < 3U * Opt.channels; n++)
+  {
+    unsigned k = (Slot_Next + n) % (3U * Opt.channels);
+    unsigned i = k / 3U;
+    Sim_Channel_TypeDef *c = &Ch[i];
+
+    if ((k % 3U == 0U) && (c->in_busy != 0U) && (host_reads != 0U))
+    {
+      uint32_t len = c->pma_len;
+
+      Slot_Next = k + 1U;
+      c->in_packets++;
+      if (len < CDC_DATA_FS_IN_PACKET_SIZE)
+      {
+        c->short_packets++;
+      }
+      if (len == 0U)
+      {
+        c->zlps++;
+      }
+      if (Opt.cobs != 0U)
+      {
+        Sim_Cobs_In(c->pma, len);
+      }
+      else
+      {
+        Sim_Host_Packet(c, c->pma, len);
+      }
+      c->urb_fill += len;
+      if ((len < CDC_DATA_FS_IN_PACKET_SIZE) || (c->urb_fill >= Opt.urb_size))
+      {
+        Sim_Host_Urb_Done(c);
+      }
+
+      c->in_pos += len;
+      if (c->in_pos < c->in_len)
+      {
+        c->pma_len = ((c->in_len - c->in_pos) < CDC_DATA_FS_IN_PACKET_SIZE) ? (c->in_len - c->in_pos)
+                                                                               : CDC_DATA_FS_IN_PACKET_SIZE;
+        memcpy(c->pma, c->in_buf + c->in_pos, c->pma_len);
+        return;
+      }
+      c->in_busy = 0U;
+      if (c->in_len != 0U)
+      {
+        c->in_transfers++;
+      }
+      Sim_Enter();
+      USBD_CDC.DataIn(&hUsbDeviceFS, CDC_IN_EP_OF(i) & 0xFU);
+      CDC_Apply_Settings();
+      Sim_Leave();
+      Cpu_Free_Ns = Now_Ns + Opt.irq_ns;
+      return;
+    }
+
+    if ((k % 3U == 1U) && (c->out_armed != 0U) && (Opt.cobs != 0U) && (Cobs.out_vector < SIM_COBS_VECTORS))
+    {
+      Slot_Next = k + 1U;
+      c->out_len = Sim_Cobs_Out(c->out_buf);
+      c->out_armed = 0U;
+      Sim_Enter();
+      USBD_CDC.DataOut(&hUsbDeviceFS, CDC_OUT_EP_OF(i));
+      CDC_Apply_Settings();
+      Sim_Leave();
+      Cpu_Free_Ns = Now_Ns + Opt.irq_ns;
+      return;
+    }
+
+    if ((k % 3U == 1U) && (c->out_armed != 0U) && (c->out_backlog != 0U))
+    {
+      uint32_t len = (c->out_backlog < CDC_DATA_FS_OUT_PACKET_SIZE) ? c->out_backlog : CDC_DATA_FS_OUT_PACKET_SIZE;
+
+      Slot_Next = k + 1U;
+      for (uint32_t b = 0U; b < len; b++)
+      {
+        c->out_buf[b] = (uint8_t)Sim_Random(&c->out_seed);
+      }
+      c->out_backlog -= len;
+      c->out_bytes += len;
+      c->out_len = len;
+      c->out_armed = 0U;
+      Sim_Enter();
+      USBD_CDC.DataOut(&hUsbDeviceFS, CDC_OUT_EP_OF(i));
+      CDC_Apply_Settings();
+      Sim_Leave();
+      Cpu_Free_Ns = Now_Ns + Opt.irq_ns;
+      return;
+    }
+
+    if ((k % 3U == 2U) && (c->notify_busy != 0U) && (host_reads != 0U))
+    {
+      Slot_Next = k + 1U;
+      c->notify_busy = 0U;
+      c->notifications++;
+      Sim_Enter();
+      USBD_CDC.DataIn(&hUsbDeviceFS, CDC_CMD_EP_OF(i) & 0xFU);
+      CDC_Apply_Settings();
+      Sim_Leave();
+      Cpu_Free_Ns = Now_Ns + Opt.irq_ns;
+      return;
+    }
+  }
+}
+
+/* The host writes its share of the line rate every millisecond, up to a tty buffer ahead */
+static void Sim_Host_Write(unsigned i)
+{
+  Sim_Channel_TypeDef *c = &Ch[i];
+  uint64_t chars_per_s = 1000000000ULL / Sim_Char_Ns(i);
+
+  c->out_credit += chars_per_s * Opt.out_percent;
+  while ((c->out_credit >= 100000U) && (c->out_backlog < SIM_OUT_WINDOW))
+  {
+    c->out_credit -= 100000U;
+    c->out_backlog++;
+  }
+  if (c->out_backlog >= SIM_OUT_WINDOW)
+  {
+    c->out_credit = 0U;
+  }
+}
+
+static void Sim_Rx_Schedule(unsigned i)
+{
+  Sim_Channel_TypeDef *c = &Ch[i];
+
+  c->rx_next_ns = Now_Ns + Sim_Char_Ns(i);
+  if ((Opt.cobs != 0U) && (Cobs.rx_pos == Cobs.line_len))
+  {
+    c->rx_next_ns = SIM_NEVER;
+  }
+  else if (Opt.burst != 0U)
+  {
+    if (c->rx_burst_left == 0U)
+    {
+      c->rx_burst_left = Opt.burst;
+      c->rx_next_ns += (uint64_t)Opt.gap_us * 1000U;
+    }
+    c->rx_burst_left--;
+  }
+}
+
+static uint32_t Sim_Percentile(const Sim_Channel_TypeDef *c, unsigned percent)
+{
+  unsigned long want = (c->latency_count * percent + 99U) / 100U;
+  unsigned long seen = 0U;
+
+  for (uint32_t b = 0U; b < SIM_LATENCY_BINS; b++)
+  {
+    seen += c->latency[b];
+    if ((seen >= want) && (seen != 0U))
+    {
+      return (b + 1U) * SIM_LATENCY_BIN_US;
+    }
+  }
+  return 0U;
+}
+
+static void Sim_Report(void)
+{
+  double seconds = (double)Opt.seconds;
+
+  printf("%u channel(s) at %u baud, %u s, IRQ latency %u ns, URB %u bytes", Opt.channels, Opt.baud,
+         Opt.seconds, Opt.irq_ns, Opt.urb_size);
+  if (Opt.burst != 0U)
+  {
+    printf(", bursts of %u after %u us gaps", Opt.burst, Opt.gap_us);
+  }
+  if (Opt.latency_ms >= 0)
+  {
+    printf(", latency timer %d ms", Opt.latency_ms);
+  }
+  printf("\n");
+
+  for (unsigned i = 0U; i < Opt.channels; i++)
+  {
+    Sim_Channel_TypeDef *c = &Ch[i];
+    double line = 1e9 / (double)Sim_Char_Ns(i);
+
+    printf("ch%u IN : %lu bytes %.0f B/s (%.1f%% of line), dropped %lu in %lu jumps, corrupt %lu, "
+           "UART overrun %lu\n",
+           i, c->rx_bytes, c->rx_bytes / seconds, 100.0 * c->rx_bytes / seconds / line, c->dropped, c->jumps,
+           c->corrupt, c->overrun);
+    printf("ch%u IN : %lu transfers %.1f bytes each, %lu packets %lu short %lu ZLP, %lu URBs, "
+           "%lu notifications\n",
+           i, c->in_transfers, (c->in_transfers != 0U) ? (double)c->rx_bytes / c->in_transfers : 0.0,
+           c->in_packets, c->short_packets, c->zlps, c->urbs, c->notifications);
+    printf("ch%u IN : latency to URB completion p50 %u us p99 %u us max %u us\n", i, Sim_Percentile(c, 50U),
+           Sim_Percentile(c, 99U), Sim_Percentile(c, 100U));
+    if (Opt.out_percent != 0U)
+    {
+      uint8_t count[4] = {0U};
+
+      /* As the host reads it */
+      if (Sim_Control_In(i, CDC_VENDOR_GET_TX_GAPS, count, sizeof(count)) != (int)sizeof(count))
+      {
+        printf("ch%u OUT: CDC_VENDOR_GET_TX_GAPS stalled\n", i);
+      }
+      printf("ch%u OUT: %lu bytes %.0f B/s (%.1f%% of line), bad %lu, line idle with data waiting %lu times "
+             "%.1f us total, Tx_Gaps %lu\n",
+             i, c->tx_bytes, c->tx_bytes / seconds, 100.0 * c->tx_bytes / seconds / line, c->tx_bad, c->gaps,
+             (double)c->gap_ns / 1000.0,
+             (unsigned long)((uint32_t)count[0] | ((uint32_t)count[1] << 8) | ((uint32_t)count[2] << 16) |
+                             ((uint32_t)count[3] << 24)));
+    }
+  }
+}
+
+static int Sim_Usage(void)
+{
+  fprintf(stderr, "usage: cdc_bench [-n channels] [-b baud] [-t seconds] [-g burst:gap_us] [-w out_percent]\n"
+                  "                 [-l latency_ms] [-u urb_size] [-p from_ms:for_ms] [-i irq_ns] [-x every] [-c]\n");
+  return 2;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long a;
+  unsigned long b;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:b:t:g:w:l:u:p:i:x:c")) != -1)
+  {
+    switch (opt)
+    {
+    case 'n':
+      Opt.channels = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'b':
+      Opt.baud = (uint32_t)strtoul(optarg, NULL, 0);
+      break;
+    case 't':
+      Opt.seconds = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'g':
+      if (sscanf(optarg, "%lu:%lu", &a, &b) != 2)
+      {
+        return Sim_Usage();
+      }
+      Opt.burst = (uint32_t)a;
+      Opt.gap_us = (uint32_t)b;
+      break;
+    case 'w':
+      Opt.out_percent = (unsigned)strtoul(optarg, NULL, 0);
+      break;
+    case 'l':
+      Opt.latency_ms = (int)strtol(optarg, NULL, 0);
+      break;
+    case 'u':
+      Opt.urb_size = (uint32_t)strtoul(optarg, NULL, 0);
+      break;
+    case 'p':
+      if (sscanf(optarg, "%lu:%lu", &a, &b) != 2)
+      {
+        return Sim_Usage();
+      }
+      Opt.pause_from_ns = (uint64_t)a * 1000000U;
+      Opt.pause_to_ns = (uint64_t)(a + b) * 1000000U;
+      break;
+    case 'i':
+      Opt.irq_ns = (uint32_t)strtoul(optarg, NULL, 0);
+      break;
+    case 'x':
+      Opt.xon_every = (uint32_t)strtoul(optarg, NULL, 0);
+      break;
+    case 'c':
+      Opt.cobs = 1U;
+      Opt.channels = 1U;
+      break;
+    default:
+      return Sim_Usage();
+    }
+  }
+  if ((Opt.channels == 0U) || (Opt.channels > NUMBER_OF_CDC) || (Opt.baud == 0U) || (Opt.seconds == 0U) ||
+      (Opt.urb_size < CDC_DATA_FS_IN_PACKET_SIZE) || (Opt.latency_ms > 255))
+  {
+    return Sim_Usage();
+  }
+
+  if ((mmap((void *)(uintptr_t)PERIPH_BASE, SIM_PERIPH_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) == MAP_FAILED) ||
+      (mmap((void *)(uintptr_t)SIM_FLASH_BASE, SIM_FLASH_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) == MAP_FAILED))
+  {
+    perror("mmap");
+    return 1;
+  }
+  memset((void *)(uintptr_t)SIM_FLASH_BASE, 0xFF, SIM_FLASH_SIZE);
+  if (Opt.cobs != 0U)
+  {
+    Sim_Cobs_Init();
+  }
+
+  for (unsigned i = 0U; i < NUMBER_OF_CDC; i++)
+  {
+    Uart[i]->Instance = Uart_Base[i];
+    Uart[i]->Init.BaudRate = 115200U;
+    Uart[i]->Init.WordLength = UART_WORDLENGTH_8B;
+    Uart[i]->Init.StopBits = UART_STOPBITS_1;
+    Uart[i]->Init.Parity = UART_PARITY_NONE;
+    Uart[i]->Init.Mode = UART_MODE_TX_RX;
+    Uart[i]->hdmarx = &Dma_Rx[i];
+    Uart[i]->hdmatx = &Dma_Tx[i];
+    Dma_Rx[i].Instance = Dma_Rx_Base[i];
+    Dma_Tx[i].Instance = Dma_Tx_Base[i];
+    Dma_Rx[i].Parent = Uart[i];
+    Dma_Tx[i].Parent = Uart[i];
+    HAL_UART_Init(Uart[i]);
+    Ch[i].rx_seed = 0x12345678U + i;
+    Ch[i].out_seed = 0x9E3779B9U + i;
+    Ch[i].tx_seed = Ch[i].out_seed;
+    Ch[i].rx_next_ns = SIM_NEVER;
+    Ch[i].rx_idle_ns = SIM_NEVER;
+  }
+
+  /* Boot as main() does, then enumerate */
+  Sim_Enter();
+  CDC_Config_Load();
+  hUsbDeviceFS.pData = &Pcd;
+  hUsbDeviceFS.dev_speed = USBD_SPEED_FULL;
+  hUsbDeviceFS.dev_state = USBD_STATE_CONFIGURED;
+  USBD_CDC_RegisterInterface(&hUsbDeviceFS, &USBD_Interface_fops_FS);
+  USBD_CDC.Init(&hUsbDeviceFS, 0U);
+  Sim_Leave();
+
+  for (unsigned i = 0U; i < Opt.channels; i++)
+  {
+    uint8_t coding[7] = {(uint8_t)Opt.baud, (uint8_t)(Opt.baud >> 8), (uint8_t)(Opt.baud >> 16),
+                         (uint8_t)(Opt.baud >> 24), 0U, 0U, 8U};
+
+    if ((Sim_Control(i, 0x21U, CDC_SET_LINE_CODING, 0U, coding, sizeof(coding)) != 0) ||
+        (Sim_Control(i, 0x21U, CDC_SET_CONTROL_LINE_STATE, 0x3U, NULL, 0U) != 0) ||
+        ((Opt.latency_ms >= 0) &&
+         (Sim_Control(i, 0x41U, CDC_VENDOR_SET_LATENCY, (uint16_t)Opt.latency_ms, NULL, 0U) != 0)) ||
+        ((Opt.xon_every != 0U) &&
+         (Sim_Control(i, 0x41U, CDC_VENDOR_SET_FLOW_CONTROL, CDC_FLOW_CONTROL_XON_XOFF, NULL, 0U) != 0)) ||
+        ((Opt.cobs != 0U) && (Sim_Control(i, 0x41U, CDC_VENDOR_SET_PACKET, CDC_PACKET_COBS, NULL, 0U) != 0)))
+    {
+      fprintf(stderr, "channel %u: control request stalled\n", i);
+      return 1;
+    }
+    Sim_Rx_Schedule(i);
+  }
+
+  for (uint64_t end = (uint64_t)Opt.seconds * 1000000000ULL; Now_Ns < end;)
+  {
+    uint64_t next = end;
+    uint64_t tick = (Now_Ns / 1000000U + 1U) * 1000000U;
+    uint64_t slot = (Now_Ns / SIM_SLOT_NS + 1U) * SIM_SLOT_NS;
+    uint64_t irq_next = SIM_NEVER;
+
+    /* Earliest event, interrupts wait for the CPU and go in NVIC order */
+    for (unsigned n = 0U; n < IRQ_COUNT; n++)
+    {
+      if ((Irq_Due[n] != 0U) && (Irq_Due[n] < irq_next))
+      {
+        irq_next = Irq_Due[n];
+      }
+    }
+    if ((irq_next != SIM_NEVER) && (irq_next < Cpu_Free_Ns))
+    {
+      irq_next = Cpu_Free_Ns;
+    }
+    next = (tick < next) ? tick : next;
+    next = (slot < next) ? slot : next;
+    next = (irq_next < next) ? irq_next : next;
+    for (unsigned i = 0U; i < Opt.channels; i++)
+    {
+      next = (Ch[i].rx_next_ns < next) ? Ch[i].rx_next_ns : next;
+      next = (Ch[i].rx_idle_ns < next) ? Ch[i].rx_idle_ns : next;
+      next = ((Ch[i].shift_busy != 0U) && (Ch[i].shift_end_ns < next)) ? Ch[i].shift_end_ns : next;
+      next = ((Timeout_Ns[i] != 0U) && (Timeout_Ns[i] < next)) ? Timeout_Ns[i] : next;
+    }
+    Now_Ns = next;
+
+    for (unsigned i = 0U; i < Opt.channels; i++)
+    {
+      if (Ch[i].rx_next_ns == Now_Ns)
+      {
+        Sim_Rx_Char(i);
+        Sim_Rx_Schedule(i);
+      }
+      if ((Ch[i].rx_idle_ns == Now_Ns) && (Ch[i].rx_next_ns > Now_Ns))
+      {
+        Ch[i].rx_idle_ns = SIM_NEVER;
+        Ch[i].sr |= USART_SR_IDLE;
+        if (READ_BIT(Uart[i]->Instance->CR1, USART_CR1_IDLEIE) != 0U)
+        {
+          Sim_Raise(IRQ_UART + i);
+        }
+      }
+      if ((Ch[i].shift_busy != 0U) && (Ch[i].shift_end_ns == Now_Ns))
+      {
+        Sim_Tx_Char(i);
+      }
+      if ((Timeout_Ns[i] != 0U) && (Timeout_Ns[i] <= Now_Ns))
+      {
+        Sim_Raise(IRQ_TIM2);
+      }
+    }
+    if (Now_Ns == tick)
+    {
+      for (unsigned i = 0U; (i < Opt.channels) && (Opt.out_percent != 0U); i++)
+      {
+        Sim_Host_Write(i);
+      }
+      Sim_Raise(IRQ_TIM4);
+    }
+    if ((Now_Ns == slot) && (Cpu_Free_Ns <= Now_Ns))
+    {
+      Sim_Usb_Slot();
+    }
+    if (Cpu_Free_Ns <= Now_Ns)
+    {
+      for (unsigned irq = 0U; irq < IRQ_COUNT; irq++)
+      {
+        if ((Irq_Due[irq] != 0U) && (Irq_Due[irq] <= Now_Ns))
+        {
+          Irq_Due[irq] = 0U;
+          Sim_Irq(irq);
+          Cpu_Free_Ns = Now_Ns + Opt.irq_ns;
+          break;
+        }
+      }
+    }
+  }
+
+  if (Opt.cobs != 0U)
+  {
+    return Sim_Cobs_Report();
+  }
+  Sim_Report();
+  return 0;
+}
@@ -0,0 +1,152 @@
+/**
+  ******************************************************************************
+  * @file    libusb.h
+  * @brief   The part of the libusb-1.0 API the host tools use, served by
+  *          usb_sim.c instead of a device. Same names, types and values as
+  *          libusb.h, so cdc_muxd builds unchanged against either. Only the
+  *          asynchronous transfers.
+  ******************************************************************************
+  */
+
+#ifndef __SIM_LIBUSB_H
+#define __SIM_LIBUSB_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#define LIBUSB_CALL
+
+typedef struct libusb_context libusb_context;
+typedef struct libusb_device_handle libusb_device_handle;
+
+enum libusb_error
+{
+  LIBUSB_SUCCESS = 0,
+  LIBUSB_ERROR_IO = -1,
+  LIBUSB_ERROR_INVALID_PARAM = -2,
+  LIBUSB_ERROR_ACCESS = -3,
+  LIBUSB_ERROR_NO_DEVICE = -4,
+  LIBUSB_ERROR_NOT_FOUND = -5,
+  LIBUSB_ERROR_BUSY = -6,
+  LIBUSB_ERROR_TIMEOUT = -7,
+  LIBUSB_ERROR_OVERFLOW = -8,
+  LIBUSB_ERROR_PIPE = -9,
+  LIBUSB_ERROR_INTERRUPTED = -10,
+  LIBUSB_ERROR_NO_MEM = -11,
+  LIBUSB_ERROR_NOT_SUPPORTED = -12,
+  LIBUSB_ERROR_OTHER = -99
+};
+
+enum libusb_endpoint_direction
+{
+  LIBUSB_ENDPOINT_OUT = 0x00,
+  LIBUSB_ENDPOINT_IN = 0x80
+};
+
+enum libusb_request_type
+{
+  LIBUSB_REQUEST_TYPE_STANDARD = (0x00 << 5),
+  LIBUSB_REQUEST_TYPE_CLASS = (0x01 << 5),
+  LIBUSB_REQUEST_TYPE_VENDOR = (0x02 << 5),
+  LIBUSB_REQUEST_TYPE_RESERVED = (0x03 << 5)
+};
+
+enum libusb_request_recipient
+{
+  LIBUSB_RECIPIENT_DEVICE = 0x00,
+  LIBUSB_RECIPIENT_INTERFACE = 0x01,
+  LIBUSB_RECIPIENT_ENDPOINT = 0x02,
+  LIBUSB_RECIPIENT_OTHER = 0x03
+};
+
+enum libusb_transfer_type
+{
+  LIBUSB_TRANSFER_TYPE_CONTROL = 0,
+  LIBUSB_TRANSFER_TYPE_ISOCHRONOUS = 1,
+  LIBUSB_TRANSFER_TYPE_BULK = 2,
+  LIBUSB_TRANSFER_TYPE_INTERRUPT = 3
+};
+
+enum libusb_transfer_status
+{
+  LIBUSB_TRANSFER_COMPLETED,
+  LIBUSB_TRANSFER_ERROR,
+  LIBUSB_TRANSFER_TIMED_OUT,
+  LIBUSB_TRANSFER_CANCELLED,
+  LIBUSB_TRANSFER_STALL,
+  LIBUSB_TRANSFER_NO_DEVICE,
+  LIBUSB_TRANSFER_OVERFLOW
+};
+
+struct libusb_transfer;
+
+typedef void (LIBUSB_CALL *libusb_transfer_cb_fn)(struct libusb_transfer *transfer);
+
+struct libusb_transfer
+{
+  libusb_device_handle *dev_handle;
+  uint8_t flags;
+  unsigned char endpoint;
+  unsigned char type;
+  unsigned int timeout;
+  enum libusb_transfer_status status;
+  int length;
+  int actual_length;
+  libusb_transfer_cb_fn callback;
+  void *user_data;
+  unsigned char *buffer;
+  int num_iso_packets;
+};
+
+struct libusb_pollfd
+{
+  int fd;
+  short events;
+};
+
+int LIBUSB_CALL libusb_init(libusb_context **ctx);
+void LIBUSB_CALL libusb_exit(libusb_context *ctx);
+const char *LIBUSB_CALL libusb_error_name(int errcode);
+
+libusb_device_handle *LIBUSB_CALL libusb_open_device_with_vid_pid(libusb_context *ctx, uint16_t vendor_id,
+                                                                  uint16_t product_id);
+void LIBUSB_CALL libusb_close(libusb_device_handle *dev_handle);
+int LIBUSB_CALL libusb_claim_interface(libusb_device_handle *dev_handle, int interface_number);
+int LIBUSB_CALL libusb_release_interface(libusb_device_handle *dev_handle, int interface_number);
+
+int LIBUSB_CALL libusb_control_transfer(libusb_device_handle *dev_handle, uint8_t request_type, uint8_t bRequest,
+                                        uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength,
+                                        unsigned int timeout);
+
+struct libusb_transfer *LIBUSB_CALL libusb_alloc_transfer(int iso_packets);
+void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer);
+
+int LIBUSB_CALL libusb_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv, int *completed);
+const struct libusb_pollfd **LIBUSB_CALL libusb_get_pollfds(libusb_context *ctx);
+void LIBUSB_CALL libusb_free_pollfds(const struct libusb_pollfd **pollfds);
+
+static inline void libusb_fill_bulk_transfer(struct libusb_transfer *transfer, libusb_device_handle *dev_handle,
+                                             unsigned char endpoint, unsigned char *buffer, int length,
+                                             libusb_transfer_cb_fn callback, void *user_data, unsigned int timeout)
+{
+  transfer->dev_handle = dev_handle;
+  transfer->endpoint = endpoint;
+  transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
+  transfer->timeout = timeout;
+  transfer->buffer = buffer;
+  transfer->length = length;
+  transfer->user_data = user_data;
+  transfer->callback = callback;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SIM_LIBUSB_H */
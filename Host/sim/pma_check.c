@@ -0,0 +1,239 @@
+/**
+  ******************************************************************************
+  * @file    pma_check.c
+  * @brief   USB_WritePMA / USB_ReadPMA of stm32f1xx_ll_usb.c against the
+  *          byte loops they replaced, on the host. The USB block is mapped at
+  *          its real address so the driver runs unmodified; every case is
+  *          done twice, once by each implementation, from the same starting
+  *          image, and the whole packet memory (unused upper half-words
+  *          included) and the user buffer (guard bytes included) must match.
+  *
+  *          FW="-I../Core/Inc -I../Drivers/CMSIS/Include \
+  *              -I../Drivers/CMSIS/Device/ST/STM32F1xx/Include \
+  *              -I../Drivers/STM32F1xx_HAL_Driver/Inc \
+  *              -DSTM32F103xB -DUSE_HAL_DRIVER"
+  *          cc -O2 -no-pie -w -fsanitize=address,undefined -o pma_check $FW \
+  *             sim/pma_check.c ../Drivers/STM32F1xx_HAL_Driver/Src/stm32f1xx_ll_usb.c
+  *
+  *          pma_check [cases] [seed]
+  *
+  *          Lengths run 0..128 with one case in three a full 48 or 64 byte
+  *          packet, the user buffer starts 0..7 bytes past an 8 byte
+  *          boundary and the packet buffer at any even offset. The user
+  *          buffer is allocated to the last byte the old loop touched so the
+  *          sanitizer catches anything past it.
+  ******************************************************************************
+  */
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "stm32f1xx_hal.h"
+
+#define PMA_BYTES      512U                     /* packet memory of the F103 */
+#define PMA_SPAN       (PMA_BYTES * PMA_ACCESS) /* its footprint on the APB bus */
+#define MAP_BASE       (USB_BASE & ~0xFFFUL)
+#define MAP_SIZE       0x2000UL
+#define GUARD          8U
+#define GUARD_BYTE     0xA5U
+
+static uint8_t *Pma;
+static uint8_t Pma_Start[PMA_SPAN];
+static uint8_t Pma_Ref[PMA_SPAN];
+static uint32_t Seed = 1U;
+
+static uint32_t Rand(void)
+{
+  Seed = Seed * 1103515245U + 12345U;
+  return Seed >> 8;
+}
+
+/**
+  * @brief  USB_WritePMA as shipped before the word-wide copy
+  */
+static void Ref_WritePMA(USB_TypeDef *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes)
+{
+  uint32_t n = ((uint32_t)wNBytes + 1U) >> 1;
+  uint32_t BaseAddr = (uint32_t)USBx;
+  uint32_t i, temp1, temp2;
+  __IO uint16_t *pdwVal;
+  uint8_t *pBuf = pbUsrBuf;
+
+  pdwVal = (__IO uint16_t *)(BaseAddr + 0x400U + ((uint32_t)wPMABufAddr * PMA_ACCESS));
+
+  for (i = n; i != 0U; i--)
+  {
+    temp1 = *pBuf;
+    pBuf++;
+    temp2 = temp1 | ((uint16_t)((uint16_t) *pBuf << 8));
+    *pdwVal = (uint16_t)temp2;
+    pdwVal++;
+    pdwVal++;
+    pBuf++;
+  }
+}
+
+/**
+  * @brief  USB_ReadPMA as shipped before the word-wide copy
+  */
+static void Ref_ReadPMA(USB_TypeDef *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes)
+{
+  uint32_t n = (uint32_t)wNBytes >> 1;
+  uint32_t BaseAddr = (uint32_t)USBx;
+  uint32_t i, temp;
+  __IO uint16_t *pdwVal;
+  uint8_t *pBuf = pbUsrBuf;
+
+  pdwVal = (__IO uint16_t *)(BaseAddr + 0x400U + ((uint32_t)wPMABufAddr * PMA_ACCESS));
+
+  for (i = n; i != 0U; i--)
+  {
+    temp = *(__IO uint16_t *)pdwVal;
+    pdwVal++;
+    *pBuf = (uint8_t)((temp >> 0) & 0xFFU);
+    pBuf++;
+    *pBuf = (uint8_t)((temp >> 8) & 0xFFU);
+    pBuf++;
+    pdwVal++;
+  }
+
+  if ((wNBytes % 2U) != 0U)
+  {
+    temp = *pdwVal;
+    *pBuf = (uint8_t)((temp >> 0) & 0xFFU);
+  }
+}
+
+static uint16_t Case_Length(void)
+{
+  switch (Rand() % 6U)
+  {
+  case 0U:
+    return 48U;
+  case 1U:
+    return 64U;
+  default:
+    return (uint16_t)(Rand() % 129U);
+  }
+}
+
+/**
+  * @brief  One write: same source bytes, same starting packet memory
+  * @retval 0 when both leave the packet memory identical
+  */
+static int Check_Write(uint16_t len, uint32_t offset, uint16_t addr)
+{
+  /* the old loop reads one byte past an odd length */
+  size_t size = offset + len + (len & 1U);
+  uint8_t *mem = memalign(8U, size ? size : 1U);
+  uint8_t *buf = mem + offset;
+  uint32_t i;
+  int bad;
+
+  for (i = 0U; i < len + (len & 1U); i++)
+  {
+    buf[i] = (uint8_t)Rand();
+  }
+  for (i = 0U; i < PMA_SPAN; i++)
+  {
+    Pma_Start[i] = (uint8_t)Rand();
+  }
+
+  memcpy(Pma, Pma_Start, PMA_SPAN);
+  Ref_WritePMA(USB, buf, addr, len);
+  memcpy(Pma_Ref, Pma, PMA_SPAN);
+
+  memcpy(Pma, Pma_Start, PMA_SPAN);
+  USB_WritePMA(USB, buf, addr, len);
+
+  bad = memcmp(Pma, Pma_Ref, PMA_SPAN) != 0;
+  free(mem);
+  return bad;
+}
+
+/**
+  * @brief  One read: same packet memory, user buffer framed by guard bytes
+  * @retval 0 when both fill the user buffer alike, guards and packet memory
+  *         untouched
+  */
+static int Check_Read(uint16_t len, uint32_t offset, uint16_t addr)
+{
+  size_t size = offset + len + GUARD;
+  uint8_t *mem = memalign(8U, size);
+  uint8_t *ref = malloc(size);
+  uint32_t i;
+  int bad;
+
+  for (i = 0U; i < PMA_SPAN; i++)
+  {
+    Pma_Start[i] = (uint8_t)Rand();
+  }
+  memcpy(Pma, Pma_Start, PMA_SPAN);
+
+  memset(ref, GUARD_BYTE, size);
+  Ref_ReadPMA(USB, ref + offset, addr, len);
+
+  memset(mem, GUARD_BYTE, size);
+  USB_ReadPMA(USB, mem + offset, addr, len);
+
+  bad = memcmp(mem, ref, size) != 0;
+  bad |= memcmp(Pma, Pma_Start, PMA_SPAN) != 0;
+  free(ref);
+  free(mem);
+  return bad;
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t cases = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1000000U;
+  uint32_t write_bad = 0U;
+  uint32_t read_bad = 0U;
+  uint32_t n;
+
+  if (argc > 2)
+  {
+    Seed = strtoul(argv[2], NULL, 0);
+  }
+
+  if (mmap((void *)MAP_BASE, MAP_SIZE, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != (void *)MAP_BASE)
+  {
+    perror("mmap USB block");
+    return 2;
+  }
+  Pma = (uint8_t *)(USB_BASE + 0x400U);
+
+  for (n = 0U; n < cases; n++)
+  {
+    uint16_t len = Case_Length();
+    uint32_t offset = Rand() % 8U;
+    /* even packet address, room for the last half-word an odd length writes */
+    uint16_t addr = (uint16_t)((Rand() % ((PMA_BYTES - len - (len & 1U)) / 2U + 1U)) * 2U);
+
+    if (Check_Write(len, offset, addr))
+    {
+      if (write_bad++ < 10U)
+      {
+        printf("write mismatch: len %u buffer+%u pma 0x%03x\n", len, offset, addr);
+      }
+    }
+
+    len = Case_Length();
+    offset = Rand() % 8U;
+    addr = (uint16_t)((Rand() % ((PMA_BYTES - len - (len & 1U)) / 2U + 1U)) * 2U);
+
+    if (Check_Read(len, offset, addr))
+    {
+      if (read_bad++ < 10U)
+      {
+        printf("read mismatch: len %u buffer+%u pma 0x%03x\n", len, offset, addr);
+      }
+    }
+  }
+
+  printf("%u cases: %u write, %u read mismatches\n", cases, write_bad, read_bad);
+  return (write_bad || read_bad) ? 1 : 0;
+}
@@ -0,0 +1,628 @@
+/**
+  ******************************************************************************
+  * @file    usb_sim.c
+  * @brief   Simulated multiplexed device behind the libusb API of libusb.h:
+  *          the firmware's own usbd_cdc.c (CDC_MUX build) on an emulated full
+  *          speed bus, every channel's UART looped back TX to RX at its line
+  *          coding. cdc_muxd linked with it runs without a board.
+  *
+  *          FW="-I../Core/Inc -I../Custom_CDC -I../Custom_CDC/Class/CDC/Inc \
+  *              -I../Custom_CDC/Core/Inc -I../Drivers/CMSIS/Include \
+  *              -I../Drivers/CMSIS/Device/ST/STM32F1xx/Include \
+  *              -I../Drivers/STM32F1xx_HAL_Driver/Inc \
+  *              -DSTM32F103xB -DUSE_HAL_DRIVER -DCDC_MUX=1U"
+  *          cc -O2 -c -Isim $FW sim/usb_sim.c ../Custom_CDC/Class/CDC/Src/usbd_cdc.c
+  *          cc -O2 -c cdc_mux.c
+  *          c++ -std=c++17 -O2 -Isim -o cdc_muxd_sim cdc_muxd.cpp cdc_mux.o usb_sim.o usbd_cdc.o
+  *
+  *          Each 1 ms frame moves at most SIM_PACKETS_PER_FRAME bulk packets,
+  *          OUT and IN taking turns, then the UARTs shift baud / 10000 bytes.
+  *          A channel whose UART falls behind stops re-arming and the OUT
+  *          endpoint NAKs, as on the board.
+  ******************************************************************************
+  */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include "libusb.h"
+#include "usbd_cdc.h"
+#include "usbd_core.h"
+#include "usbd_ctlreq.h"
+
+#define SIM_PACKETS_PER_FRAME 19U /* full speed bulk on an otherwise idle bus */
+#define SIM_FIFO_SIZE 1024U       /* like APP_RX_DATA_SIZE and APP_TX_DATA_SIZE */
+#define SIM_QUEUE_SIZE 64U
+#define SIM_MAX_FRAMES 20U        /* frames caught up per call after a stall */
+
+#define SIM_SET_LINE_CODING 0x20U
+
+typedef struct
+{
+  struct libusb_transfer *item[SIM_QUEUE_SIZE];
+  unsigned count;
+} Sim_Queue_TypeDef;
+
+typedef struct
+{
+  uint8_t slot[CDC_DATA_FS_MAX_PACKET_SIZE]; /* OUT data of the channel */
+  uint8_t arm_due;                          /* slot handed back once the TX FIFO has room */
+  uint8_t tx[SIM_FIFO_SIZE];                /* to the UART */
+  uint32_t tx_len;
+  uint8_t rx[SIM_FIFO_SIZE];                /* from the UART, to USB */
+  uint32_t rx_len;
+  uint8_t usb[SIM_FIFO_SIZE];               /* IN transfer in progress */
+  uint32_t baud;
+  uint32_t credit;                          /* line time owed, in 1/1000 byte */
+  uint32_t gaps;                            /* CDC_VENDOR_GET_TX_GAPS */
+} Sim_Uart_TypeDef;
+
+struct libusb_device_handle
+{
+  int open;
+};
+
+static USBD_HandleTypeDef Dev;
+static struct libusb_device_handle Handle;
+static Sim_Uart_TypeDef Uart[NUMBER_OF_CDC];
+static Sim_Queue_TypeDef In_Queue;
+static Sim_Queue_TypeDef Out_Queue;
+static Sim_Queue_TypeDef Done_Queue;
+static int Timer_Fd = -1;
+static struct libusb_pollfd Timer_Pollfd;
+
+/* Device side of the bus */
+static uint8_t *Out_Ep_Buf;
+static uint8_t Out_Ep_Armed;
+static uint32_t Out_Ep_Len;
+static uint8_t In_Ep_Buf[CDC_MUX_PACKET_SIZE];
+static uint32_t In_Ep_Len;
+static uint8_t In_Ep_Busy;
+static uint8_t *Ctl_Buf;
+static uint16_t Ctl_Len;
+static uint8_t Ctl_Stall;
+
+/* LL driver and control endpoint of the core, as usbd_cdc.c calls them */
+
+USBD_StatusTypeDef USBD_LL_OpenEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t ep_type, uint16_t ep_mps)
+{
+  (void)pdev;
+  (void)ep_addr;
+  (void)ep_type;
+  (void)ep_mps;
+  return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_CloseEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
+{
+  (void)pdev;
+  (void)ep_addr;
+  return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_Transmit(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t *pbuf, uint16_t size)
+{
+  (void)pdev;
+
+  if ((ep_addr != CDC_MUX_IN_EP) || (size > CDC_MUX_PACKET_SIZE) || (In_Ep_Busy != 0U))
+  {
+    return USBD_FAIL;
+  }
+
+  memcpy(In_Ep_Buf, pbuf, size);
+  In_Ep_Len = size;
+  In_Ep_Busy = 1U;
+  return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t *pbuf, uint16_t size)
+{
+  (void)pdev;
+  (void)size;
+
+  if (ep_addr != CDC_MUX_OUT_EP)
+  {
+    return USBD_FAIL;
+  }
+
+  Out_Ep_Buf = pbuf;
+  Out_Ep_Armed = 1U;
+  return USBD_OK;
+}
+
+uint32_t USBD_LL_GetRxDataSize(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
+{
+  (void)pdev;
+  (void)ep_addr;
+  return Out_Ep_Len;
+}
+
+USBD_StatusTypeDef USBD_CtlSendData(USBD_HandleTypeDef *pdev, uint8_t *pbuf, uint16_t len)
+{
+  (void)pdev;
+  Ctl_Buf = pbuf;
+  Ctl_Len = len;
+  return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_CtlPrepareRx(USBD_HandleTypeDef *pdev, uint8_t *pbuf, uint16_t len)
+{
+  (void)pdev;
+  Ctl_Buf = pbuf;
+  Ctl_Len = len;
+  return USBD_OK;
+}
+
+void USBD_CtlError(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
+{
+  (void)pdev;
+  (void)req;
+  Ctl_Stall = 1U;
+}
+
+/* Interface of the channels: UART loopback */
+
+static void Sim_Arm(uint8_t cdc_index)
+{
+  Uart[cdc_index].arm_due = 0U;
+  USBD_CDC_SetRxBuffer(cdc_index, &Dev, Uart[cdc_index].slot);
+  USBD_CDC_ReceivePacket(cdc_index, &Dev);
+}
+
+static int8_t Sim_Init(uint8_t cdc_index)
+{
+  Uart[cdc_index].tx_len = 0U;
+  Uart[cdc_index].rx_len = 0U;
+  Uart[cdc_index].credit = 0U;
+  USBD_CDC_SetRxBuffer(cdc_index, &Dev, Uart[cdc_index].slot);
+  return USBD_OK;
+}
+
+static int8_t Sim_DeInit(uint8_t cdc_index)
+{
+  (void)cdc_index;
+  return USBD_OK;
+}
+
+static int8_t Sim_Control(uint8_t cdc_index, uint8_t cmd, uint8_t *pbuf, uint16_t length)
+{
+  if ((cmd == SIM_SET_LINE_CODING) && (length >= 4U))
+  {
+    Uart[cdc_index].baud = (uint32_t)pbuf[0] | ((uint32_t)pbuf[1] << 8) | ((uint32_t)pbuf[2] << 16) |
+                           ((uint32_t)pbuf[3] << 24);
+  }
+  else if (cmd == CDC_VENDOR_GET_TX_GAPS)
+  {
+    if (length != 4U)
+    {
+      return USBD_FAIL;
+    }
+    pbuf[0] = (uint8_t)Uart[cdc_index].gaps;
+    pbuf[1] = (uint8_t)(Uart[cdc_index].gaps >> 8);
+    pbuf[2] = (uint8_t)(Uart[cdc_index].gaps >> 16);
+    pbuf[3] = (uint8_t)(Uart[cdc_index].gaps >> 24);
+  }
+  return USBD_OK;
+}
+
+static int8_t Sim_Receive(uint8_t cdc_index, uint8_t *pbuf, uint32_t *Len)
+{
+  Sim_Uart_TypeDef *uart = &Uart[cdc_index];
+
+  memcpy(&uart->tx[uart->tx_len], pbuf, *Len);
+  uart->tx_len += *Len;
+
+  if ((SIM_FIFO_SIZE - uart->tx_len) >= CDC_DATA_FS_MAX_PACKET_SIZE)
+  {
+    Sim_Arm(cdc_index);
+  }
+  else
+  {
+    uart->arm_due = 1U;
+  }
+  return USBD_OK;
+}
+
+static USBD_CDC_ItfTypeDef Sim_Fops = {Sim_Init, Sim_DeInit, Sim_Control, Sim_Receive};
+
+/* One frame of a UART: bytes shifted out come straight back in */
+static void Sim_Uart_Frame(uint8_t cdc_index)
+{
+  Sim_Uart_TypeDef *uart = &Uart[cdc_index];
+  USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef *)Dev.pClassDataCDC[cdc_index];
+  uint32_t n;
+  uint32_t line;
+
+  uart->credit += uart->baud / 10U;
+  line = uart->credit / 1000U;
+  n = MIN(line, uart->tx_len);
+  n = MIN(n, SIM_FIFO_SIZE - uart->rx_len);
+  memcpy(&uart->rx[uart->rx_len], uart->tx, n);
+  uart->rx_len += n;
+  uart->tx_len -= n;
+  memmove(uart->tx, &uart->tx[n], uart->tx_len);
+
+  /* Ran dry mid-frame with the host still holding OUT data: the bus is
+     where data waits here, the FIFO takes every packet as it lands */
+  if ((n != 0U) && (n < line) && (uart->tx_len == 0U) && (Out_Queue.count != 0U))
+  {
+    uart->gaps++;
+  }
+
+  /* A line with nothing to send, or held by a full RX side, saves up nothing */
+  uart->credit = (uart->tx_len == 0U) ? 0U : ((uart->credit - n * 1000U) % 1000U);
+
+  if ((uart->arm_due != 0U) && ((SIM_FIFO_SIZE - uart->tx_len) >= CDC_DATA_FS_MAX_PACKET_SIZE))
+  {
+    Sim_Arm(cdc_index);
+  }
+
+  if ((hcdc != NULL) && (hcdc->TxState == 0U) && (uart->rx_len != 0U))
+  {
+    memcpy(uart->usb, uart->rx, uart->rx_len);
+    USBD_CDC_SetTxBuffer(cdc_index, &Dev, uart->usb, (uint16_t)uart->rx_len);
+    USBD_CDC_TransmitPacket(cdc_index, &Dev);
+    uart->rx_len = 0U;
+  }
+}
+
+/* Host side of the bus */
+
+static void Sim_Push(Sim_Queue_TypeDef *queue, struct libusb_transfer *transfer)
+{
+  queue->item[queue->count++] = transfer;
+}
+
+static void Sim_Pop(Sim_Queue_TypeDef *queue, unsigned index)
+{
+  queue->count--;
+  memmove(&queue->item[index], &queue->item[index + 1U], (queue->count - index) * sizeof(queue->item[0]));
+}
+
+static void Sim_Complete(Sim_Queue_TypeDef *queue, enum libusb_transfer_status status)
+{
+  struct libusb_transfer *transfer = queue->item[0];
+
+  Sim_Pop(queue, 0U);
+  transfer->status = status;
+  Sim_Push(&Done_Queue, transfer);
+}
+
+/* One OUT packet of the first OUT transfer, when the endpoint takes it */
+static int Sim_Out_Packet(void)
+{
+  struct libusb_transfer *transfer;
+
+  if ((Out_Queue.count == 0U) || (Out_Ep_Armed == 0U))
+  {
+    return 0;
+  }
+
+  transfer = Out_Queue.item[0];
+  Out_Ep_Len = (uint32_t)MIN(transfer->length - transfer->actual_length, (int)CDC_MUX_PACKET_SIZE);
+  memcpy(Out_Ep_Buf, &transfer->buffer[transfer->actual_length], Out_Ep_Len);
+  transfer->actual_length += (int)Out_Ep_Len;
+  Out_Ep_Armed = 0U;
+
+  if (transfer->actual_length == transfer->length)
+  {
+    Sim_Complete(&Out_Queue, LIBUSB_TRANSFER_COMPLETED);
+  }
+
+  USBD_CDC.DataOut(&Dev, CDC_MUX_OUT_EP);
+  return 1;
+}
+
+/* One IN packet into the first IN transfer, a short one ends it */
+static int Sim_In_Packet(void)
+{
+  struct libusb_transfer *transfer;
+
+  if ((In_Queue.count == 0U) || (In_Ep_Busy == 0U))
+  {
+    return 0;
+  }
+
+  transfer = In_Queue.item[0];
+  if ((transfer->length - transfer->actual_length) < (int)In_Ep_Len)
+  {
+    Sim_Complete(&In_Queue, LIBUSB_TRANSFER_OVERFLOW);
+    return 0;
+  }
+
+  memcpy(&transfer->buffer[transfer->actual_length], In_Ep_Buf, In_Ep_Len);
+  transfer->actual_length += (int)In_Ep_Len;
+  In_Ep_Busy = 0U;
+
+  if ((In_Ep_Len < CDC_MUX_PACKET_SIZE) || (transfer->actual_length == transfer->length))
+  {
+    Sim_Complete(&In_Queue, LIBUSB_TRANSFER_COMPLETED);
+  }
+
+  USBD_CDC.DataIn(&Dev, CDC_MUX_IN_EP & 0x7FU);
+  return 1;
+}
+
+static void Sim_Frame(void)
+{
+  unsigned budget = SIM_PACKETS_PER_FRAME;
+  int moved = 1;
+
+  for (uint8_t i = 0U; i < NUMBER_OF_CDC; i++)
+  {
+    Sim_Uart_Frame(i);
+  }
+
+  while ((budget != 0U) && (moved != 0))
+  {
+    moved = 0;
+    if (Sim_Out_Packet() != 0)
+    {
+      budget--;
+      moved = 1;
+    }
+    if ((budget != 0U) && (Sim_In_Packet() != 0))
+    {
+      budget--;
+      moved = 1;
+    }
+  }
+}
+
+/* libusb API */
+
+int libusb_init(libusb_context **ctx)
+{
+  struct itimerspec frame = {{0, 1000000}, {0, 1000000}};
+
+  if (ctx != NULL)
+  {
+    *ctx = NULL;
+  }
+
+  Timer_Fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if ((Timer_Fd < 0) || (timerfd_settime(Timer_Fd, 0, &frame, NULL) != 0))
+  {
+    return LIBUSB_ERROR_OTHER;
+  }
+
+  Timer_Pollfd.fd = Timer_Fd;
+  Timer_Pollfd.events = POLLIN;
+  return LIBUSB_SUCCESS;
+}
+
+void libusb_exit(libusb_context *ctx)
+{
+  (void)ctx;
+  close(Timer_Fd);
+  Timer_Fd = -1;
+}
+
+const char *libusb_error_name(int errcode)
+{
+  switch (errcode)
+  {
+  case LIBUSB_SUCCESS:
+    return "LIBUSB_SUCCESS";
+  case LIBUSB_ERROR_INVALID_PARAM:
+    return "LIBUSB_ERROR_INVALID_PARAM";
+  case LIBUSB_ERROR_NO_DEVICE:
+    return "LIBUSB_ERROR_NO_DEVICE";
+  case LIBUSB_ERROR_NOT_FOUND:
+    return "LIBUSB_ERROR_NOT_FOUND";
+  case LIBUSB_ERROR_BUSY:
+    return "LIBUSB_ERROR_BUSY";
+  case LIBUSB_ERROR_PIPE:
+    return "LIBUSB_ERROR_PIPE";
+  case LIBUSB_ERROR_NO_MEM:
+    return "LIBUSB_ERROR_NO_MEM";
+  default:
+    return "LIBUSB_ERROR_OTHER";
+  }
+}
+
+/* Any vid:pid finds the simulated device, already configured */
+libusb_device_handle *libusb_open_device_with_vid_pid(libusb_context *ctx, uint16_t vendor_id, uint16_t product_id)
+{
+  (void)ctx;
+  (void)vendor_id;
+  (void)product_id;
+
+  if (Handle.open != 0)
+  {
+    return NULL;
+  }
+
+  for (uint8_t i = 0U; i < NUMBER_OF_CDC; i++)
+  {
+    Uart[i].baud = 115200U;
+  }
+
+  Dev.dev_speed = USBD_SPEED_FULL;
+  Dev.dev_state = USBD_STATE_CONFIGURED;
+  USBD_CDC_RegisterInterface(&Dev, &Sim_Fops);
+  USBD_CDC.Init(&Dev, 1U);
+  Handle.open = 1;
+  return &Handle;
+}
+
+void libusb_close(libusb_device_handle *dev_handle)
+{
+  USBD_CDC.DeInit(&Dev, 1U);
+  Out_Ep_Armed = 0U;
+  In_Ep_Busy = 0U;
+  dev_handle->open = 0;
+}
+
+int libusb_claim_interface(libusb_device_handle *dev_handle, int interface_number)
+{
+  (void)dev_handle;
+  /* The mux build has interface 0 only */
+  return (interface_number == 0) ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+}
+
+int libusb_release_interface(libusb_device_handle *dev_handle, int interface_number)
+{
+  (void)dev_handle;
+  (void)interface_number;
+  return LIBUSB_SUCCESS;
+}
+
+/* Setup, data and status stage at once */
+int libusb_control_transfer(libusb_device_handle *dev_handle, uint8_t request_type, uint8_t bRequest,
+                            uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength,
+                            unsigned int timeout)
+{
+  USBD_SetupReqTypedef req = {request_type, bRequest, wValue, wIndex, wLength};
+  (void)dev_handle;
+  (void)timeout;
+
+  Ctl_Buf = NULL;
+  Ctl_Len = 0U;
+  Ctl_Stall = 0U;
+  USBD_CDC.Setup(&Dev, &req);
+
+  if (Ctl_Stall != 0U)
+  {
+    return LIBUSB_ERROR_PIPE;
+  }
+
+  if (wLength == 0U)
+  {
+    return 0;
+  }
+
+  if (Ctl_Buf == NULL)
+  {
+    return LIBUSB_ERROR_PIPE;
+  }
+
+  if ((request_type & LIBUSB_ENDPOINT_IN) != 0U)
+  {
+    memcpy(data, Ctl_Buf, MIN(Ctl_Len, wLength));
+    return MIN(Ctl_Len, wLength);
+  }
+
+  memcpy(Ctl_Buf, data, MIN(Ctl_Len, wLength));
+  USBD_CDC.EP0_RxReady(&Dev);
+  return MIN(Ctl_Len, wLength);
+}
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets)
+{
+  (void)iso_packets;
+  return calloc(1U, sizeof(struct libusb_transfer));
+}
+
+void libusb_free_transfer(struct libusb_transfer *transfer)
+{
+  free(transfer);
+}
+
+int libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+  Sim_Queue_TypeDef *queue;
+
+  if ((transfer->dev_handle != &Handle) || (Handle.open == 0))
+  {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+
+  if (transfer->type != LIBUSB_TRANSFER_TYPE_BULK)
+  {
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+  }
+
+  if (transfer->endpoint == CDC_MUX_IN_EP)
+  {
+    queue = &In_Queue;
+  }
+  else if (transfer->endpoint == CDC_MUX_OUT_EP)
+  {
+    queue = &Out_Queue;
+  }
+  else
+  {
+    return LIBUSB_ERROR_NOT_FOUND;
+  }
+
+  if (queue->count == SIM_QUEUE_SIZE)
+  {
+    return LIBUSB_ERROR_BUSY;
+  }
+
+  transfer->actual_length = 0;
+  Sim_Push(queue, transfer);
+  return LIBUSB_SUCCESS;
+}
+
+int libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+  Sim_Queue_TypeDef *queue = (transfer->endpoint == CDC_MUX_IN_EP) ? &In_Queue : &Out_Queue;
+
+  for (unsigned i = 0U; i < queue->count; i++)
+  {
+    if (queue->item[i] == transfer)
+    {
+      Sim_Pop(queue, i);
+      transfer->status = LIBUSB_TRANSFER_CANCELLED;
+      Sim_Push(&Done_Queue, transfer);
+      return LIBUSB_SUCCESS;
+    }
+  }
+  return LIBUSB_ERROR_NOT_FOUND;
+}
+
+/* Runs the frames due since the last call, then the completion callbacks */
+int libusb_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv, int *completed)
+{
+  uint64_t frames = 0U;
+  (void)ctx;
+  (void)completed;
+
+  if ((Done_Queue.count == 0U) && (tv != NULL) && ((tv->tv_sec != 0) || (tv->tv_usec != 0)))
+  {
+    struct pollfd fd = {Timer_Fd, POLLIN, 0};
+
+    poll(&fd, 1U, (int)(tv->tv_sec * 1000 + tv->tv_usec / 1000));
+  }
+
+  if ((read(Timer_Fd, &frames, sizeof(frames)) < 0) && (errno != EAGAIN))
+  {
+    return LIBUSB_ERROR_IO;
+  }
+
+  for (uint64_t i = 0U; i < MIN(frames, SIM_MAX_FRAMES); i++)
+  {
+    Sim_Frame();
+  }
+
+  while (Done_Queue.count != 0U)
+  {
+    struct libusb_transfer *transfer = Done_Queue.item[0];
+
+    Sim_Pop(&Done_Queue, 0U);
+    transfer->callback(transfer);
+  }
+  return LIBUSB_SUCCESS;
+}
+
+const struct libusb_pollfd **libusb_get_pollfds(libusb_context *ctx)
+{
+  const struct libusb_pollfd **list = calloc(2U, sizeof(*list));
+  (void)ctx;
+
+  if (list != NULL)
+  {
+    list[0] = &Timer_Pollfd;
+  }
+  return list;
+}
+
+void libusb_free_pollfds(const struct libusb_pollfd **pollfds)
+{
+  free((void *)pollfds);
+}